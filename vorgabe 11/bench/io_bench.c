@@ -0,0 +1,67 @@
+/*
+ * Image I/O benchmark.
+ *
+ * Creates an image, then times a full fs_load, a full fs_dump and an
+ * incremental fs_flush of every fourth data block, once with pread/pwrite
+ * and once with io_uring (if the kernel allows it) at the given queue depth.
+ * The image is rewritten before each run, so reads are mostly served from
+ * the page cache while writes include the fsync.
+ *
+ * Usage: io_bench [blocks] [queue depth] [image path]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/filesystem.h"
+#include "../lib/flush.h"
+#include "../lib/imageio.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, enum fs_io_backend backend, int depth,
+                uint32_t blocks, const char *path)
+{
+	fs_io_configure(backend, depth);
+	if (backend == FS_IO_URING && fs_io_backend() != FS_IO_URING) {
+		printf("backend=%s unavailable\n", name);
+		return;
+	}
+
+	cleanup(fs_create(path, blocks));
+
+	double t0 = now();
+	file_system *fs = fs_load(path);
+	double t1 = now();
+	fs_dump(fs, path);
+	double t2 = now();
+	for (uint32_t b = 0; b < blocks; b += 4) {
+		memset(fs->data_blocks[b].block, (int)b, BLOCK_SIZE);
+		fs_mark_block(fs, b);
+	}
+	double t3 = now();
+	fs_flush(fs);
+	double t4 = now();
+	cleanup(fs);
+
+	printf("backend=%s depth=%d blocks=%u load_ms=%.1f dump_ms=%.1f flush_ms=%.1f\n",
+	       name, depth, blocks, (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t4 - t3) * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t blocks = argc > 1 ? (uint32_t)atol(argv[1]) : 65536;
+	int depth = argc > 2 ? atoi(argv[2]) : FS_IO_DEFAULT_DEPTH;
+	const char *path = argc > 3 ? argv[3] : "build/io_bench.fs";
+
+	run("sync", FS_IO_PSYNC, depth, blocks, path);
+	run("uring", FS_IO_URING, depth, blocks, path);
+	return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Multi-threaded lookup benchmark.
+ *
+ * Builds a three level tree (12 x 12 directories, 12 files each) and lets
+ * every thread resolve random paths with fs_readf / fs_list (99:1).
+ * Compiled once per synchronisation mode, see `make bench_lookup`.
+ *
+ * Usage: lookup_bench [threads] [ops per thread]
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../lib/filesystem.h"
+#include "../lib/operations.h"
+
+#define FANOUT DIRECT_BLOCKS_COUNT
+
+#ifdef FS_RCU
+	#define MODE "rcu"
+#else
+	#define MODE "locked"
+#endif
+
+static file_system *fs;
+static long ops_per_thread = 200000;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *reader(void *arg)
+{
+	unsigned int seed = (unsigned int)(uintptr_t)arg;
+	char path[64];
+	long found = 0;
+
+	for (long i = 0; i < ops_per_thread; i++) {
+		int a = rand_r(&seed) % FANOUT, b = rand_r(&seed) % FANOUT;
+		if (i % 100 == 0) {
+			snprintf(path, sizeof(path), "/d%d/d%d", a, b);
+			char *out = fs_list(fs, path);
+			found += out != NULL;
+			free(out);
+		} else {
+			int size = 0;
+			snprintf(path, sizeof(path), "/d%d/d%d/f%d", a, b, rand_r(&seed) % FANOUT);
+			free(fs_readf(fs, path, &size));
+			found += size;
+		}
+	}
+	return (void *)found;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	if (argc > 2) ops_per_thread = atol(argv[2]);
+
+	fs = fs_create("build/lookup_bench.fs", 2048);
+	char path[64];
+	for (int a = 0; a < FANOUT; a++) {
+		snprintf(path, sizeof(path), "/d%d", a);
+		fs_mkdir(fs, path);
+		for (int b = 0; b < FANOUT; b++) {
+			snprintf(path, sizeof(path), "/d%d/d%d", a, b);
+			fs_mkdir(fs, path);
+			for (int c = 0; c < FANOUT; c++) {
+				snprintf(path, sizeof(path), "/d%d/d%d/f%d", a, b, c);
+				fs_mkfile(fs, path);
+			}
+		}
+	}
+
+	pthread_t tids[threads];
+	double start = now();
+	for (int t = 0; t < threads; t++) {
+		pthread_create(&tids[t], NULL, reader, (void *)(uintptr_t)(t + 1));
+	}
+	for (int t = 0; t < threads; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	double elapsed = now() - start;
+
+	long total = ops_per_thread * threads;
+	printf("mode=%s threads=%d ops=%ld time=%.3fs ops/s=%.0f\n",
+	       MODE, threads, total, elapsed, total / elapsed);
+
+	cleanup(fs);
+	return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * Microbenchmark of the operations in operations.h plus fs_load / fs_dump.
+ *
+ * For every image size it creates a fresh image and times each call of
+ * mkdir, mkfile, writef, readf, stat, list, cp, mv, rm, export, import, dump
+ * and load on their own. Directories form a tree of fanout 4 below /b, every
+ * directory gets 4 files; one quarter of the image is used so there is
+ * room for the copies. The results go to stdout as one JSON document
+ * (throughput and latency percentiles per operation and image size) that
+ * can be compared across versions.
+ *
+ * Usage: ops_bench [blocks ...] (default 1024 16384 262144 1048576)
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/filesystem.h"
+#include "../lib/operations.h"
+
+#define FANOUT 4
+#define IO_OPS 2000 //export / import go through the host filesystem
+#define IMAGE_OPS 3 //dump / load handle the whole image
+#define IMAGE "build/ops_bench.fs"
+#define EXTERNAL "build/ops_bench.tmp"
+
+#ifdef FS_RCU
+	#define MODE "rcu"
+#else
+	#define MODE "locked"
+#endif
+
+#ifndef BENCH_VERSION
+	#define BENCH_VERSION "unknown"
+#endif
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Latencies of one operation
+typedef struct _samples {
+	uint64_t *ns;
+	long n;
+	long failed;
+} samples;
+
+#define TIMED(s, call) do { \
+		uint64_t t_ = now_ns(); \
+		int ok_ = (call); \
+		(s)->ns[(s)->n++] = now_ns() - t_; \
+		(s)->failed += !ok_; \
+	} while (0)
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int first_result = 1;
+
+// Prints one JSON record and resets s
+static void report(uint32_t blocks, const char *op, samples *s)
+{
+	if (s->n == 0) return;
+	uint64_t total = 0;
+	for (long i = 0; i < s->n; i++) total += s->ns[i];
+	qsort(s->ns, s->n, sizeof(uint64_t), cmp_u64);
+
+	printf("%s\n    {\"blocks\": %u, \"op\": \"%s\", \"ops\": %ld, \"failed\": %ld, \"ops_per_s\": %.0f, "
+	       "\"mean_ns\": %.0f, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+	       first_result ? "" : ",", blocks, op, s->n, s->failed, s->n / (total / 1e9), (double)total / s->n,
+	       (unsigned long long)s->ns[s->n / 2], (unsigned long long)s->ns[s->n * 90 / 100],
+	       (unsigned long long)s->ns[s->n * 99 / 100], (unsigned long long)s->ns[s->n - 1]);
+	fflush(stdout);
+	first_result = 0;
+	s->n = 0;
+	s->failed = 0;
+}
+
+// Path of directory k, the children of k are FANOUT * k + 1 .. FANOUT * k + FANOUT
+static char *dir_path(char *buf, long k)
+{
+	int slots[64];
+	int depth = 0;
+	for (; k > 0; k = (k - 1) / FANOUT) slots[depth++] = (int)((k - 1) % FANOUT);
+
+	char *p = buf + sprintf(buf, "/b");
+	while (depth-- > 0) p += sprintf(p, "/d%d", slots[depth]);
+	return p;
+}
+
+// Path of the entry called prefix<j % FANOUT> in directory j / FANOUT
+static char *entry_path(char *buf, const char *prefix, long j)
+{
+	char *p = dir_path(buf, j / FANOUT);
+	sprintf(p, "/%s%ld", prefix, j % FANOUT);
+	return buf;
+}
+
+static void bench_image(uint32_t blocks)
+{
+	long files = blocks / 4;
+	long dirs = (files + FANOUT - 1) / FANOUT;
+	long io_ops = files < IO_OPS ? files : IO_OPS;
+	char a[256], b[256];
+	samples s = { .ns = malloc((files + 1) * sizeof(uint64_t)) };
+	if (s.ns == NULL) {
+		perror("Malloc error");
+		exit(1);
+	}
+
+	file_system *fs = fs_create(IMAGE, blocks);
+	if (fs == NULL) exit(1);
+
+	for (long k = 0; k < dirs; k++) {
+		dir_path(a, k);
+		TIMED(&s, fs_mkdir(fs, a) == 0);
+	}
+	report(blocks, "mkdir", &s);
+
+	for (long j = 0; j < files; j++) {
+		entry_path(a, "f", j);
+		TIMED(&s, fs_mkfile(fs, a) == 0);
+	}
+	report(blocks, "mkfile", &s);
+
+	// 200 bytes, so every file ends up with one block
+	char text[201];
+	memset(text, 'x', 200);
+	text[200] = '\0';
+	for (long j = 0; j < files; j++) {
+		entry_path(a, "f", j);
+		TIMED(&s, fs_writef(fs, a, text) == 200);
+	}
+	report(blocks, "writef", &s);
+
+	for (long j = 0; j < files; j++) {
+		int size = 0;
+		uint8_t *data;
+		entry_path(a, "f", j);
+		TIMED(&s, (data = fs_readf(fs, a, &size)) != NULL);
+		free(data);
+	}
+	report(blocks, "readf", &s);
+
+	for (long j = 0; j < files; j++) {
+		fs_stat_info st;
+		entry_path(a, "f", j);
+		TIMED(&s, fs_stat(fs, a, &st) == 0);
+	}
+	report(blocks, "stat", &s);
+
+	for (long k = 0; k < dirs; k++) {
+		char *out;
+		dir_path(a, k);
+		TIMED(&s, (out = fs_list(fs, a)) != NULL);
+		free(out);
+	}
+	report(blocks, "list", &s);
+
+	for (long j = 0; j < files; j++) {
+		entry_path(a, "f", j);
+		entry_path(b, "c", j);
+		TIMED(&s, fs_cp(fs, a, b) == 0);
+	}
+	report(blocks, "cp", &s);
+
+	for (long j = 0; j < files; j++) {
+		entry_path(a, "c", j);
+		entry_path(b, "m", j);
+		TIMED(&s, fs_mv(fs, a, b) == 0);
+	}
+	report(blocks, "mv", &s);
+
+	for (long j = 0; j < files; j++) {
+		entry_path(a, "m", j);
+		TIMED(&s, fs_rm(fs, a) == 0);
+	}
+	report(blocks, "rm", &s);
+
+	for (long j = 0; j < io_ops; j++) {
+		entry_path(a, "f", j);
+		TIMED(&s, fs_export(fs, a, EXTERNAL) == 0);
+	}
+	report(blocks, "export", &s);
+
+	for (long j = 0; j < io_ops; j++) {
+		entry_path(a, "f", j);
+		TIMED(&s, fs_import(fs, a, EXTERNAL) == 0);
+	}
+	report(blocks, "import", &s);
+	remove(EXTERNAL);
+
+	for (int i = 0; i < IMAGE_OPS; i++) {
+		TIMED(&s, fs_dump(fs, IMAGE) == 0);
+	}
+	report(blocks, "dump", &s);
+	cleanup(fs);
+
+	for (int i = 0; i < IMAGE_OPS; i++) {
+		file_system *loaded;
+		TIMED(&s, (loaded = fs_load(IMAGE)) != NULL);
+		if (loaded) cleanup(loaded);
+	}
+	report(blocks, "load", &s);
+	remove(IMAGE);
+
+	free(s.ns);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t defaults[] = { 1024, 16384, 262144, 1048576 };
+	int count = argc > 1 ? argc - 1 : (int)(sizeof(defaults) / sizeof(defaults[0]));
+
+	printf("{\"bench\": \"ops\", \"version\": \"%s\", \"sync\": \"%s\", \"results\": [", BENCH_VERSION, MODE);
+	for (int i = 0; i < count; i++) {
+		uint32_t blocks = argc > 1 ? (uint32_t)strtoul(argv[i + 1], NULL, 10) : defaults[i];
+		if (blocks < 16) {
+			fprintf(stderr, "images need at least 16 blocks\n");
+			return 1;
+		}
+		bench_image(blocks);
+	}
+	printf("\n]}\n");
+	return 0;
+}
@@ -0,0 +1,367 @@
+/*
+ * Trace replay benchmark.
+ *
+ * A trace is a text file with one command per line in the syntax of the ha2
+ * prompt (mkdir, mkfile, writef, readf, list, stat, du, cp, mv, ln, rm,
+ * import, export, dump), see bench/tracegen.c for synthetic ones. The
+ * replayer parses the whole trace first, then runs it against the image
+ * and times every command.
+ *
+ * With several threads the lines are split by the first component of their
+ * path, so everything below /x keeps its order and runs in one thread while
+ * different top level directories run in parallel.
+ *
+ * At the end it prints a JSON document with the overall throughput, a log2
+ * latency histogram per command (percentiles are bucket upper bounds) and
+ * how fragmented the free space and the files are. The image itself is only
+ * written if the trace says dump.
+ *
+ * Usage: replay <image> <trace> [threads]
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/alloc.h"
+#include "../lib/filesystem.h"
+#include "../lib/operations.h"
+#include "../lib/reclaim.h"
+
+#define BUCKETS 40 //latency histogram, bucket i counts [2^i, 2^(i+1)) ns
+
+enum command {
+	CMD_MKDIR, CMD_MKFILE, CMD_WRITEF, CMD_READF, CMD_LIST, CMD_STAT, CMD_DU, CMD_CP,
+	CMD_MV, CMD_LN, CMD_RM, CMD_IMPORT, CMD_EXPORT, CMD_DUMP, CMD_COUNT
+};
+
+static const char *names[CMD_COUNT] = {
+	"mkdir", "mkfile", "writef", "readf", "list", "stat", "du", "cp",
+	"mv", "ln", "rm", "import", "export", "dump"
+};
+
+typedef struct _trace_op {
+	enum command cmd;
+	int flag; //list -l, rm -d
+	char *arg0, *arg1; //point into line
+	char *line;
+} trace_op;
+
+// Per thread results, merged at the end
+typedef struct _stats {
+	uint64_t count[CMD_COUNT];
+	uint64_t failed[CMD_COUNT];
+	uint64_t total_ns[CMD_COUNT];
+	uint64_t hist[CMD_COUNT][BUCKETS];
+} stats;
+
+typedef struct _worker {
+	pthread_t thread;
+	trace_op **ops; //this thread's share of the trace, in trace order
+	size_t n, cap;
+	stats st;
+} worker;
+
+static file_system *fs;
+static const char *image;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Same tokenizer as the ha2 prompt
+static char *next_token(char **cursor)
+{
+	char *p = *cursor;
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+	if (*p == '\0') {
+		*cursor = p;
+		return NULL;
+	}
+	char *start = p;
+	while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+	if (*p != '\0') *p++ = '\0';
+	*cursor = p;
+	return start;
+}
+
+static char *rest_of_line(char **cursor)
+{
+	char *p = *cursor;
+	*cursor = p + strlen(p);
+	return *p != '\0' ? p : NULL;
+}
+
+// Parses line (modified in place), returns 0 or -1 for an unknown command
+static int parse(char *line, trace_op *op)
+{
+	char *cursor = line;
+	char *command = next_token(&cursor);
+	if (command == NULL) return -1;
+
+	int cmd = 0;
+	while (cmd < CMD_COUNT && strcmp(command, names[cmd]) != 0) cmd++;
+	if (cmd == CMD_COUNT) return -1;
+
+	op->cmd = cmd;
+	op->flag = 0;
+	op->arg0 = next_token(&cursor);
+	if (op->arg0 && ((cmd == CMD_LIST && !strcmp(op->arg0, "-l")) || (cmd == CMD_RM && !strcmp(op->arg0, "-d")))) {
+		op->flag = 1;
+		op->arg0 = next_token(&cursor);
+	}
+	op->arg1 = cmd == CMD_WRITEF || cmd == CMD_IMPORT || cmd == CMD_EXPORT ? rest_of_line(&cursor)
+	                                                                          : next_token(&cursor);
+	return 0;
+}
+
+// Runs one command, returns 1 if it succeeded
+static int execute(trace_op *op)
+{
+	char *a = op->arg0, *b = op->arg1;
+
+	switch (op->cmd) {
+	case CMD_MKDIR:
+		return fs_mkdir(fs, a) == 0;
+	case CMD_MKFILE:
+		return fs_mkfile(fs, a) == 0;
+	case CMD_WRITEF:
+		return b == NULL || fs_writef(fs, a, b) >= 0;
+	case CMD_READF: {
+		int size = 0;
+		uint8_t *data = fs_readf(fs, a, &size);
+		free(data);
+		return data != NULL || fs_lookup(fs, a, NULL) >= 0;
+	}
+	case CMD_LIST: {
+		if (op->flag) {
+			fs_dir dir;
+			if (fs_opendir(fs, a, &dir) != 0) return 0;
+			while (fs_readdir(&dir) != NULL) {}
+			fs_closedir(&dir);
+			return 1;
+		}
+		char *out = fs_list(fs, a);
+		free(out);
+		return out != NULL;
+	}
+	case CMD_STAT: {
+		fs_stat_info st;
+		return fs_stat(fs, a, &st) == 0;
+	}
+	case CMD_DU: {
+		fs_stat_info st;
+		fs_track_sizes(fs);
+		return fs_stat(fs, a, &st) == 0;
+	}
+	case CMD_CP:
+		return fs_cp(fs, a, b) == 0;
+	case CMD_MV:
+		return fs_mv(fs, a, b) == 0;
+	case CMD_LN:
+		return fs_link(fs, a, b) == 0;
+	case CMD_RM:
+		return (op->flag ? fs_rm_deferred(fs, a) : fs_rm(fs, a)) == 0;
+	case CMD_IMPORT:
+		return fs_import(fs, a, b) == 0;
+	case CMD_EXPORT:
+		return fs_export(fs, a, b) == 0;
+	case CMD_DUMP:
+		return fs_dump(fs, image) == 0;
+	default:
+		return 0;
+	}
+}
+
+static void *replay(void *arg)
+{
+	worker *w = arg;
+
+	for (size_t i = 0; i < w->n; i++) {
+		trace_op *op = w->ops[i];
+		uint64_t t = now_ns();
+		int ok = execute(op);
+		uint64_t ns = now_ns() - t;
+
+		int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+		w->st.count[op->cmd]++;
+		w->st.failed[op->cmd] += !ok;
+		w->st.total_ns[op->cmd] += ns;
+		w->st.hist[op->cmd][bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+	}
+	return NULL;
+}
+
+// Picks the thread for op by its first path component
+static size_t partition(trace_op *op, int threads)
+{
+	const char *p = op->arg0 ? op->arg0 : "";
+	while (*p == '/') p++;
+	uint32_t h = 2166136261u;
+	for (; *p && *p != '/'; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+	return h % (uint32_t)threads;
+}
+
+// Upper end of the bucket that holds the q quantile of hist
+static uint64_t percentile(const uint64_t *hist, uint64_t count, double q)
+{
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > 0 && seen >= q * count) return 2ull << i;
+	}
+	return 2ull << (BUCKETS - 1);
+}
+
+static void report_fragmentation(void)
+{
+	uint32_t n = fs->s_block->num_blocks;
+	uint64_t free_blocks = 0, runs = 0, largest = 0, run = 0;
+	for (uint32_t b = 0; b < n; b++) {
+		if (fs->free_list[b]) {
+			free_blocks++;
+			if (run++ == 0) runs++;
+			if (run > largest) largest = run;
+		} else {
+			run = 0;
+		}
+	}
+
+	// a file is fragmented if its blocks are not consecutive
+	uint64_t files = 0, fragmented = 0, extents = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		if (fs->inodes[i].n_type != reg_file) continue;
+		int last = -2, used = 0, split = 0;
+		for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+			int b = fs->inodes[i].direct_blocks[k];
+			if (b == -1) continue;
+			if (b != last + 1) extents++;
+			if (used && b != last + 1) split = 1;
+			last = b;
+			used = 1;
+		}
+		files++;
+		fragmented += split;
+	}
+
+	printf("  \"fragmentation\": {\"blocks\": %u, \"free_blocks\": %llu, \"free_runs\": %llu, "
+	       "\"largest_free_run\": %llu, \"free_space_fragmentation\": %.4f, \"files\": %llu, "
+	       "\"fragmented_files\": %llu, \"extents_per_file\": %.3f}\n",
+	       n, (unsigned long long)free_blocks, (unsigned long long)runs, (unsigned long long)largest,
+	       free_blocks ? 1.0 - (double)largest / free_blocks : 0.0, (unsigned long long)files,
+	       (unsigned long long)fragmented, files ? (double)extents / files : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <image> <trace> [threads]\n", argv[0]);
+		return 1;
+	}
+	image = argv[1];
+	int threads = argc > 3 ? atoi(argv[3]) : 1;
+	if (threads < 1) threads = 1;
+
+	FILE *trace = fopen(argv[2], "r");
+	if (trace == NULL) {
+		perror("Could not open trace");
+		return 1;
+	}
+	trace_op *ops = NULL;
+	size_t n = 0, cap = 0, skipped = 0;
+	char *line = NULL;
+	size_t line_cap = 0;
+	while (getline(&line, &line_cap, trace) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			ops = realloc(ops, cap * sizeof(trace_op));
+			if (ops == NULL) {
+				perror("Realloc error");
+				return 1;
+			}
+		}
+		char *copy = strdup(line);
+		if (copy == NULL || parse(copy, &ops[n]) != 0) {
+			free(copy);
+			skipped++;
+			continue;
+		}
+		ops[n++].line = copy;
+	}
+	free(line);
+	fclose(trace);
+
+	worker *workers = calloc(threads, sizeof(worker));
+	if (workers == NULL) {
+		perror("Calloc error");
+		return 1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		worker *w = &workers[threads > 1 ? partition(&ops[i], threads) : 0];
+		if (w->n == w->cap) {
+			w->cap = w->cap ? w->cap * 2 : 1024;
+			w->ops = realloc(w->ops, w->cap * sizeof(trace_op *));
+			if (w->ops == NULL) {
+				perror("Realloc error");
+				return 1;
+			}
+		}
+		w->ops[w->n++] = &ops[i];
+	}
+
+	fs = fs_load(image);
+	if (fs == NULL) return 1;
+
+	uint64_t start = now_ns();
+	for (int t = 0; t < threads; t++) pthread_create(&workers[t].thread, NULL, replay, &workers[t]);
+	for (int t = 0; t < threads; t++) pthread_join(workers[t].thread, NULL);
+	uint64_t elapsed = now_ns() - start;
+
+	stats all = { 0 };
+	for (int t = 0; t < threads; t++) {
+		for (int c = 0; c < CMD_COUNT; c++) {
+			all.count[c] += workers[t].st.count[c];
+			all.failed[c] += workers[t].st.failed[c];
+			all.total_ns[c] += workers[t].st.total_ns[c];
+			for (int b = 0; b < BUCKETS; b++) all.hist[c][b] += workers[t].st.hist[c][b];
+		}
+	}
+
+	printf("{\"bench\": \"replay\", \"trace\": \"%s\", \"threads\": %d, \"ops\": %zu, \"skipped_lines\": %zu, "
+	       "\"seconds\": %.3f, \"ops_per_s\": %.0f,\n  \"commands\": [",
+	       argv[2], threads, n, skipped, elapsed / 1e9, n / (elapsed / 1e9));
+	int first = 1;
+	for (int c = 0; c < CMD_COUNT; c++) {
+		if (all.count[c] == 0) continue;
+		printf("%s\n    {\"op\": \"%s\", \"ops\": %llu, \"failed\": %llu, \"mean_ns\": %.0f, \"p50_ns\": %llu, "
+		       "\"p99_ns\": %llu, \"histogram_log2_ns\": [",
+		       first ? "" : ",", names[c], (unsigned long long)all.count[c], (unsigned long long)all.failed[c],
+		       (double)all.total_ns[c] / all.count[c],
+		       (unsigned long long)percentile(all.hist[c], all.count[c], 0.5),
+		       (unsigned long long)percentile(all.hist[c], all.count[c], 0.99));
+		int last = BUCKETS - 1;
+		while (last > 0 && all.hist[c][last] == 0) last--;
+		for (int b = 0; b <= last; b++) printf("%s%llu", b ? ", " : "", (unsigned long long)all.hist[c][b]);
+		printf("]}");
+		first = 0;
+	}
+	printf("\n  ],\n");
+
+	fs_reclaim_drain(fs);
+	fs_alloc_drain(fs);
+	report_fragmentation();
+	printf("}\n");
+
+	cleanup(fs);
+	for (int t = 0; t < threads; t++) free(workers[t].ops);
+	free(workers);
+	for (size_t i = 0; i < n; i++) free(ops[i].line);
+	free(ops);
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Recursive delete benchmark.
+ *
+ * Builds a tree of four directory levels (fanout 12, directories are limited
+ * to 12 entries) with `files` small files in every leaf directory, about
+ * 105k entries with the default of 4, and times one fs_rm of its root. Then
+ * builds it again and times fs_rm_deferred (the unlink the caller waits for)
+ * and the reclaim that follows.
+ *
+ * Usage: rm_bench [files per leaf directory]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../lib/filesystem.h"
+#include "../lib/operations.h"
+#include "../lib/reclaim.h"
+
+#define FANOUT 12
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void build_tree(file_system *fs, int files)
+{
+	char path[64];
+	fs_mkdir(fs, "/t");
+	for (int a = 0; a < FANOUT; a++) {
+		snprintf(path, sizeof(path), "/t/%d", a);
+		fs_mkdir(fs, path);
+		for (int b = 0; b < FANOUT; b++) {
+			snprintf(path, sizeof(path), "/t/%d/%d", a, b);
+			fs_mkdir(fs, path);
+			for (int c = 0; c < FANOUT; c++) {
+				snprintf(path, sizeof(path), "/t/%d/%d/%d", a, b, c);
+				fs_mkdir(fs, path);
+				for (int d = 0; d < FANOUT; d++) {
+					snprintf(path, sizeof(path), "/t/%d/%d/%d/%d", a, b, c, d);
+					fs_mkdir(fs, path);
+					for (int f = 0; f < files; f++) {
+						snprintf(path, sizeof(path), "/t/%d/%d/%d/%d/f%d", a, b, c, d, f);
+						fs_mkfile(fs, path);
+						fs_writef(fs, path, "data");
+					}
+				}
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int files = argc > 1 ? atoi(argv[1]) : 4;
+	if (files < 0 || files > FANOUT) {
+		fprintf(stderr, "files per leaf directory must be 0..%d\n", FANOUT);
+		return 1;
+	}
+
+	long dirs = FANOUT + FANOUT * FANOUT + FANOUT * FANOUT * FANOUT + (long)FANOUT * FANOUT * FANOUT * FANOUT;
+	long leaves = (long)FANOUT * FANOUT * FANOUT * FANOUT;
+	long entries = 1 + dirs + leaves * files;
+	file_system *fs = fs_create("build/rm_bench.fs", (uint32_t)(entries + entries / 8));
+	if (fs == NULL) return 1;
+
+	double t0 = now();
+	build_tree(fs, files);
+	double t1 = now();
+	uint32_t free_before = fs->s_block->free_blocks;
+	int ret = fs_rm(fs, "/t");
+	double t2 = now();
+
+	printf("entries=%ld build_ms=%.1f rm_ms=%.2f rm_ns_per_entry=%.1f ret=%d freed_blocks=%u\n",
+	       entries, (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t2 - t1) * 1e9 / entries, ret,
+	       fs->s_block->free_blocks - free_before);
+
+	build_tree(fs, files);
+	double t3 = now();
+	ret = fs_rm_deferred(fs, "/t");
+	double t4 = now();
+	fs_reclaim_drain(fs);
+	double t5 = now();
+	printf("deferred: unlink_us=%.1f reclaim_ms=%.2f ret=%d\n", (t4 - t3) * 1e6, (t5 - t4) * 1e3, ret);
+	cleanup(fs);
+	return 0;
+}
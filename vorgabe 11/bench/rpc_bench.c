@@ -0,0 +1,140 @@
+/*
+ * Load generator for `ha2 --serve`.
+ *
+ * Every client thread gets its own connection and directory with a few
+ * files and keeps `depth` requests in flight: 80% readf, 10% stat and 10%
+ * writef. Prints throughput and the latency percentiles of all requests.
+ *
+ * Usage: rpc_bench <socket> [clients] [ops per client] [pipeline depth]
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../lib/client.h"
+
+#define FILES 8
+
+static const char *socket_path;
+static long ops_per_client = 100000;
+static int depth = 16;
+
+typedef struct _client_result {
+	int id;
+	double *latencies;
+	long done;
+} client_result;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void send_op(fs_client *c, unsigned int *seed, char (*files)[32])
+{
+	int r = rand_r(seed) % 10;
+	char *path = files[rand_r(seed) % FILES];
+	if (r == 0) {
+		fs_client_send(c, RPC_WRITEF, path, "x");
+	} else if (r == 1) {
+		fs_client_send(c, RPC_STAT, path, NULL);
+	} else {
+		fs_client_send(c, RPC_READF, path, NULL);
+	}
+}
+
+static void *client(void *arg)
+{
+	client_result *res = arg;
+	fs_client *c = fs_client_connect(socket_path);
+	if (c == NULL) {
+		perror("connect");
+		return NULL;
+	}
+
+	// "/c" and "/f" followed by an int fit
+	char dir[16], files[FILES][32];
+	snprintf(dir, sizeof(dir), "/c%d", res->id);
+	fs_client_call(c, RPC_MKDIR, dir, NULL, NULL, NULL);
+	for (int i = 0; i < FILES; i++) {
+		snprintf(files[i], sizeof(files[i]), "%s/f%d", dir, i);
+		fs_client_call(c, RPC_MKFILE, files[i], NULL, NULL, NULL);
+		fs_client_call(c, RPC_WRITEF, files[i], "hello world", NULL, NULL);
+	}
+
+	// responses come back in order, so send times form a ring of depth entries
+	double sent[depth];
+	unsigned int seed = (unsigned int)res->id + 1;
+	long issued = 0;
+	for (; issued < depth && issued < ops_per_client; issued++) {
+		sent[issued % depth] = now();
+		send_op(c, &seed, files);
+	}
+	while (res->done < issued) {
+		rpc_response_header h;
+		if (fs_client_recv(c, &h, NULL) != 0) break;
+		res->latencies[res->done] = now() - sent[res->done % depth];
+		res->done++;
+		if (issued < ops_per_client) {
+			sent[issued % depth] = now();
+			send_op(c, &seed, files);
+			issued++;
+		}
+	}
+	fs_client_close(c);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <socket> [clients] [ops per client] [pipeline depth]\n", argv[0]);
+		return 1;
+	}
+	socket_path = argv[1];
+	int clients = argc > 2 ? atoi(argv[2]) : 4;
+	if (argc > 3) ops_per_client = atol(argv[3]);
+	if (argc > 4) depth = atoi(argv[4]);
+	if (clients < 1 || clients > 12 || depth < 1) {
+		fprintf(stderr, "clients must be 1..12 (directory fanout), depth > 0\n");
+		return 1;
+	}
+
+	pthread_t threads[clients];
+	client_result results[clients];
+	double start = now();
+	for (int i = 0; i < clients; i++) {
+		results[i].id = i;
+		results[i].done = 0;
+		results[i].latencies = malloc(ops_per_client * sizeof(double));
+		pthread_create(&threads[i], NULL, client, &results[i]);
+	}
+	for (int i = 0; i < clients; i++) pthread_join(threads[i], NULL);
+	double elapsed = now() - start;
+
+	long total = 0;
+	for (int i = 0; i < clients; i++) total += results[i].done;
+	double *all = malloc((total ? total : 1) * sizeof(double));
+	long n = 0;
+	for (int i = 0; i < clients; i++) {
+		for (long j = 0; j < results[i].done; j++) all[n++] = results[i].latencies[j];
+		free(results[i].latencies);
+	}
+	qsort(all, n, sizeof(double), cmp_double);
+
+	printf("clients=%d depth=%d ops=%ld ops/s=%.0f p50_us=%.1f p99_us=%.1f\n",
+	       clients, depth, total, total / elapsed,
+	       n ? all[n / 2] * 1e6 : 0.0, n ? all[(long)(n * 0.99)] * 1e6 : 0.0);
+	free(all);
+	return 0;
+}
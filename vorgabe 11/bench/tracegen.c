@@ -0,0 +1,266 @@
+/*
+ * Synthetic traces for bench/replay.c, written to stdout.
+ *
+ * fileserver: reads dominate; files of 1-4 KB are created, appended to,
+ * copied, renamed and removed in a growing directory tree.
+ * logappend: a few log files per client get short lines appended; a log
+ * that is nearly full is rotated (rm log.1, mv log log.1, mkfile log).
+ *
+ * Every client works below its own top level directory /c<k>, so replay
+ * can run clients in parallel. The generator keeps a model of the tree and
+ * only emits commands that succeed on an empty image that is large enough.
+ *
+ * Usage: tracegen <fileserver|logappend> [ops] [clients] [seed]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/filesystem.h"
+
+#define PATH_LEN 256
+#define MAX_FILE (DIRECT_BLOCKS_COUNT * BLOCK_SIZE)
+#define MAX_DEPTH 5
+#define LOGS 4
+#define ROTATE_AT (MAX_FILE - 1024)
+
+typedef struct _gen_dir {
+	char path[PATH_LEN];
+	int entries;
+	int depth;
+} gen_dir;
+
+typedef struct _gen_file {
+	char path[PATH_LEN];
+	int dir;
+	int size;
+} gen_file;
+
+typedef struct _client {
+	gen_dir *dirs;
+	int ndirs, dir_cap;
+	gen_file *files;
+	int nfiles, file_cap;
+	int next_name;
+	int logs[LOGS]; //logappend: size of the current log, -1 before rotation created log.1
+	int rotated[LOGS];
+} client;
+
+static uint64_t rng_state;
+
+static uint32_t rnd(uint32_t n)
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (uint32_t)((rng_state * 2685821657736338717ull) >> 32) % n;
+}
+
+static void *grow(void *v, int *cap, size_t size)
+{
+	*cap = *cap ? *cap * 2 : 64;
+	v = realloc(v, *cap * size);
+	if (v == NULL) {
+		perror("Realloc error");
+		exit(1);
+	}
+	return v;
+}
+
+static void emit_text(int len)
+{
+	for (int i = 0; i < len; i++) putchar('a' + rnd(26));
+}
+
+static void writef(const char *path, int len)
+{
+	printf("writef %s ", path);
+	emit_text(len);
+	putchar('\n');
+}
+
+// Takes the result of snprintf into a path. Paths stay far below PATH_LEN
+// (MAX_DEPTH levels of short names), a cut one would make the trace wrong.
+static void check_path(int len)
+{
+	if (len < 0 || len >= PATH_LEN) {
+		fprintf(stderr, "Path too long\n");
+		exit(1);
+	}
+}
+
+static int add_dir(client *c, const char *path, int depth)
+{
+	if (c->ndirs == c->dir_cap) c->dirs = grow(c->dirs, &c->dir_cap, sizeof(gen_dir));
+	gen_dir *d = &c->dirs[c->ndirs];
+	check_path(snprintf(d->path, PATH_LEN, "%s", path));
+	d->entries = 0;
+	d->depth = depth;
+	return c->ndirs++;
+}
+
+static gen_file *add_file(client *c, int dir, const char *name, int size)
+{
+	if (c->nfiles == c->file_cap) c->files = grow(c->files, &c->file_cap, sizeof(gen_file));
+	gen_file *f = &c->files[c->nfiles++];
+	check_path(snprintf(f->path, PATH_LEN, "%s/%s", c->dirs[dir].path, name));
+	f->dir = dir;
+	f->size = size;
+	c->dirs[dir].entries++;
+	return f;
+}
+
+// A random directory with a free entry or -1
+static int dir_with_room(client *c)
+{
+	for (int tries = 0; tries < 8; tries++) {
+		int d = (int)rnd(c->ndirs);
+		if (c->dirs[d].entries < DIRECT_BLOCKS_COUNT) return d;
+	}
+	return -1;
+}
+
+// Writes len bytes in lines of at most 1000 characters
+static void fill(const char *path, int len)
+{
+	for (int off = 0; off < len; off += 1000) writef(path, len - off < 1000 ? len - off : 1000);
+}
+
+// One fileserver step, returns the number of lines emitted
+static int fileserver_step(client *c)
+{
+	char path[PATH_LEN + 16];
+	int r = (int)rnd(100);
+	if (c->nfiles == 0 && r < 58) r = 58;
+
+	if (r < 40) {
+		printf("readf %s\n", c->files[rnd(c->nfiles)].path);
+	} else if (r < 50) {
+		printf("stat %s\n", c->files[rnd(c->nfiles)].path);
+	} else if (r < 58) {
+		printf("list %s\n", c->dirs[rnd(c->ndirs)].path);
+	} else if (r < 73 || c->nfiles == 0) {
+		int d = dir_with_room(c);
+		if (d < 0) return 0;
+		char name[16];
+		snprintf(name, sizeof(name), "f%d", c->next_name++);
+		int size = 1024 + (int)rnd(3 * 1024);
+		gen_file *f = add_file(c, d, name, size);
+		printf("mkfile %s\n", f->path);
+		fill(f->path, size);
+		return 2 + (size - 1) / 1000;
+	} else if (r < 83) {
+		gen_file *f = &c->files[rnd(c->nfiles)];
+		int len = 100 + (int)rnd(900);
+		if (f->size + len > MAX_FILE) return 0;
+		f->size += len;
+		writef(f->path, len);
+	} else if (r < 88) {
+		int d = dir_with_room(c);
+		if (d < 0 || c->dirs[d].depth >= MAX_DEPTH) return 0;
+		check_path(snprintf(path, sizeof(path), "%s/d%d", c->dirs[d].path, c->next_name++));
+		c->dirs[d].entries++;
+		add_dir(c, path, c->dirs[d].depth + 1);
+		printf("mkdir %s\n", path);
+	} else if (r < 93) {
+		int i = (int)rnd(c->nfiles);
+		printf("rm %s\n", c->files[i].path);
+		c->dirs[c->files[i].dir].entries--;
+		c->files[i] = c->files[--c->nfiles];
+	} else if (r < 97) {
+		gen_file *src = &c->files[rnd(c->nfiles)];
+		if (c->dirs[src->dir].entries >= DIRECT_BLOCKS_COUNT) return 0;
+		char name[16], from[PATH_LEN];
+		snprintf(name, sizeof(name), "f%d", c->next_name++);
+		snprintf(from, sizeof(from), "%s", src->path);
+		gen_file *f = add_file(c, src->dir, name, src->size); //may move src
+		printf("cp %s %s\n", from, f->path);
+	} else {
+		gen_file *f = &c->files[rnd(c->nfiles)];
+		check_path(snprintf(path, sizeof(path), "%s/f%d", c->dirs[f->dir].path, c->next_name++));
+		printf("mv %s %s\n", f->path, path);
+		check_path(snprintf(f->path, PATH_LEN, "%s", path));
+	}
+	return 1;
+}
+
+// One logappend step, returns the number of lines emitted
+static int logappend_step(client *c, int k)
+{
+	int l = (int)rnd(LOGS);
+	int r = (int)rnd(100);
+
+	if (r < 8) {
+		printf("readf /c%d/log%d\n", k, l);
+	} else if (r < 10) {
+		printf("stat /c%d/log%d\n", k, l);
+	} else {
+		int len = 60 + (int)rnd(140);
+		if (c->logs[l] + len <= ROTATE_AT) {
+			c->logs[l] += len;
+			printf("writef /c%d/log%d ", k, l);
+			emit_text(len);
+			putchar('\n');
+			return 1;
+		}
+		int lines = 2;
+		if (c->rotated[l]) {
+			printf("rm /c%d/log%d.1\n", k, l);
+			lines++;
+		}
+		printf("mv /c%d/log%d /c%d/log%d.1\n", k, l, k, l);
+		printf("mkfile /c%d/log%d\n", k, l);
+		c->rotated[l] = 1;
+		c->logs[l] = 0;
+		return lines;
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2 || (strcmp(argv[1], "fileserver") != 0 && strcmp(argv[1], "logappend") != 0)) {
+		fprintf(stderr, "Usage: %s <fileserver|logappend> [ops] [clients] [seed]\n", argv[0]);
+		return 1;
+	}
+	int logappend = strcmp(argv[1], "logappend") == 0;
+	long ops = argc > 2 ? atol(argv[2]) : 100000;
+	int clients = argc > 3 ? atoi(argv[3]) : 4;
+	rng_state = argc > 4 ? strtoull(argv[4], NULL, 10) : 1;
+	if (rng_state == 0) rng_state = 1;
+	if (clients < 1 || clients > DIRECT_BLOCKS_COUNT) {
+		fprintf(stderr, "clients must be 1..%d (entries of the root)\n", DIRECT_BLOCKS_COUNT);
+		return 1;
+	}
+
+	client *cs = calloc(clients, sizeof(client));
+	if (cs == NULL) {
+		perror("Calloc error");
+		return 1;
+	}
+	long lines = 0;
+	for (int k = 0; k < clients; k++) {
+		char path[PATH_LEN];
+		snprintf(path, sizeof(path), "/c%d", k);
+		add_dir(&cs[k], path, 1);
+		printf("mkdir %s\n", path);
+		lines++;
+		if (logappend) {
+			for (int l = 0; l < LOGS; l++) printf("mkfile /c%d/log%d\n", k, l);
+			lines += LOGS;
+		}
+	}
+	while (lines < ops) {
+		int k = (int)rnd(clients);
+		lines += logappend ? logappend_step(&cs[k], k) : fileserver_step(&cs[k]);
+	}
+
+	for (int k = 0; k < clients; k++) {
+		free(cs[k].dirs);
+		free(cs[k].files);
+	}
+	free(cs);
+	return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../lib/concurrency.h"
+#include "../lib/filesystem.h"
+
+/*
+ * Inode and data block allocation.
+ *
+ * Scanning free_list / the inode table is done in chunks: a thread carves up
+ * to ALLOC_CHUNK free entries at once into its own cache and serves the
+ * following allocations from there without touching shared state.
+ * Threads are spread over ALLOC_SHARDS caches round robin. Entries sitting
+ * in a cache are still free on disk; they are only marked as reserved in
+ * memory and are handed back by fs_alloc_drain (dump, cleanup) or when
+ * another cache runs dry.
+ */
+
+#define ALLOC_SHARDS 16
+#define ALLOC_CHUNK 32
+
+typedef struct _alloc_cache {
+	_Alignas(CACHE_LINE) pthread_mutex_t lock;
+	int blocks[ALLOC_CHUNK];
+	int block_pos, block_count;
+	int inodes[ALLOC_CHUNK];
+	int inode_pos, inode_count;
+} alloc_cache;
+
+typedef struct fs_alloc {
+	pthread_mutex_t lock; //protects carving and the hints
+	uint8_t *block_reserved; //1 if the block sits in a cache
+	uint8_t *inode_reserved;
+	uint32_t block_hint; //where the next scan starts
+	uint32_t inode_hint;
+	alloc_cache caches[ALLOC_SHARDS];
+} fs_alloc;
+
+void fs_alloc_init(file_system *fs);
+void fs_alloc_destroy(file_system *fs);
+
+/*
+ * Returns a data block marked as used in free_list (size reset to 0)
+ * or -1 if the filesystem is full
+ */
+int fs_alloc_block(file_system *fs);
+
+/*
+ * Returns a freshly initialised inode of the given type or -1 if there is no
+ * free inode left
+ */
+int fs_alloc_inode(file_system *fs, enum node_type type);
+
+/*
+ * Marks an inode / data block as free right away. Only for entries no reader
+ * can reach anymore, everything else goes through fs_retire_inode/block.
+ */
+void fs_free_inode(file_system *fs, int i);
+void fs_free_block(file_system *fs, int b);
+
+/*
+ * Frees count consecutive inodes / blocks starting at first with one range
+ * update of free_list and the dirty bitmaps
+ */
+void fs_free_inode_range(file_system *fs, int first, int count);
+void fs_free_block_range(file_system *fs, int first, int count);
+
+/*
+ * Hands every cached entry back, so free_list, the inode table and
+ * superblock.free_blocks are exact again
+ */
+void fs_alloc_drain(file_system *fs);
+
+#endif //ALLOC_H
@@ -0,0 +1,106 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Data blocks of a lazily loaded filesystem (fs_load_lazy).
+ *
+ * fs->data_blocks is NULL then. A block is read from the image the first
+ * time it is used, into one of a bounded number of frames that are replaced
+ * with the CLOCK algorithm. Every access to a data block goes through
+ * fs_block_get / fs_block_put, which keep the frame pinned in between; for
+ * an eagerly loaded filesystem they are just &fs->data_blocks[b].
+ *
+ * A changed frame stays until the image has its content: fs_flush marks the
+ * frames it writes (fs_cache_staged) and releases them once the write is on
+ * disk (fs_cache_flushed), a dump of the image releases all of them. If
+ * every frame is pinned or changed, a changed one is written back to the
+ * image in place (not synced, as by fs_flush) and replaced. Only while every
+ * frame is pinned or a flush is being written does the cache grow past its
+ * limit, it shrinks back after the flush.
+ */
+
+#define FS_CACHE_DEFAULT_FRAMES 4096
+
+typedef struct _cache_frame {
+	data_block data;
+	int block;
+	uint32_t pins;
+	uint8_t ref; //CLOCK reference bit
+	uint8_t dirty; //changed since the image was written
+	uint8_t flushing; //being written by fs_flush
+} cache_frame;
+
+typedef struct fs_cache {
+	pthread_mutex_t lock;
+	struct fs_io *io; //the image
+	uint32_t limit; //frames kept after a flush
+	int in_flush; //between fs_cache_staged and fs_cache_flushed
+	uint32_t count;
+	uint32_t cap;
+	uint32_t hand;
+	cache_frame **frames; //separate allocations, so pinned data never moves
+	int32_t *frame_of; //per block, -1 if not cached
+} fs_cache;
+
+/*
+ * Sets up the cache of fs with up to frames frames (fs->image_path must be
+ * set and the free list loaded)
+ * @return 0 on success, -1 else
+ */
+int fs_cache_init(file_system *fs, uint32_t frames);
+void fs_cache_destroy(file_system *fs);
+
+data_block *fs_cache_get(file_system *fs, int b);
+data_block *fs_cache_new(file_system *fs, int b);
+void fs_cache_put(file_system *fs, int b, int dirty);
+
+/*
+ * Pins block b and returns its content
+ */
+static inline data_block *fs_block_get(file_system *fs, int b)
+{
+	if (fs->cache == NULL) return &fs->data_blocks[b];
+	return fs_cache_get(fs, b);
+}
+
+/*
+ * Pins block b for a new owner, its old content is not needed: a block that
+ * is not cached gets a zeroed frame instead of being read
+ */
+static inline data_block *fs_block_new(file_system *fs, int b)
+{
+	if (fs->cache == NULL) return &fs->data_blocks[b];
+	return fs_cache_new(fs, b);
+}
+
+/*
+ * Unpins block b, dirty if it was changed
+ */
+static inline void fs_block_put(file_system *fs, int b, int dirty)
+{
+	if (fs->cache != NULL) fs_cache_put(fs, b, dirty);
+}
+
+/*
+ * Called by fs_flush while holding the write lock for every block it takes
+ */
+void fs_cache_staged(file_system *fs, int b);
+
+/*
+ * Called by fs_flush once the blocks it took are written (ok) or not
+ */
+void fs_cache_flushed(file_system *fs, int ok);
+
+/*
+ * Called after the image was replaced by a dump of fs: reopens it and
+ * releases every changed frame
+ * @return 0 on success, -1 if the image can't be opened
+ */
+int fs_cache_reopen(file_system *fs);
+
+#endif //CACHE_H
@@ -0,0 +1,58 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdint.h>
+
+#include "../lib/rpc.h"
+
+/*
+ * Client side of `ha2 --serve` (see rpc.h).
+ *
+ * fs_client_send only buffers a request, so many of them can be pipelined
+ * before the responses are collected with fs_client_recv (in order).
+ * fs_client_call does both for a single request.
+ */
+
+typedef struct fs_client fs_client;
+
+/*
+ * @return a connection to the server at socket_path or NULL
+ */
+fs_client *fs_client_connect(const char *socket_path);
+
+void fs_client_close(fs_client *c);
+
+/*
+ * Queues a request, arg1 is only used by RPC_WRITEF, RPC_CP and RPC_MV
+ * @return the request id
+ */
+uint32_t fs_client_send(fs_client *c, enum rpc_op op, const char *arg0, const char *arg1);
+
+/*
+ * Writes all queued requests to the socket
+ * @return 0 on success, -1 else
+ */
+int fs_client_flush(fs_client *c);
+
+/*
+ * Waits for the next response (flushing queued requests first)
+ * @param payload receives a malloced copy of the payload (NULL if empty),
+ * may be NULL to drop it
+ * @return 0 on success, -1 if the connection broke
+ */
+int fs_client_recv(fs_client *c, rpc_response_header *h, uint8_t **payload);
+
+/*
+ * Sends one request and waits for its response
+ * @param payload, length as for fs_client_recv (both may be NULL)
+ * @return the status of the operation, -1 on connection errors as well
+ */
+int fs_client_call(fs_client *c, enum rpc_op op, const char *arg0, const char *arg1,
+                   uint8_t **payload, uint32_t *length);
+
+/*
+ * @return 0 and fills st on success, -1 if the path does not exist
+ */
+int fs_client_stat(fs_client *c, const char *path, rpc_stat *st);
+
+#endif //CLIENT_H
@@ -0,0 +1,218 @@
+#ifndef CONCURRENCY_H
+#define CONCURRENCY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Synchronisation of a file_system between threads.
+ *
+ * Default build ("locked"): one rwlock per filesystem. Readers (readf, list,
+ * export) and updaters (writef: content of one file, serialised per inode by
+ * a striped lock) share it, writers that change the tree take it exclusively.
+ *
+ * -D FS_RCU: readers take no lock and do no atomic read-modify-write at all.
+ * They announce the epoch they run in while writers publish every change
+ * with release stores and defer the reuse of removed inodes and blocks until
+ * no reader can still see them (epoch based reclamation). Updaters and
+ * writers use the rwlock as above.
+ *
+ * In both modes shared fields that readers look at without the writer's lock
+ * are read with FS_LOAD and written with FS_PUBLISH.
+ */
+
+#define FS_LOAD(x)		__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define FS_PUBLISH(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+#define CACHE_LINE 64
+#define INODE_LOCK_STRIPES 64
+
+#ifdef FS_RCU
+
+typedef struct _rcu_reader {
+	_Alignas(CACHE_LINE) uint64_t state; //(epoch << 1) | active
+	pthread_t owner;
+	uint32_t refs; //held by the filesystem and by the owning thread
+	uint8_t exited; //the owner is gone, the filesystem unlinks it
+	struct _rcu_reader *next;
+	struct _rcu_reader *thread_next; //readers of the owner in other filesystems
+} rcu_reader;
+
+typedef struct _retired {
+	int kind; //RETIRED_INODE or RETIRED_BLOCK
+	int index;
+	int count; //consecutive entries starting at index
+} retired;
+
+typedef struct _limbo_list {
+	retired *items;
+	size_t count;
+	size_t cap;
+} limbo_list;
+
+enum { RETIRED_INODE, RETIRED_BLOCK };
+
+#endif
+
+typedef struct fs_locks {
+	uint32_t id; //unique per filesystem instance, used by thread local caches
+	pthread_rwlock_t rw;
+	pthread_mutex_t inode_locks[INODE_LOCK_STRIPES];
+#ifdef FS_RCU
+	uint64_t epoch;
+	uint32_t name_seq; //odd while a name is rewritten, see fs_name_read_begin
+	pthread_mutex_t registry_lock;
+	rcu_reader *readers;
+	limbo_list limbo[3];
+#endif
+} fs_locks;
+
+/*
+ * Sets up / tears down the locks of a freshly created or loaded filesystem
+ */
+void fs_locks_init(file_system *fs);
+void fs_locks_destroy(file_system *fs);
+
+void fs_write_begin(file_system *fs);
+void fs_write_end(file_system *fs);
+
+/*
+ * Brackets changes to the content of existing files (not to the tree).
+ * Updaters run in parallel with each other and with readers; two updaters of
+ * the same inode are serialised by fs_inode_lock.
+ */
+void fs_update_begin(file_system *fs);
+void fs_update_end(file_system *fs);
+
+static inline void fs_inode_lock(file_system *fs, int i)
+{
+	pthread_mutex_lock(&fs->locks->inode_locks[i % INODE_LOCK_STRIPES]);
+}
+
+static inline void fs_inode_unlock(file_system *fs, int i)
+{
+	pthread_mutex_unlock(&fs->locks->inode_locks[i % INODE_LOCK_STRIPES]);
+}
+
+/*
+ * Hands back an inode / data block that was unlinked by a writer.
+ * It becomes free immediately in the locked build and after a grace period
+ * with -D FS_RCU. Must be called with the write lock held.
+ */
+void fs_retire_inode(file_system *fs, int i);
+void fs_retire_block(file_system *fs, int b);
+
+/*
+ * Same for count consecutive entries starting at first
+ */
+void fs_retire_inode_range(file_system *fs, int first, int count);
+void fs_retire_block_range(file_system *fs, int first, int count);
+
+/*
+ * Waits until every retired inode and block has been reclaimed.
+ * Must be called with the write lock held. No-op in the locked build.
+ */
+void fs_reclaim_all(file_system *fs);
+
+#ifdef FS_RCU
+
+typedef struct _rcu_tls {
+	uint32_t fs_id;
+	rcu_reader *reader;
+	int nesting; //read sections nest, only the outermost one is published
+} rcu_tls;
+
+extern _Thread_local rcu_tls rcu_current;
+
+rcu_reader *rcu_register_reader(file_system *fs);
+
+static inline void fs_read_begin(file_system *fs)
+{
+	if (rcu_current.nesting++ > 0) return;
+	rcu_reader *r = rcu_current.reader;
+	if (rcu_current.fs_id != fs->locks->id) r = rcu_register_reader(fs);
+
+	uint64_t e = FS_LOAD(fs->locks->epoch);
+	__atomic_store_n(&r->state, (e << 1) | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void fs_read_end(file_system *fs)
+{
+	if (--rcu_current.nesting > 0) return;
+	FS_PUBLISH(rcu_current.reader->state, 0);
+}
+
+/*
+ * fs_mv rewrites a name in place. Readers that look at names without a lock
+ * repeat that if a rename ran meanwhile (a sequence lock):
+ * do { s = fs_name_read_begin(fs); ... } while (fs_name_read_retry(fs, s));
+ */
+static inline uint32_t fs_name_read_begin(file_system *fs)
+{
+	uint32_t s;
+	while ((s = __atomic_load_n(&fs->locks->name_seq, __ATOMIC_ACQUIRE)) & 1) {}
+	return s;
+}
+
+static inline int fs_name_read_retry(file_system *fs, uint32_t s)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&fs->locks->name_seq, __ATOMIC_RELAXED) != s;
+}
+
+/*
+ * Bracket a change of a name, called with the write lock held
+ */
+static inline void fs_name_write_begin(file_system *fs)
+{
+	__atomic_store_n(&fs->locks->name_seq, fs->locks->name_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void fs_name_write_end(file_system *fs)
+{
+	FS_PUBLISH(fs->locks->name_seq, fs->locks->name_seq + 1);
+}
+
+#else
+
+static inline void fs_read_begin(file_system *fs)
+{
+	pthread_rwlock_rdlock(&fs->locks->rw);
+}
+
+static inline void fs_read_end(file_system *fs)
+{
+	pthread_rwlock_unlock(&fs->locks->rw);
+}
+
+// readers hold the lock a rename needs exclusively
+static inline uint32_t fs_name_read_begin(file_system *fs)
+{
+	(void)fs;
+	return 0;
+}
+
+static inline int fs_name_read_retry(file_system *fs, uint32_t s)
+{
+	(void)fs;
+	(void)s;
+	return 0;
+}
+
+static inline void fs_name_write_begin(file_system *fs)
+{
+	(void)fs;
+}
+
+static inline void fs_name_write_end(file_system *fs)
+{
+	(void)fs;
+}
+
+#endif
+
+#endif //CONCURRENCY_H
@@ -0,0 +1,69 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Online defragmentation and compaction.
+ *
+ * fs_defrag_step moves up to about budget data blocks / inodes with the
+ * write lock held, so other operations go on between two steps and a
+ * defragmentation can stop after any of them and continue later.
+ * - inodes: the highest used inode moves to the lowest free one until the
+ *   used ones are at the front; the parent's entry, the children's parent
+ *   links and hard links follow it.
+ * - blocks: files are visited in (the new) inode order, the blocks of each
+ *   one move to the next positions from the start of data_blocks in the
+ *   order of its direct_blocks. A block in the way is moved out to the
+ *   highest free block first. At the end every file is one contiguous run
+ *   and all free blocks are at the end.
+ * Moved entries are retired like removed ones, so lock-free readers finish
+ * on the old copy. Operations between two steps may fragment the part done
+ * already again, a later pass picks that up.
+ *
+ * Inode numbers are not stable across a step: those reported before (by
+ * fs_stat or fs_readdir) may name another entry afterwards, and a directory
+ * iterator opened before a step must be opened again.
+ *
+ * After a complete pass fs_shrink (resize.h) cuts off all free blocks.
+ */
+
+enum defrag_phase {
+	DEFRAG_INODES,
+	DEFRAG_BLOCKS,
+	DEFRAG_DONE
+};
+
+typedef struct fs_defrag_state {
+	//only touched with the write lock held
+	enum defrag_phase phase;
+	uint32_t lo, hi; //inode phase: lowest free / highest used inode candidates
+	uint32_t file; //next inode whose blocks are placed
+	uint32_t next; //where the blocks of that file go
+	uint32_t top; //blocks in the way go to the highest free block below top
+	uint64_t *owner; //(inode << 4) | slot per block, may be stale
+	int32_t *link_first; //inode phase: per file a hard link naming it, -1 if none
+	int32_t *link_next; //per hard link the next one naming the same file
+	int fresh; //owner was rebuilt during this step
+	uint64_t moved_blocks;
+	uint64_t moved_inodes;
+} fs_defrag_state;
+
+void fs_defrag_destroy(file_system *fs);
+
+/*
+ * One step of a pass (a new one starts after the last pass completed). The
+ * step completing the pass leaves fs->defrag->phase at DEFRAG_DONE.
+ * @return the number of blocks and inodes moved, -1 if memory ran out
+ */
+int fs_defrag_step(file_system *fs, int budget);
+
+/*
+ * Runs steps until the pass is complete
+ * @return blocks and inodes moved, -1 if memory ran out
+ */
+int64_t fs_defrag(file_system *fs);
+
+#endif //DEFRAG_H
@@ -13,7 +13,8 @@
 enum node_type{
 	reg_file=1,
 	directory=2,
-	free_block=3
+	free_block=3,
+	hard_link=4 //second name of a regular file, see fs_link
 };
 
 typedef struct _data_block{
@@ -23,16 +24,22 @@ typedef struct _data_block{
 
 /*
  * The direct_blocks can either point to other inode, in case this inode is a directory
- * or to data_blocks, in case this is a regular file
+ * or to data_blocks, in case this is a regular file.
+ * A hard link has its own name and parent, direct_blocks[0] is the file it
+ * names. A file whose own name was removed while links remain keeps its data
+ * with parent UNLINKED_PARENT until the last link goes.
  */
 typedef struct _inode {
 	enum node_type n_type;
 	uint16_t size;
 	char name[NAME_MAX_LENGTH];
+	uint16_t links; //hard links naming this file (fills the padding before direct_blocks)
 	int direct_blocks[DIRECT_BLOCKS_COUNT]; //Block numbers. -1 if there is no block
 	int parent; //inode number of parent
 } inode;
 
+#define UNLINKED_PARENT -2
+
 typedef struct _superblock{
 	uint32_t num_blocks;
 	uint32_t free_blocks;
@@ -42,10 +49,28 @@ typedef struct _fs{
 	superblock* s_block;
 	uint8_t * free_list; //free == 1
 	inode * inodes;	
-	data_block* data_blocks;
+	data_block* data_blocks; //NULL if loaded lazily, see fs_block_get in cache.h
 	int root_node; //inode-number of root node
+	struct fs_locks* locks; //see concurrency.h
+	struct fs_alloc* alloc; //see alloc.h
+	char* image_path; //file the filesystem was loaded from / created at
+	struct fs_journal* journal; //NULL unless journaling, see journal.h
+	struct fs_dirty* dirty; //see flush.h
+	struct fs_reclaim* reclaim; //see reclaim.h
+	uint64_t* dir_sizes; //bytes below each directory, NULL unless fs_track_sizes was called
+	struct fs_stats_shards* stats; //see stats.h
+	struct fs_defrag_state* defrag; //NULL unless a defragmentation ran, see defrag.h
+	struct fs_cache* cache; //NULL unless loaded lazily, see cache.h
 }file_system ;
 
+/*
+ * Byte offsets of the parts of an image with n blocks:
+ * superblock | free list | inodes | data blocks
+ */
+#define FREE_LIST_OFFSET(n)	((uint64_t)sizeof(superblock))
+#define INODES_OFFSET(n)	(FREE_LIST_OFFSET(n) + (uint64_t)(n))
+#define DATA_OFFSET(n)		(INODES_OFFSET(n) + (uint64_t)(n) * sizeof(inode))
+
 /**
 	* Allocates memory for a filesystem and loads an existing filesystem from a .fs-file.
 	* @param const char* path to the fs-file
@@ -53,6 +78,12 @@ typedef struct _fs{
 **/
 file_system* fs_load(const char* fs_file_path);
 
+/*
+ * fs_load that reads the superblock, free list and inodes only. Data blocks
+ * are read on first use and at most about frames of them are kept in memory.
+ */
+file_system* fs_load_lazy(const char* fs_file_path, uint32_t frames);
+
 
 /**
 	* creates a new file system file
@@ -65,12 +96,30 @@ file_system* fs_create(const char* fs_file_path, uint32_t size);
 
 /*
  * dumps the filesystem to harddrive
+ * The image is written to a temporary file that replaces file_path only once
+ * it is complete, so a crash never leaves a truncated image behind.
+ * Dumping to the image of a journaled filesystem empties its journal.
  * @param file_system* fs the filesystem to dump
  * @param const char* file_path where to put the file on the harddrive
  * @return 0 on success, -1 else
  */
 int fs_dump(file_system* fs, const char* file_path);
 
+/*
+ * fs_dump for callers that hold dirty->io_lock and the write lock and have
+ * drained the allocation caches
+ */
+int fs_dump_locked(file_system* fs, const char* file_path);
+
+struct fs_io; //see imageio.h
+
+/*
+ * Writes the image of fs into the empty file io and sizes it. Free data
+ * blocks are not written, they stay holes in a sparse file.
+ * @return 0 on success, -1 else
+ */
+int fs_write_image(file_system* fs, struct fs_io* io);
+
 
 /*
 	* Initialize an empty inode
@@ -85,11 +134,5 @@ int find_free_inode(file_system* fs);
 	* frees up memory
 */
 void cleanup(file_system* fs);
-#ifdef DEBUG
-	#define LOG_INODE(i) fprintf(stderr,"INODE\nType: %d\nName: %s\n",i.n_type,i.name);
-#else
-	#define LOG_INODE(i)	;
-
-#endif
 
 #endif //FILESYSTEM_H
@@ -0,0 +1,102 @@
+#ifndef FLUSH_H
+#define FLUSH_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+#include "../lib/journal.h"
+
+/*
+ * Incremental write back of the image.
+ *
+ * Every change marks its inode / block dirty in a bitmap. fs_flush copies the
+ * dirty entries while holding the filesystem exclusively (a memcpy, no I/O),
+ * then writes them in place into the image in as few requests as possible
+ * (imageio.h) and fsyncs. Freed data blocks are punched out of the image
+ * instead, so it stays sparse. A background flusher thread does this
+ * periodically and whenever the number of dirty entries crosses a threshold,
+ * so operations never wait for the disk.
+ */
+
+typedef struct fs_dirty {
+	uint64_t *inodes; //bitmaps, one bit per inode / block
+	uint64_t *blocks;
+	uint32_t count; //entries marked since the last flush
+	uint32_t threshold;
+	int interval_ms;
+	pthread_mutex_t io_lock; //one writer of the image at a time (flush or dump)
+	pthread_mutex_t lock; //protects the flusher state below
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	pthread_t thread;
+	int running;
+	int stop;
+	int error; //result of the last flush
+	uint64_t requested; //sync generations
+	uint64_t completed;
+} fs_dirty;
+
+void fs_dirty_init(file_system *fs);
+void fs_dirty_destroy(file_system *fs);
+
+/*
+ * Forgets all dirty marks, called once the complete image has been written
+ */
+void fs_dirty_clear(file_system *fs);
+
+void fs_dirty_mark(file_system *fs, uint64_t *map, int i);
+
+/*
+ * Marks count consecutive entries starting at first, a word at a time
+ */
+void fs_dirty_mark_range(file_system *fs, uint64_t *map, int first, int count);
+
+/*
+ * Records that inode i / block b (free_list entry and data) changed
+ */
+static inline void fs_mark_inode(file_system *fs, int i)
+{
+	fs_dirty_mark(fs, fs->dirty->inodes, i);
+	fs_journal_inode(fs, i);
+}
+
+static inline void fs_mark_block(file_system *fs, int b)
+{
+	fs_dirty_mark(fs, fs->dirty->blocks, b);
+	fs_journal_block(fs, b);
+}
+
+/*
+ * Writes all dirty entries into fs->image_path and fsyncs
+ * @return 0 on success, -1 else
+ */
+int fs_flush(file_system *fs);
+
+/*
+ * Starts the background flusher
+ * @param interval_ms flush at least this often if anything is dirty
+ * @param threshold flush early once this many entries are dirty
+ * @return 0 on success, -1 else
+ */
+int fs_flusher_start(file_system *fs, int interval_ms, uint32_t threshold);
+
+/*
+ * Asks the flusher for a flush without waiting for it (flushes directly if
+ * no flusher runs)
+ */
+void fs_flusher_wake(file_system *fs);
+
+/*
+ * Stops the flusher after a last flush
+ */
+void fs_flusher_stop(file_system *fs);
+
+/*
+ * Makes everything changed so far durable and waits for it
+ * (through the flusher if it runs)
+ * @return 0 on success, -1 else
+ */
+int fs_sync(file_system *fs);
+
+#endif //FLUSH_H
@@ -0,0 +1,75 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Consistency check of the free list, inodes and superblock.
+ *
+ * Everything is found in linear time without walking paths: threads scan
+ * ranges of the inode table once and record per block the lowest file
+ * holding it and per inode the directory listing it (atomic compare and
+ * swap), one breadth first pass from the root marks what is reachable in a
+ * bitmap, and a second parallel scan compares inodes and blocks against
+ * what was recorded. --repair then fixes everything in three sequential
+ * passes:
+ * - inodes not reachable from the root (and invalid ones) are freed, as
+ *   fs_load does with orphaned subtrees
+ * - parent links are set to the directory listing the inode, other entries
+ *   for it are dropped
+ * - a block held by several files stays with the lowest one, the free list,
+ *   file sizes, link counts and the free block count are recomputed
+ */
+
+#define FSCK_CHUNK (1 << 16) //inodes per thread at least
+
+enum fsck_problem {
+	FSCK_BAD_INODE, //unknown node type
+	FSCK_BAD_BLOCK_REF, //file block number out of range
+	FSCK_BAD_ENTRY, //directory entry out of range, free, the root or listed twice
+	FSCK_BAD_LINK, //hard link to something that is no file
+	FSCK_DOUBLE_ALLOC, //block held by more than one file
+	FSCK_FREE_IN_USE, //block held by a file but marked free
+	FSCK_ORPHAN_BLOCK, //block marked used that no file holds
+	FSCK_ORPHAN_INODE, //inode not reachable from the root
+	FSCK_MULTI_LISTED, //inode listed by more than one directory
+	FSCK_BROKEN_PARENT, //parent is not the directory listing the inode
+	FSCK_LINK_COUNT, //links differs from the hard links naming the file
+	FSCK_FILE_SIZE, //size differs from the sum of its blocks
+	FSCK_FREE_COUNT, //superblock free_blocks differs from the free list
+	FSCK_PROBLEM_COUNT
+};
+
+typedef struct fsck_report {
+	uint64_t problems[FSCK_PROBLEM_COUNT];
+	int64_t first[FSCK_PROBLEM_COUNT]; //lowest inode / block with the problem, -1 if none
+	uint32_t inodes_used;
+	uint32_t blocks_used;
+	int repaired; //1 if the image was changed
+} fsck_report;
+
+/*
+ * Checks fs and with repair fixes what was found. A loaded filesystem is
+ * held exclusively meanwhile; repairs are marked dirty but not journaled,
+ * tracked directory sizes are not recomputed.
+ * @param report filled in if not NULL
+ * @return the number of problems found, -1 if there is no root directory or
+ * memory ran out
+ */
+int fs_check(file_system *fs, int repair, fsck_report *report);
+
+/*
+ * fs_check on the image file as it is on disk (its journal is not
+ * replayed), repairs are written back like fs_dump does. A repair is refused
+ * while a non-empty journal exists, the next fs_load would replay it over
+ * the repaired image.
+ * @return as fs_check, -1 as well if the image can't be read or written or
+ * a repair is refused
+ */
+int fs_check_image(const char *path, int repair, fsck_report *report);
+
+const char *fsck_problem_name(enum fsck_problem p);
+
+#endif //FSCK_H
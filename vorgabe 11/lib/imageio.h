@@ -0,0 +1,86 @@
+#ifndef IMAGEIO_H
+#define IMAGEIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Positioned I/O on image files, used by fs_load, fs_dump and fs_flush.
+ *
+ * Requests are queued and may complete in any order until fs_io_wait: with
+ * the io_uring backend up to queue_depth of them are in flight at once, the
+ * psync backend (pread/pwrite) performs each one right away. io_uring is
+ * used only where the kernel allows it, otherwise psync is the fallback.
+ * Large requests are split into FS_IO_CHUNK sized pieces so a single region
+ * keeps the queue busy as well.
+ */
+
+#define FS_IO_CHUNK (256 * 1024)
+#define FS_IO_DEFAULT_DEPTH 32
+
+enum fs_io_backend {
+	FS_IO_PSYNC = 0,
+	FS_IO_URING = 1,
+};
+
+typedef struct fs_io fs_io;
+
+/*
+ * Sets the backend and queue depth for files opened from now on
+ * (default: FS_IO_PSYNC, FS_IO_DEFAULT_DEPTH)
+ */
+void fs_io_configure(enum fs_io_backend backend, int queue_depth);
+
+/*
+ * @return the backend files opened from now on will really use
+ */
+enum fs_io_backend fs_io_backend(void);
+
+/*
+ * Opens path with open(2) flags / mode
+ * @return NULL if the file can't be opened
+ */
+fs_io *fs_io_open(const char *path, int flags, mode_t mode);
+
+/*
+ * Queue a read / write of len bytes at file offset off. buf must stay valid
+ * (and unchanged for writes) until fs_io_wait returned. Reads past the end of
+ * the file leave zeros.
+ */
+void fs_io_read(fs_io *io, void *buf, size_t len, uint64_t off);
+void fs_io_write(fs_io *io, const void *buf, size_t len, uint64_t off);
+
+/*
+ * Waits for every queued request
+ * @return 0 if all of them succeeded, -1 else
+ */
+int fs_io_wait(fs_io *io);
+
+/*
+ * Waits for every queued request, then fdatasyncs
+ * @return 0 on success, -1 else
+ */
+int fs_io_sync(fs_io *io);
+
+/*
+ * Waits for every queued request, then sets the file size to len. What was
+ * never written reads as zeros and takes no space on disk.
+ * @return 0 on success, -1 else
+ */
+int fs_io_truncate(fs_io *io, uint64_t len);
+
+/*
+ * Deallocates len bytes at off right away (FALLOC_FL_PUNCH_HOLE), they read
+ * as zeros afterwards. Where the file system can't punch holes the bytes are
+ * left as they are.
+ */
+void fs_io_punch(fs_io *io, uint64_t off, uint64_t len);
+
+/*
+ * Waits for every queued request and closes the file
+ * @return 0 on success, -1 if any request since open failed
+ */
+int fs_io_close(fs_io *io);
+
+#endif //IMAGEIO_H
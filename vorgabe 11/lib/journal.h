@@ -0,0 +1,134 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Write-ahead journal in a sidecar file next to the image (<image>.journal).
+ *
+ * Every operation notes the inodes and blocks it changes. When it ends (still
+ * holding the filesystem lock) their current content is appended to the
+ * journal buffer as one checksummed transaction; the buffer is written and
+ * fsynced once per group of transactions. fs_load replays every complete
+ * transaction of an existing journal, fs_dump writes the whole image
+ * atomically and then empties the journal. An incremental flush (flush.h)
+ * rotates the journal to <image>.journal.old first and removes that once the
+ * image is on disk; replay reads the old journal before the current one.
+ *
+ * Without JOURNAL_DATA only metadata (inodes, free_list entries, block sizes)
+ * is logged, so structure survives a crash while the content of blocks
+ * written since the last dump may not.
+ */
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_OLD_SUFFIX ".old" //appended to JOURNAL_SUFFIX
+#define JOURNAL_MAGIC 0x4e58544a //"JTXN"
+
+enum journal_flags {
+	JOURNAL_DATA = 1, //log block content as well
+	JOURNAL_SYNC = 2, //an operation returns only once its transaction is on disk
+};
+
+enum journal_record {
+	JREC_INODE = 1,
+	JREC_BLOCK = 2,
+};
+
+typedef struct _journal_header {
+	uint32_t magic;
+	uint32_t length; //bytes of records following the header
+	uint64_t seq;
+	uint32_t checksum; //FNV-1a over the records
+	uint32_t count;
+} journal_header;
+
+typedef struct fs_journal {
+	int fd;
+	int flags;
+	int group_size; //transactions per fsync without JOURNAL_SYNC
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t *buf; //committed, not yet written
+	size_t len, cap;
+	uint8_t *spare; //buffer currently being written
+	size_t spare_cap;
+	int buffered; //transactions in buf
+	int flushing;
+	uint64_t seq; //last committed transaction
+	uint64_t durable; //last transaction on disk
+} fs_journal;
+
+/*
+ * Opens (creates) the journal of fs->image_path and starts logging
+ * @return 0 on success, -1 else
+ */
+int fs_journal_open(file_system *fs, int flags, int group_size);
+
+/*
+ * Writes outstanding transactions, fsyncs and closes the journal
+ */
+void fs_journal_close(file_system *fs);
+
+/*
+ * Applies every complete transaction of the journal next to fs->image_path.
+ * Called by fs_load.
+ * @return number of transactions replayed, -1 on error
+ */
+int fs_journal_replay(file_system *fs);
+
+/*
+ * Records that inode i / block b is changed by the running operation
+ */
+void fs_journal_note(file_system *fs, int kind, int index);
+
+static inline void fs_journal_inode(file_system *fs, int i)
+{
+	if (fs->journal) fs_journal_note(fs, JREC_INODE, i);
+}
+
+static inline void fs_journal_block(file_system *fs, int b)
+{
+	if (fs->journal) fs_journal_note(fs, JREC_BLOCK, b);
+}
+
+/*
+ * Turns everything noted by this thread into one transaction.
+ * Must be called while the noted entries are still locked.
+ */
+void fs_journal_commit(file_system *fs);
+
+/*
+ * Called after the locks are released: waits until the last transaction of
+ * this thread is on disk with JOURNAL_SYNC (group commit), otherwise writes
+ * the buffer once a group is full
+ */
+void fs_journal_wait(file_system *fs);
+
+/*
+ * Forces all committed transactions to disk
+ * @return 0 on success, -1 else
+ */
+int fs_journal_sync(file_system *fs);
+
+/*
+ * Drops the journal content after the image itself was written, removes the
+ * journal files if none is open (they were replayed into the image)
+ */
+void fs_journal_checkpoint(file_system *fs);
+
+/*
+ * Writes outstanding transactions and moves them aside to the old journal,
+ * new transactions go to a fresh file. Called with the filesystem held
+ * exclusively before an incremental flush.
+ */
+void fs_journal_rotate(file_system *fs);
+
+/*
+ * Removes the old journal once the flush covering it is on disk
+ */
+void fs_journal_drop_old(file_system *fs);
+
+#endif //JOURNAL_H
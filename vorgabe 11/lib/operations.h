@@ -39,6 +39,30 @@ int fs_mkfile(file_system *fs, char *path_and_name);
  * - in case of copying a folder, the function should be called recursively.
  */
  int fs_cp(file_system *fs, char *src_path, char *dst_path_and_name);
+
+/**
+ * Moves (and/or renames) a file or directory by relinking its inode, so the
+ * cost does not depend on the size of the subtree.
+ *
+ * @Returns:
+ * - 0 on success.
+ * - -1 if the source does not exist or is the root, the destination
+ *   directory does not exist, is full or lies inside the source.
+ * - -2 if the destination already exists.
+ */
+int fs_mv(file_system *fs, char *src_path, char *dst_path_and_name);
+
+/**
+ * Creates link_path as a second name of the regular file at target_path
+ * (a hard link, no data is copied). Reads and writes through either name
+ * see the same file, its blocks are freed once the last name is removed.
+ *
+ * @Returns:
+ * - 0 on success.
+ * - -1 if the target is no regular file or link_path is invalid.
+ * - -2 if link_path already exists.
+ */
+int fs_link(file_system *fs, char *target_path, char *link_path);
 /**
  * Lists all directories and files in the directory pointed to by path
  * @Returns:
@@ -58,6 +82,45 @@ int fs_mkfile(file_system *fs, char *path_and_name);
  */
 char *fs_list(file_system *fs, char *path);
 
+/**
+ * One directory entry as returned by fs_readdir, a hard link is reported as
+ * the file it names
+ */
+typedef struct fs_dirent {
+    int inode;
+    enum node_type type;
+    uint16_t size;
+    char name[NAME_MAX_LENGTH + 1];
+} fs_dirent;
+
+/**
+ * Directory iterator, lives wherever the caller puts it (no allocation)
+ */
+typedef struct fs_dir {
+    file_system *fs;
+    int inode;
+    int children[DIRECT_BLOCKS_COUNT];
+    int count, pos;
+    fs_dirent entry;
+} fs_dir;
+
+/**
+ * Starts iterating over the directory at path. The entries are the ones
+ * present now, in inode order; entries removed before they are reached are
+ * skipped. A defragmentation step renumbers inodes, the iterator has to be
+ * opened again after one (see defrag.h).
+ *
+ * @Returns: 0 on success, -1 if path is not a directory
+ */
+int fs_opendir(file_system *fs, char *path, fs_dir *dir);
+
+/**
+ * @Returns the next entry (valid until the next call) or NULL at the end
+ */
+fs_dirent *fs_readdir(fs_dir *dir);
+
+void fs_closedir(fs_dir *dir);
+
 /**
  * Write (append, not overwrite) @param text to a file pointed to by @param
  * filename The file must exist before it can be written to
@@ -78,6 +141,44 @@ int fs_writef(file_system *fs, char *filename, char *text);
  */
 uint8_t *fs_readf(file_system *fs, char *filename, int *file_size);
 
+/**
+ * Metadata of a file or directory as returned by fs_stat
+ */
+typedef struct fs_stat_info {
+    int inode;
+    enum node_type type;
+    uint64_t size;   // bytes, for a directory everything below it (0 unless sizes are tracked)
+    uint32_t blocks; // data blocks of a file, entries of a directory
+    int parent;      // UNLINKED_PARENT if only hard links name the file
+    uint32_t nlink;  // names of the file: its own plus its hard links
+} fs_stat_info;
+
+/**
+ * Fills st from the inode alone, no data is read. A hard link is reported
+ * as the file it names.
+ *
+ * @Returns: 0 on success, -1 if the path does not exist
+ */
+int fs_stat(file_system *fs, char *path, fs_stat_info *st);
+
+/**
+ * Starts keeping the total size of every directory, which fs_stat then
+ * reports without walking the subtree. Costs one pass over the inodes now
+ * and a walk up to the root on every write, rm, mv and cp afterwards.
+ *
+ * @Returns: 0 on success (also if sizes are tracked already), -1 else
+ */
+int fs_track_sizes(file_system *fs);
+
+/**
+ * Resolves a path without reading any data
+ *
+ * @Param: inode* out receives a copy of the inode if not NULL
+ *
+ * @Returns the inode number or -1 if the path does not exist
+ */
+int fs_lookup(file_system *fs, char *path, inode *out);
+
 /**
  * Deletes a file or a directory recursively.
  *
@@ -87,6 +188,17 @@ uint8_t *fs_readf(file_system *fs, char *filename, int *file_size);
  */
 int fs_rm(file_system *fs, char *path);
 
+/**
+ * Unlinks a file or a directory right away and leaves freeing its inodes and
+ * blocks to the background reclaimer (see reclaim.h), so the call takes the
+ * same time for any size of subtree.
+ *
+ * @Returns:
+ * 0 on success
+ * -1 if the file or directory was not found
+ */
+int fs_rm_deferred(file_system *fs, char *path);
+
 /**
  * Imports the file and saves it in the current filesystem under the path
  * pointed to by the second parameter
@@ -112,5 +224,41 @@ int fs_import(file_system *fs, char *int_path, char *ext_path);
  */
 int fs_export(file_system *fs, char *int_path, char *ext_path);
 
+/**
+ * One operation of a batch, see fs_batch
+ */
+enum fs_batch_op {
+    FS_BATCH_MKDIR,
+    FS_BATCH_MKFILE,
+    FS_BATCH_WRITEF,
+    FS_BATCH_RM,
+};
+
+#define FS_BATCH_SKIPPED -3 // status of operations a failed batch didn't run
+
+typedef struct fs_batch_entry {
+    enum fs_batch_op op;
+    char *path;
+    char *text;  // only for FS_BATCH_WRITEF
+    int status;  // set by fs_batch: what the single call would have returned
+} fs_batch_entry;
+
+/**
+ * Runs count operations in order as one: either all of them are applied or,
+ * as soon as one fails, none. Inodes and blocks for the whole batch are
+ * reserved up front, the filesystem is locked once and a journal records
+ * the batch as a single transaction.
+ *
+ * NOTE: with FS_RCU lock-free readers may see a failed batch before it is
+ * undone.
+ *
+ * @Returns:
+ * 0 if every operation succeeded
+ * -1 if one failed, nothing was applied. Its status tells why, the statuses
+ *  before it are what those operations returned, later ones are
+ *  FS_BATCH_SKIPPED.
+ */
+int fs_batch(file_system *fs, fs_batch_entry *ops, int count);
+
 #define OPERATIONS_H
 #endif /* OPERATIONS_H */
@@ -0,0 +1,101 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Freeing of removed subtrees.
+ *
+ * fs_free_tree releases a whole subtree at once: one pass collects its inodes
+ * and blocks, which then go back as ranges of consecutive numbers.
+ * fs_reclaim_defer only queues the (already unlinked) subtree; the
+ * background reclaimer frees it a budget of inodes at a time, taking the
+ * write lock once per step, so removing a huge tree costs the caller O(1).
+ *
+ * A queued root gets parent -1 and every inode whose parent does not list it
+ * counts as an orphan, so after a crash fs_load finds and frees what the
+ * reclaimer did not get to.
+ */
+
+typedef struct _tree_stack {
+	int *v;
+	size_t n, cap;
+} tree_stack;
+
+// Set of inode or block numbers below n as a bitmap, lo..hi is the part in use
+typedef struct _id_set {
+	uint64_t *bits;
+	uint32_t n;
+	int lo, hi;
+} id_set;
+
+typedef struct fs_reclaim {
+	//only touched with the write lock held
+	int *queue; //detached roots, queue[head..tail)
+	size_t head, tail, cap;
+	tree_stack stack; //unvisited inodes of the tree being freed
+	id_set inodes, blocks; //released at the end of a step
+	uint32_t pending; //trees not completely freed yet
+	uint64_t reclaimed; //inodes done by deferred removals
+	pthread_mutex_t lock; //protects the reclaimer state below
+	pthread_cond_t wake;
+	pthread_t thread;
+	int budget; //inodes per step
+	int running;
+	int stop;
+} fs_reclaim;
+
+void fs_reclaim_init(file_system *fs);
+void fs_reclaim_destroy(file_system *fs);
+
+/*
+ * Frees the subtree idx, which must not be linked anymore.
+ * Must be called with the write lock held.
+ */
+void fs_free_tree(file_system *fs, int idx);
+
+/*
+ * Queues the unlinked subtree idx for the reclaimer.
+ * Must be called with the write lock held.
+ */
+void fs_reclaim_defer(file_system *fs, int idx);
+
+/*
+ * Works through up to budget inodes of queued trees (takes the write lock)
+ * @return the number of inodes done
+ */
+int fs_reclaim_step(file_system *fs, int budget);
+
+/*
+ * Frees everything queued
+ */
+void fs_reclaim_drain(file_system *fs);
+
+/*
+ * Queues and frees every inode that is not linked into its parent, left over
+ * by a crash during a deferred removal. Called by fs_load.
+ * @return the number of orphaned subtrees
+ */
+int fs_reclaim_orphans(file_system *fs);
+
+/*
+ * @return the number of removed trees still waiting to be freed
+ */
+uint32_t fs_reclaim_pending(file_system *fs);
+
+/*
+ * Starts the background reclaimer
+ * @param budget inodes per write lock hold
+ * @return 0 on success, -1 else
+ */
+int fs_reclaimer_start(file_system *fs, int budget);
+
+/*
+ * Stops the reclaimer after freeing everything still queued
+ */
+void fs_reclaimer_stop(file_system *fs);
+
+#endif //RECLAIM_H
@@ -0,0 +1,39 @@
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Changing the size of a loaded filesystem in place.
+ *
+ * The free list, inode table and data area are copied into arrays of the
+ * new size (entries added at the end are free), which are written to a new
+ * image with every region at its offset for that size and renamed over the
+ * old one, as fs_dump does. Only then are the arrays swapped, so a failed
+ * write leaves the filesystem as it was.
+ *
+ * Lock-free readers (-D FS_RCU) never see num_blocks beyond the arrays they
+ * index: growing publishes the arrays a grace period before num_blocks,
+ * shrinking num_blocks a grace period before the arrays. The old arrays are
+ * freed after another grace period.
+ */
+
+/*
+ * Resizes fs to num_blocks blocks (and inodes), dumping it to fs->image_path.
+ * Shrinking needs every block and inode at num_blocks and above to be free,
+ * see fs_defrag. Not for lazily loaded filesystems.
+ * @return 0 on success, -1 if the tail is in use, memory ran out or the
+ * image can't be written
+ */
+int fs_resize(file_system *fs, uint32_t num_blocks);
+
+/*
+ * Drops the free blocks and inodes at the end (all of them after a complete
+ * fs_defrag pass)
+ * @return the new number of blocks, -1 on failure
+ */
+int64_t fs_shrink(file_system *fs);
+
+#endif //RESIZE_H
@@ -0,0 +1,55 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include <stdint.h>
+
+/*
+ * Wire format between `ha2 --serve` (server.h) and its clients (client.h).
+ *
+ * Both directions are a stream of frames in native byte order, the socket is
+ * local. A client may send any number of requests without waiting; responses
+ * come back in request order and carry the id of their request.
+ *
+ * request:  rpc_request_header, then argc arguments, each a uint32_t length
+ *           followed by that many bytes (no terminating 0)
+ * response: rpc_response_header, then length bytes of payload
+ */
+
+#define RPC_MAX_FRAME (16 * 1024 * 1024)
+
+enum rpc_op {
+	RPC_MKDIR = 1, //path
+	RPC_MKFILE,    //path
+	RPC_WRITEF,    //path, text
+	RPC_READF,     //path -> file content, status is the size
+	RPC_LIST,      //path -> listing as fs_list
+	RPC_RM,        //path
+	RPC_CP,        //source, destination
+	RPC_STAT,      //path -> rpc_stat
+	RPC_MV,        //source, destination
+};
+
+typedef struct _rpc_request_header {
+	uint32_t length; //bytes following the header
+	uint32_t id;
+	uint8_t op;
+	uint8_t argc;
+	uint16_t reserved;
+} rpc_request_header;
+
+typedef struct _rpc_response_header {
+	uint32_t length; //bytes following the header
+	uint32_t id;
+	int32_t status; //return value of the operation
+} rpc_response_header;
+
+typedef struct _rpc_stat {
+	uint32_t inode;
+	uint32_t type; //enum node_type
+	uint32_t size; //for a directory the total below it
+	uint32_t blocks; //data blocks of a file, entries of a directory
+	int32_t parent;
+	uint32_t nlink; //own name plus hard links
+} rpc_stat;
+
+#endif //RPC_H
@@ -0,0 +1,21 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "../lib/filesystem.h"
+#include "../lib/rpc.h"
+
+/*
+ * Serves fs on a Unix socket with the protocol of rpc.h.
+ *
+ * One epoll loop handles every client: all complete requests in a
+ * connection's input are executed in order and their responses are written
+ * back together, so pipelined requests cost one read and one write per
+ * batch. A client that doesn't read its responses stops being read from
+ * until it does, as does one that is more than a frame ahead of execution.
+ *
+ * Returns after SIGINT / SIGTERM, the socket file is removed again.
+ * @return 0 on shutdown, -1 if the socket can't be set up
+ */
+int fs_serve(file_system *fs, const char *socket_path);
+
+#endif //SERVER_H
@@ -0,0 +1,119 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "../lib/concurrency.h"
+#include "../lib/filesystem.h"
+
+/*
+ * Operation counters and latency histograms, always on.
+ *
+ * Every thread adds to one of STATS_SHARDS cache line aligned copies
+ * (assigned round robin like the allocator caches) with relaxed atomics, so
+ * counting costs an uncontended add and a clock read per operation.
+ * fs_get_stats sums the shards into a snapshot.
+ *
+ * Latencies go into log-linear (HDR style) buckets: 8 sub-buckets per power
+ * of two, so a reported percentile is at most 12.5% above the real one.
+ */
+
+#define STATS_SHARDS 8
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS (38 << STATS_SUB_BITS) //up to 2^40 ns
+
+enum fs_op {
+	FS_OP_MKDIR,
+	FS_OP_MKFILE,
+	FS_OP_WRITEF,
+	FS_OP_READF,
+	FS_OP_LOOKUP,
+	FS_OP_STAT,
+	FS_OP_LIST,
+	FS_OP_CP,
+	FS_OP_MV,
+	FS_OP_LINK,
+	FS_OP_RM,
+	FS_OP_RM_DEFERRED,
+	FS_OP_IMPORT,
+	FS_OP_EXPORT,
+	FS_OP_BATCH,
+	FS_OP_DUMP,
+	FS_OP_COUNT
+};
+
+enum fs_counter {
+	FS_CTR_INODES_ALLOCATED,
+	FS_CTR_INODES_FREED,
+	FS_CTR_BLOCKS_ALLOCATED,
+	FS_CTR_BLOCKS_FREED,
+	FS_CTR_BYTES_WRITTEN,
+	FS_CTR_BYTES_READ,
+	FS_CTR_NAME_COMPARES, //path component comparisons during lookups
+	FS_CTR_CACHE_HITS, //data blocks found in the cache of a lazy load
+	FS_CTR_CACHE_MISSES, //data blocks read from the image on demand
+	FS_CTR_CACHE_WRITEBACKS, //changed blocks written to the image to free a frame
+	FS_CTR_COUNT
+};
+
+typedef struct fs_op_stats {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t total_ns;
+	uint64_t hist[STATS_BUCKETS];
+} fs_op_stats;
+
+typedef struct _stats_shard {
+	_Alignas(CACHE_LINE) uint64_t counters[FS_CTR_COUNT];
+	fs_op_stats ops[FS_OP_COUNT];
+} stats_shard;
+
+typedef struct fs_stats_shards {
+	stats_shard shards[STATS_SHARDS];
+} fs_stats_shards;
+
+/*
+ * Snapshot returned by fs_get_stats
+ */
+typedef struct fs_stats {
+	fs_op_stats ops[FS_OP_COUNT];
+	uint64_t counters[FS_CTR_COUNT];
+	uint32_t reclaim_pending; //removed trees not freed yet, see reclaim.h
+} fs_stats;
+
+void fs_stats_init(file_system *fs);
+void fs_stats_destroy(file_system *fs);
+
+/*
+ * Start time of an operation for fs_stats_op
+ */
+uint64_t fs_stats_clock(void);
+
+/*
+ * Records one operation that started at start
+ */
+void fs_stats_op(file_system *fs, enum fs_op op, uint64_t start, int failed);
+
+void fs_stats_count(file_system *fs, enum fs_counter c, uint64_t n);
+
+/*
+ * Sums up all shards into out
+ */
+void fs_get_stats(file_system *fs, fs_stats *out);
+
+/*
+ * Sets everything to 0. Operations running during the reset may still be
+ * counted partly.
+ */
+void fs_reset_stats(file_system *fs);
+
+/*
+ * @return the upper end of the bucket holding the q quantile (0..1), 0 if
+ * nothing was recorded
+ */
+uint64_t fs_stats_percentile(const fs_op_stats *s, double q);
+
+const char *fs_op_name(enum fs_op op);
+const char *fs_counter_name(enum fs_counter c);
+
+#endif //STATS_H
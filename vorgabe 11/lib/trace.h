@@ -0,0 +1,66 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Structured tracing, compiled in with -D FS_TRACE only.
+ *
+ * Every thread writes its events into its own ring buffer (no locks, no
+ * atomic read-modify-write, the oldest events are overwritten once it is
+ * full). An event is an id, a timestamp, for spans a duration, and two
+ * numbers whose meaning depends on the id (inode, block, count, ...).
+ * fs_trace_dump writes all rings to a file in Chrome trace format
+ * (chrome://tracing, ui.perfetto.dev).
+ *
+ * Without FS_TRACE the TRACE macros expand to nothing.
+ */
+
+#define TRACE_RING_SIZE (1 << 15) //events per thread, a power of two
+#define TRACE_RETIRED_MAX 16 //rings of exited threads kept for the next dump
+
+enum fs_trace_event {
+	TR_OP, //span of one operation, a: enum fs_op, b: 1 if it failed
+	TR_CREATE, //a: blocks
+	TR_LOAD, //a: blocks
+	TR_JOURNAL_REPLAY, //a: transactions replayed
+	TR_ORPHANS, //a: orphaned subtrees found at load
+	TR_INODE_ALLOC, //a: inode, b: type
+	TR_BLOCK_ALLOC, //a: block
+	TR_INODE_FREE, //a: first inode, b: count
+	TR_BLOCK_FREE, //a: first block, b: count
+	TR_FLUSH, //span, a: entries written, b: 1 if it failed
+	TR_RECLAIM_STEP, //span, a: inodes done, b: trees still pending
+	TR_DEFRAG_STEP, //span, a: blocks and inodes moved, b: phase after the step
+	TR_RESIZE, //a: old blocks, b: new blocks
+	TR_EVENT_COUNT
+};
+
+#ifdef FS_TRACE
+	#define TRACE(ev, a, b) fs_trace_emit((ev), fs_trace_clock(), 0, (a), (b))
+	//span that started at start (fs_trace_clock)
+	#define TRACE_SPAN(ev, start, a, b) fs_trace_emit((ev), (start), fs_trace_clock() - (start) + 1, (a), (b))
+	#define TRACE_START(var) uint64_t var = fs_trace_clock()
+#else
+	#define TRACE(ev, a, b) ((void)0)
+	#define TRACE_SPAN(ev, start, a, b) ((void)0)
+	#define TRACE_START(var) ((void)0)
+#endif
+
+uint64_t fs_trace_clock(void);
+
+/*
+ * Appends an event to the calling thread's ring, dur 0 for a point in time
+ */
+void fs_trace_emit(enum fs_trace_event ev, uint64_t ts, uint64_t dur, int64_t a, int64_t b);
+
+/*
+ * Writes the events of all live threads and of the last TRACE_RETIRED_MAX
+ * threads that exited since the previous dump as Chrome trace JSON. Events
+ * emitted during the dump may be missing, events a thread overwrites while
+ * they are written are left out.
+ * @return 0 on success, -1 else
+ */
+int fs_trace_dump(const char *path);
+
+#endif //TRACE_H
@@ -5,12 +5,3 @@
 void printhelp();
 
 #endif //UTILS_H
-
-
-
-#ifdef DEBUG
-	#include <stdio.h>
-	#define LOG(x) fprintf(stderr,x);
-#else
-	#define LOG(x) ;
-#endif
@@ -0,0 +1,58 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdint.h>
+
+#include "../lib/filesystem.h"
+
+/*
+ * Recursive traversal of a subtree (du, find, checksums, export).
+ *
+ * The whole walk runs inside one read section: in the locked build it sees a
+ * consistent tree and writers wait until it is done, with SYNC=rcu entries
+ * changed meanwhile may or may not be seen. Callbacks may use the read only
+ * operations (fs_lookup, fs_readf, ...) but must not modify the filesystem.
+ */
+
+enum fs_walk_flags {
+	FS_WALK_PRE = 1, //visit directories before their children (default)
+	FS_WALK_POST = 2, //visit directories after their children
+};
+
+// callback return value: do not descend into this directory (pre visits only)
+#define FS_WALK_SKIP 1
+
+typedef struct fs_walk_entry {
+	const char *path; //absolute, valid during the callback only
+	int inode;
+	int parent;
+	enum node_type type;
+	uint16_t size;
+	int depth; //0 for the start of the walk
+	int post; //1 on the post order visit of a directory
+} fs_walk_entry;
+
+/*
+ * @return 0 to continue, FS_WALK_SKIP or a negative value to stop the walk
+ */
+typedef int (*fs_walk_fn)(const fs_walk_entry *e, void *arg);
+
+/*
+ * Visits path and everything below it. Files are visited once, directories
+ * before and/or after their children as selected by flags. Children come in
+ * inode order. Nothing deeper than max_depth is visited (-1: no limit).
+ * @return 0, the negative value a callback stopped the walk with, or -1 if
+ * path does not exist
+ */
+int fs_walk(file_system *fs, char *path, fs_walk_fn fn, void *arg, int flags, int max_depth);
+
+/*
+ * Same as fs_walk, but subtrees are spread over threads workers that steal
+ * work from each other. The callback runs concurrently and the order between
+ * siblings is unspecified; a directory's post visit still comes after all of
+ * its descendants.
+ */
+int fs_walk_parallel(file_system *fs, char *path, fs_walk_fn fn, void *arg, int flags, int max_depth,
+                     int threads);
+
+#endif //WALK_H
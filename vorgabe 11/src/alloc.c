@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/alloc.h"
+#include "../lib/cache.h"
+#include "../lib/flush.h"
+#include "../lib/stats.h"
+#include "../lib/trace.h"
+
+static uint32_t next_shard;
+static _Thread_local int my_shard = -1;
+
+static alloc_cache *thread_cache(file_system *fs)
+{
+	if (my_shard < 0) {
+		my_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % ALLOC_SHARDS;
+	}
+	return &fs->alloc->caches[my_shard];
+}
+
+void fs_alloc_init(file_system *fs)
+{
+	uint32_t n = fs->s_block->num_blocks;
+
+	fs->alloc = calloc(1, sizeof(fs_alloc));
+	if (fs->alloc == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	fs->alloc->block_reserved = calloc(n, 1);
+	fs->alloc->inode_reserved = calloc(n, 1);
+	if (fs->alloc->block_reserved == NULL || fs->alloc->inode_reserved == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	pthread_mutex_init(&fs->alloc->lock, NULL);
+	for (int i = 0; i < ALLOC_SHARDS; i++) {
+		pthread_mutex_init(&fs->alloc->caches[i].lock, NULL);
+	}
+}
+
+void fs_alloc_destroy(file_system *fs)
+{
+	for (int i = 0; i < ALLOC_SHARDS; i++) {
+		pthread_mutex_destroy(&fs->alloc->caches[i].lock);
+	}
+	pthread_mutex_destroy(&fs->alloc->lock);
+	free(fs->alloc->block_reserved);
+	free(fs->alloc->inode_reserved);
+	free(fs->alloc);
+	fs->alloc = NULL;
+}
+
+static int block_is_free(file_system *fs, uint32_t i)
+{
+	return FS_LOAD(fs->free_list[i]) == 1;
+}
+
+static int inode_is_free(file_system *fs, uint32_t i)
+{
+	return FS_LOAD(fs->inodes[i].n_type) == free_block;
+}
+
+// Moves up to ALLOC_CHUNK unreserved free entries starting at *hint into out.
+// Called with fs->alloc->lock held.
+static int carve(file_system *fs, int (*is_free)(file_system *, uint32_t),
+                 uint8_t *reserved, uint32_t *hint, int *out)
+{
+	uint32_t n = fs->s_block->num_blocks;
+	uint32_t start = *hint;
+	int count = 0;
+
+	for (uint32_t k = 0; k < n && count < ALLOC_CHUNK; k++) {
+		uint32_t i = (start + k) % n;
+		if (!FS_LOAD(reserved[i]) && is_free(fs, i)) {
+			reserved[i] = 1;
+			out[count++] = (int)i;
+			*hint = (i + 1) % n;
+		}
+	}
+	return count;
+}
+
+// Gives the unused part of a cache back. Called with both locks held.
+static void release_cache(file_system *fs, alloc_cache *c)
+{
+	fs_alloc *a = fs->alloc;
+
+	for (; c->block_pos < c->block_count; c->block_pos++) {
+		int b = c->blocks[c->block_pos];
+		a->block_reserved[b] = 0;
+		if (block_is_free(fs, b)) {
+			__atomic_fetch_add(&fs->s_block->free_blocks, 1, __ATOMIC_RELAXED);
+		}
+	}
+	for (; c->inode_pos < c->inode_count; c->inode_pos++) {
+		a->inode_reserved[c->inodes[c->inode_pos]] = 0;
+	}
+}
+
+static void drain_locked(file_system *fs)
+{
+	for (int i = 0; i < ALLOC_SHARDS; i++) {
+		alloc_cache *c = &fs->alloc->caches[i];
+		pthread_mutex_lock(&c->lock);
+		release_cache(fs, c);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+void fs_alloc_drain(file_system *fs)
+{
+	pthread_mutex_lock(&fs->alloc->lock);
+	drain_locked(fs);
+	pthread_mutex_unlock(&fs->alloc->lock);
+}
+
+// Slow path: refills the cache of the calling thread.
+// Returns the number of entries carved.
+static int refill(file_system *fs, alloc_cache *c, int inodes)
+{
+	fs_alloc *a = fs->alloc;
+	int count;
+
+	pthread_mutex_lock(&a->lock);
+	for (int attempt = 0; attempt < 2; attempt++) {
+		pthread_mutex_lock(&c->lock);
+		if (inodes) {
+			count = c->inode_count = carve(fs, inode_is_free, a->inode_reserved,
+			                               &a->inode_hint, c->inodes);
+			c->inode_pos = 0;
+		} else {
+			count = c->block_count = carve(fs, block_is_free, a->block_reserved,
+			                               &a->block_hint, c->blocks);
+			c->block_pos = 0;
+			__atomic_fetch_sub(&fs->s_block->free_blocks, count, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		// everything left sits in other caches: take it back and retry
+		if (count > 0 || attempt > 0) break;
+		drain_locked(fs);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return count;
+}
+
+int fs_alloc_block(file_system *fs)
+{
+	alloc_cache *c = thread_cache(fs);
+
+	do {
+		pthread_mutex_lock(&c->lock);
+		while (c->block_pos < c->block_count) {
+			int b = c->blocks[c->block_pos++];
+			// the entry may have been taken behind the allocator's back
+			if (!block_is_free(fs, b)) {
+				fs->alloc->block_reserved[b] = 0;
+				continue;
+			}
+			fs_block_new(fs, b)->size = 0;
+			fs_block_put(fs, b, 1);
+			FS_PUBLISH(fs->free_list[b], 0);
+			fs_mark_block(fs, b);
+			FS_PUBLISH(fs->alloc->block_reserved[b], 0);
+			pthread_mutex_unlock(&c->lock);
+			fs_stats_count(fs, FS_CTR_BLOCKS_ALLOCATED, 1);
+			TRACE(TR_BLOCK_ALLOC, b, 0);
+			return b;
+		}
+		pthread_mutex_unlock(&c->lock);
+	} while (refill(fs, c, 0) > 0);
+
+	return -1;
+}
+
+int fs_alloc_inode(file_system *fs, enum node_type type)
+{
+	alloc_cache *c = thread_cache(fs);
+
+	do {
+		pthread_mutex_lock(&c->lock);
+		while (c->inode_pos < c->inode_count) {
+			int i = c->inodes[c->inode_pos++];
+			if (!inode_is_free(fs, i)) {
+				fs->alloc->inode_reserved[i] = 0;
+				continue;
+			}
+			inode_init(&fs->inodes[i]);
+			FS_PUBLISH(fs->inodes[i].n_type, type);
+			fs_mark_inode(fs, i);
+			FS_PUBLISH(fs->alloc->inode_reserved[i], 0);
+			pthread_mutex_unlock(&c->lock);
+			fs_stats_count(fs, FS_CTR_INODES_ALLOCATED, 1);
+			TRACE(TR_INODE_ALLOC, i, type);
+			return i;
+		}
+		pthread_mutex_unlock(&c->lock);
+	} while (refill(fs, c, 1) > 0);
+
+	return -1;
+}
+
+void fs_free_inode(file_system *fs, int i)
+{
+	inode_init(&fs->inodes[i]);
+	fs_mark_inode(fs, i);
+	fs_stats_count(fs, FS_CTR_INODES_FREED, 1);
+	TRACE(TR_INODE_FREE, i, 1);
+}
+
+void fs_free_block(file_system *fs, int b)
+{
+	FS_PUBLISH(fs->free_list[b], 1);
+	fs_mark_block(fs, b);
+	__atomic_fetch_add(&fs->s_block->free_blocks, 1, __ATOMIC_RELAXED);
+	fs_stats_count(fs, FS_CTR_BLOCKS_FREED, 1);
+	TRACE(TR_BLOCK_FREE, b, 1);
+}
+
+void fs_free_inode_range(file_system *fs, int first, int count)
+{
+	for (int i = first; i < first + count; i++) {
+		inode_init(&fs->inodes[i]);
+		fs_journal_inode(fs, i);
+	}
+	fs_dirty_mark_range(fs, fs->dirty->inodes, first, count);
+	fs_stats_count(fs, FS_CTR_INODES_FREED, count);
+	TRACE(TR_INODE_FREE, first, count);
+}
+
+void fs_free_block_range(file_system *fs, int first, int count)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(&fs->free_list[first], 1, count);
+	for (int b = first; fs->journal && b < first + count; b++) fs_journal_block(fs, b);
+	fs_dirty_mark_range(fs, fs->dirty->blocks, first, count);
+	__atomic_fetch_add(&fs->s_block->free_blocks, count, __ATOMIC_RELAXED);
+	fs_stats_count(fs, FS_CTR_BLOCKS_FREED, count);
+	TRACE(TR_BLOCK_FREE, first, count);
+}
@@ -0,0 +1,244 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/cache.h"
+#include "../lib/imageio.h"
+#include "../lib/stats.h"
+
+int fs_cache_init(file_system *fs, uint32_t frames)
+{
+	uint32_t n = fs->s_block->num_blocks;
+	fs_cache *c = calloc(1, sizeof(fs_cache));
+	if (c == NULL) return -1;
+
+	c->limit = frames > 0 ? frames : 1;
+	c->frame_of = malloc((size_t)n * sizeof(int32_t));
+	c->io = fs_io_open(fs->image_path, O_RDWR, 0);
+	if (c->frame_of == NULL || c->io == NULL) {
+		if (c->io) fs_io_close(c->io);
+		free(c->frame_of);
+		free(c);
+		return -1;
+	}
+	memset(c->frame_of, 0xff, (size_t)n * sizeof(int32_t));
+	pthread_mutex_init(&c->lock, NULL);
+	fs->cache = c;
+	return 0;
+}
+
+void fs_cache_destroy(file_system *fs)
+{
+	fs_cache *c = fs->cache;
+	if (c == NULL) return;
+
+	for (uint32_t f = 0; f < c->count; f++) free(c->frames[f]);
+	free(c->frames);
+	free(c->frame_of);
+	fs_io_close(c->io);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+	fs->cache = NULL;
+}
+
+static uint32_t add_frame(fs_cache *c)
+{
+	if (c->count == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 64;
+		c->frames = realloc(c->frames, c->cap * sizeof(cache_frame *));
+		if (c->frames == NULL) {
+			perror("Realloc error");
+			exit(errno);
+		}
+	}
+	c->frames[c->count] = calloc(1, sizeof(cache_frame));
+	if (c->frames[c->count] == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	return c->count++;
+}
+
+static int evictable(cache_frame *fr)
+{
+	return fr->pins == 0 && !fr->dirty && !fr->flushing;
+}
+
+// Writes a changed frame to its place in the image so it may go
+static int write_back(file_system *fs, cache_frame *fr)
+{
+	fs_cache *c = fs->cache;
+	uint32_t n = fs->s_block->num_blocks;
+
+	fs_io_write(c->io, &fr->data, sizeof(data_block), DATA_OFFSET(n) + (uint64_t)fr->block * sizeof(data_block));
+	if (fs_io_wait(c->io) != 0) {
+		perror("Cache write error");
+		return -1;
+	}
+	fr->dirty = 0;
+	fs_stats_count(fs, FS_CTR_CACHE_WRITEBACKS, 1);
+	return 0;
+}
+
+// Frame for a block that is not cached: a new one below the limit, else the
+// next unreferenced one the clock hand finds, else a changed one written back
+static uint32_t victim(file_system *fs)
+{
+	fs_cache *c = fs->cache;
+	if (c->count < c->limit) return add_frame(c);
+
+	//two rounds: the first one may only clear reference bits
+	for (uint32_t step = 0; step < 2 * c->count; step++) {
+		uint32_t f = c->hand;
+		c->hand = (c->hand + 1) % c->count;
+		cache_frame *fr = c->frames[f];
+		if (!evictable(fr)) continue;
+		if (fr->ref) {
+			fr->ref = 0;
+			continue;
+		}
+		c->frame_of[fr->block] = -1;
+		return f;
+	}
+	//a flush under way could write its older copy of a frame after ours
+	for (uint32_t step = 0; !c->in_flush && step < c->count; step++) {
+		uint32_t f = c->hand;
+		c->hand = (c->hand + 1) % c->count;
+		cache_frame *fr = c->frames[f];
+		if (fr->pins > 0 || fr->flushing) continue;
+		if (write_back(fs, fr) != 0) break;
+		c->frame_of[fr->block] = -1;
+		return f;
+	}
+	//everything is pinned or being flushed
+	return add_frame(c);
+}
+
+// Gives back the frames above the limit that may go
+static void trim(fs_cache *c)
+{
+	for (uint32_t f = c->count; f-- > c->limit;) {
+		cache_frame *fr = c->frames[f];
+		if (!evictable(fr)) continue;
+		c->frame_of[fr->block] = -1;
+		free(fr);
+		//the last frame takes its place, it was looked at already
+		c->frames[f] = c->frames[--c->count];
+		if (f < c->count) c->frame_of[c->frames[f]->block] = f;
+	}
+	if (c->hand >= c->count) c->hand = 0;
+}
+
+// Pins the frame of block b. A block that is not cached gets a frame that is
+// read from the image (read) or zeroed. Returns 1 if it was cached.
+static int pin(file_system *fs, int b, int read, cache_frame **out)
+{
+	fs_cache *c = fs->cache;
+	uint32_t n = fs->s_block->num_blocks;
+	int hit = 1;
+
+	pthread_mutex_lock(&c->lock);
+	int32_t f = c->frame_of[b];
+	if (f < 0) {
+		hit = 0;
+		f = victim(fs);
+		cache_frame *fr = c->frames[f];
+		fr->block = b;
+		fr->dirty = 0;
+		if (read) {
+			fs_io_read(c->io, &fr->data, sizeof(data_block), DATA_OFFSET(n) + (uint64_t)b * sizeof(data_block));
+			if (fs_io_wait(c->io) != 0) {
+				perror("Cache read error");
+				exit(1);
+			}
+		} else {
+			memset(&fr->data, 0, sizeof(data_block));
+		}
+		c->frame_of[b] = f;
+	}
+	cache_frame *fr = c->frames[f];
+	fr->pins++;
+	fr->ref = 1;
+	pthread_mutex_unlock(&c->lock);
+
+	*out = fr;
+	return hit;
+}
+
+data_block *fs_cache_get(file_system *fs, int b)
+{
+	cache_frame *fr;
+	int hit = pin(fs, b, 1, &fr);
+	fs_stats_count(fs, hit ? FS_CTR_CACHE_HITS : FS_CTR_CACHE_MISSES, 1);
+	return &fr->data;
+}
+
+data_block *fs_cache_new(file_system *fs, int b)
+{
+	cache_frame *fr;
+	pin(fs, b, 0, &fr);
+	return &fr->data;
+}
+
+void fs_cache_put(file_system *fs, int b, int dirty)
+{
+	fs_cache *c = fs->cache;
+
+	pthread_mutex_lock(&c->lock);
+	cache_frame *fr = c->frames[c->frame_of[b]];
+	fr->pins--;
+	if (dirty) fr->dirty = 1;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void fs_cache_staged(file_system *fs, int b)
+{
+	fs_cache *c = fs->cache;
+	if (c == NULL) return;
+
+	pthread_mutex_lock(&c->lock);
+	int32_t f = c->frame_of[b];
+	c->in_flush = 1;
+	if (f >= 0) {
+		//changes from now on make it dirty again
+		c->frames[f]->dirty = 0;
+		c->frames[f]->flushing = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void fs_cache_flushed(file_system *fs, int ok)
+{
+	fs_cache *c = fs->cache;
+	if (c == NULL) return;
+
+	pthread_mutex_lock(&c->lock);
+	c->in_flush = 0;
+	for (uint32_t f = 0; f < c->count; f++) {
+		cache_frame *fr = c->frames[f];
+		if (!fr->flushing) continue;
+		fr->flushing = 0;
+		if (!ok) fr->dirty = 1;
+	}
+	trim(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+int fs_cache_reopen(file_system *fs)
+{
+	fs_cache *c = fs->cache;
+	if (c == NULL) return 0;
+
+	fs_io *io = fs_io_open(fs->image_path, O_RDWR, 0);
+	if (io == NULL) return -1;
+
+	pthread_mutex_lock(&c->lock);
+	fs_io_close(c->io);
+	c->io = io;
+	for (uint32_t f = 0; f < c->count; f++) c->frames[f]->dirty = 0;
+	trim(c);
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
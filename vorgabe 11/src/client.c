@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../lib/client.h"
+
+#define READ_CHUNK (64 * 1024)
+
+struct fs_client {
+	int fd;
+	uint32_t next_id;
+	uint8_t *out; //requests not yet written
+	size_t out_len, out_cap;
+	uint8_t *in; //received, not yet returned
+	size_t in_pos, in_len, in_cap;
+};
+
+static void reserve(uint8_t **buf, size_t *cap, size_t needed)
+{
+	if (needed <= *cap) return;
+	size_t new_cap = *cap ? *cap : READ_CHUNK;
+	while (new_cap < needed) new_cap *= 2;
+	*buf = realloc(*buf, new_cap);
+	if (*buf == NULL) {
+		perror("Realloc error");
+		exit(errno);
+	}
+	*cap = new_cap;
+}
+
+fs_client *fs_client_connect(const char *socket_path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) return NULL;
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return NULL;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return NULL;
+	}
+	fs_client *c = calloc(1, sizeof(fs_client));
+	if (c == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	c->fd = fd;
+	c->next_id = 1;
+	return c;
+}
+
+void fs_client_close(fs_client *c)
+{
+	if (!c) return;
+	close(c->fd);
+	free(c->out);
+	free(c->in);
+	free(c);
+}
+
+static void put(fs_client *c, const void *p, size_t len)
+{
+	reserve(&c->out, &c->out_cap, c->out_len + len);
+	memcpy(c->out + c->out_len, p, len);
+	c->out_len += len;
+}
+
+static void put_arg(fs_client *c, const char *arg)
+{
+	uint32_t len = (uint32_t)strlen(arg);
+	put(c, &len, sizeof(len));
+	put(c, arg, len);
+}
+
+uint32_t fs_client_send(fs_client *c, enum rpc_op op, const char *arg0, const char *arg1)
+{
+	rpc_request_header h = { .id = c->next_id++, .op = (uint8_t)op };
+	h.argc = arg0 ? (arg1 ? 2 : 1) : 0;
+	h.length = 0;
+	if (arg0) h.length += sizeof(uint32_t) + strlen(arg0);
+	if (arg0 && arg1) h.length += sizeof(uint32_t) + strlen(arg1);
+
+	put(c, &h, sizeof(h));
+	if (arg0) put_arg(c, arg0);
+	if (arg0 && arg1) put_arg(c, arg1);
+	return h.id;
+}
+
+int fs_client_flush(fs_client *c)
+{
+	size_t pos = 0;
+	while (pos < c->out_len) {
+		ssize_t n = send(c->fd, c->out + pos, c->out_len - pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		pos += n;
+	}
+	c->out_len = 0;
+	return 0;
+}
+
+// Makes sure len bytes are buffered
+static int fill(fs_client *c, size_t len)
+{
+	if (c->in_len - c->in_pos >= len) return 0;
+	if (c->in_pos > 0) {
+		memmove(c->in, c->in + c->in_pos, c->in_len - c->in_pos);
+		c->in_len -= c->in_pos;
+		c->in_pos = 0;
+	}
+	reserve(&c->in, &c->in_cap, len > READ_CHUNK ? len : READ_CHUNK);
+	while (c->in_len < len) {
+		ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		c->in_len += n;
+	}
+	return 0;
+}
+
+int fs_client_recv(fs_client *c, rpc_response_header *h, uint8_t **payload)
+{
+	if (payload) *payload = NULL;
+	if (c->out_len && fs_client_flush(c) != 0) return -1;
+	if (fill(c, sizeof(*h)) != 0) return -1;
+	memcpy(h, c->in + c->in_pos, sizeof(*h));
+	if (h->length > RPC_MAX_FRAME || fill(c, sizeof(*h) + h->length) != 0) return -1;
+
+	if (payload && h->length) {
+		*payload = malloc(h->length + 1);
+		if (*payload == NULL) {
+			perror("Malloc error");
+			exit(errno);
+		}
+		memcpy(*payload, c->in + c->in_pos + sizeof(*h), h->length);
+		(*payload)[h->length] = '\0';
+	}
+	c->in_pos += sizeof(*h) + h->length;
+	return 0;
+}
+
+int fs_client_call(fs_client *c, enum rpc_op op, const char *arg0, const char *arg1,
+                   uint8_t **payload, uint32_t *length)
+{
+	rpc_response_header h;
+	fs_client_send(c, op, arg0, arg1);
+	if (fs_client_recv(c, &h, payload) != 0) return -1;
+	if (length) *length = h.length;
+	return h.status;
+}
+
+int fs_client_stat(fs_client *c, const char *path, rpc_stat *st)
+{
+	uint8_t *payload;
+	uint32_t length;
+	int ret = fs_client_call(c, RPC_STAT, path, NULL, &payload, &length);
+	if (ret == 0 && length == sizeof(*st)) {
+		memcpy(st, payload, sizeof(*st));
+	} else {
+		ret = -1;
+	}
+	free(payload);
+	return ret;
+}
@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../lib/alloc.h"
+#include "../lib/concurrency.h"
+#include "../lib/filesystem.h"
+#include "../lib/journal.h"
+
+static uint32_t next_fs_id = 1;
+
+void fs_locks_init(file_system *fs)
+{
+	fs->locks = calloc(1, sizeof(fs_locks));
+	if (fs->locks == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	fs->locks->id = __atomic_fetch_add(&next_fs_id, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_init(&fs->locks->rw, NULL);
+	for (int i = 0; i < INODE_LOCK_STRIPES; i++) {
+		pthread_mutex_init(&fs->locks->inode_locks[i], NULL);
+	}
+#ifdef FS_RCU
+	pthread_mutex_init(&fs->locks->registry_lock, NULL);
+#endif
+}
+
+static void destroy_common(fs_locks *l)
+{
+	for (int i = 0; i < INODE_LOCK_STRIPES; i++) {
+		pthread_mutex_destroy(&l->inode_locks[i]);
+	}
+	pthread_rwlock_destroy(&l->rw);
+	free(l);
+}
+
+void fs_write_begin(file_system *fs)
+{
+	pthread_rwlock_wrlock(&fs->locks->rw);
+}
+
+void fs_update_begin(file_system *fs)
+{
+	pthread_rwlock_rdlock(&fs->locks->rw);
+}
+
+// The transaction of the operation is committed while its changes are still
+// locked, waiting for the journal happens after the lock is released
+void fs_update_end(file_system *fs)
+{
+	fs_journal_commit(fs);
+	pthread_rwlock_unlock(&fs->locks->rw);
+	fs_journal_wait(fs);
+}
+
+#ifdef FS_RCU
+
+_Thread_local rcu_tls rcu_current;
+
+// per thread: the first of its readers, chained by thread_next
+static pthread_key_t thread_readers;
+static pthread_once_t thread_readers_once = PTHREAD_ONCE_INIT;
+
+static void reader_unref(rcu_reader *r)
+{
+	if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0) free(r);
+}
+
+// Thread exit: the readers are left for their filesystems to unlink, which
+// may have been destroyed already
+static void thread_exit(void *first)
+{
+	rcu_reader *r = first;
+	while (r) {
+		rcu_reader *next = r->thread_next;
+		FS_PUBLISH(r->state, 0);
+		FS_PUBLISH(r->exited, 1);
+		reader_unref(r);
+		r = next;
+	}
+}
+
+static void thread_readers_init(void)
+{
+	if (pthread_key_create(&thread_readers, thread_exit) != 0) {
+		perror("pthread_key_create");
+		exit(1);
+	}
+}
+
+void fs_locks_destroy(file_system *fs)
+{
+	fs_locks *l = fs->locks;
+
+	rcu_reader *r = l->readers;
+	while (r) {
+		rcu_reader *next = r->next;
+		reader_unref(r);
+		r = next;
+	}
+	for (int i = 0; i < 3; i++) {
+		free(l->limbo[i].items);
+	}
+	pthread_mutex_destroy(&l->registry_lock);
+	destroy_common(l);
+	fs->locks = NULL;
+}
+
+// Slow path of fs_read_begin: first access of this thread to this filesystem
+rcu_reader *rcu_register_reader(file_system *fs)
+{
+	fs_locks *l = fs->locks;
+	pthread_t self = pthread_self();
+
+	pthread_once(&thread_readers_once, thread_readers_init);
+	pthread_mutex_lock(&l->registry_lock);
+	//an exited thread's id may have been reused
+	rcu_reader *r = l->readers;
+	while (r && (FS_LOAD(r->exited) || !pthread_equal(r->owner, self))) r = r->next;
+	if (!r) {
+		if (posix_memalign((void **)&r, CACHE_LINE, sizeof(rcu_reader)) != 0) {
+			perror("Malloc error");
+			exit(errno);
+		}
+		r->state = 0;
+		r->owner = self;
+		r->refs = 2;
+		r->exited = 0;
+		r->thread_next = pthread_getspecific(thread_readers);
+		pthread_setspecific(thread_readers, r);
+		r->next = l->readers;
+		FS_PUBLISH(l->readers, r);
+	}
+	pthread_mutex_unlock(&l->registry_lock);
+
+	rcu_current.fs_id = l->id;
+	rcu_current.reader = r;
+	return r;
+}
+
+static void reclaim_list(file_system *fs, limbo_list *list)
+{
+	for (size_t i = 0; i < list->count; i++) {
+		if (list->items[i].kind == RETIRED_INODE) {
+			fs_free_inode_range(fs, list->items[i].index, list->items[i].count);
+		} else {
+			fs_free_block_range(fs, list->items[i].index, list->items[i].count);
+		}
+	}
+	list->count = 0;
+}
+
+// Unlinks the readers of exited threads. Other walks of the list hold the
+// write lock (try_advance) or registry_lock (registration), so both are taken.
+static void prune_readers(fs_locks *l)
+{
+	pthread_mutex_lock(&l->registry_lock);
+	rcu_reader **link = &l->readers;
+	while (*link) {
+		rcu_reader *r = *link;
+		if (FS_LOAD(r->exited)) {
+			*link = r->next;
+			reader_unref(r);
+		} else {
+			link = &r->next;
+		}
+	}
+	pthread_mutex_unlock(&l->registry_lock);
+}
+
+// Advances the global epoch if every active reader has seen the current one.
+// Items retired two epochs ago can no longer be referenced and are freed,
+// without any active reader everything retired so far is.
+static int try_advance(file_system *fs)
+{
+	fs_locks *l = fs->locks;
+	uint64_t e = l->epoch;
+	int active = 0;
+	int exited = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (rcu_reader *r = FS_LOAD(l->readers); r; r = r->next) {
+		uint64_t s = FS_LOAD(r->state);
+		if ((s & 1) && (s >> 1) != e) return -1;
+		active |= s & 1;
+		exited |= FS_LOAD(r->exited);
+	}
+	if (exited) prune_readers(l);
+	FS_PUBLISH(l->epoch, e + 1);
+	reclaim_list(fs, &l->limbo[(e + 2) % 3]);
+	if (!active) {
+		reclaim_list(fs, &l->limbo[e % 3]);
+		reclaim_list(fs, &l->limbo[(e + 1) % 3]);
+	}
+	return 0;
+}
+
+static void retire(file_system *fs, int kind, int index, int count)
+{
+	fs_locks *l = fs->locks;
+	limbo_list *list = &l->limbo[l->epoch % 3];
+
+	if (list->count == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 64;
+		list->items = realloc(list->items, list->cap * sizeof(retired));
+		if (list->items == NULL) {
+			perror("Realloc error");
+			exit(errno);
+		}
+	}
+	list->items[list->count].kind = kind;
+	list->items[list->count].index = index;
+	list->items[list->count].count = count;
+	list->count++;
+}
+
+void fs_retire_inode(file_system *fs, int i)
+{
+	retire(fs, RETIRED_INODE, i, 1);
+}
+
+void fs_retire_block(file_system *fs, int b)
+{
+	retire(fs, RETIRED_BLOCK, b, 1);
+}
+
+void fs_retire_inode_range(file_system *fs, int first, int count)
+{
+	retire(fs, RETIRED_INODE, first, count);
+}
+
+void fs_retire_block_range(file_system *fs, int first, int count)
+{
+	retire(fs, RETIRED_BLOCK, first, count);
+}
+
+void fs_reclaim_all(file_system *fs)
+{
+	fs_locks *l = fs->locks;
+	int passes = 0;
+
+	while (l->limbo[0].count || l->limbo[1].count || l->limbo[2].count || passes < 3) {
+		if (try_advance(fs) == 0) {
+			passes++;
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+#else
+
+void fs_locks_destroy(file_system *fs)
+{
+	destroy_common(fs->locks);
+	fs->locks = NULL;
+}
+
+void fs_retire_inode(file_system *fs, int i)
+{
+	fs_free_inode(fs, i);
+}
+
+void fs_retire_block(file_system *fs, int b)
+{
+	fs_free_block(fs, b);
+}
+
+void fs_retire_inode_range(file_system *fs, int first, int count)
+{
+	fs_free_inode_range(fs, first, count);
+}
+
+void fs_retire_block_range(file_system *fs, int first, int count)
+{
+	fs_free_block_range(fs, first, count);
+}
+
+void fs_reclaim_all(file_system *fs)
+{
+	(void)fs;
+}
+
+#endif
+
+void fs_write_end(file_system *fs)
+{
+#ifdef FS_RCU
+	try_advance(fs);
+#endif
+	fs_journal_commit(fs);
+	pthread_rwlock_unlock(&fs->locks->rw);
+	fs_journal_wait(fs);
+}
@@ -0,0 +1,357 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/alloc.h"
+#include "../lib/cache.h"
+#include "../lib/concurrency.h"
+#include "../lib/defrag.h"
+#include "../lib/flush.h"
+#include "../lib/reclaim.h"
+#include "../lib/stats.h"
+#include "../lib/trace.h"
+
+#define SLOT_BITS 4
+#define NO_OWNER UINT64_MAX
+#define DEFRAG_BUDGET 1024 //moves per step of fs_defrag
+
+enum { OCCUPANT_FREE = -1, OCCUPANT_UNKNOWN = -2 };
+
+static fs_defrag_state *defrag_state(file_system *fs)
+{
+	if (fs->defrag == NULL) {
+		fs->defrag = calloc(1, sizeof(fs_defrag_state));
+		if (fs->defrag != NULL) fs->defrag->phase = DEFRAG_DONE;
+	}
+	return fs->defrag;
+}
+
+static void free_maps(fs_defrag_state *d)
+{
+	free(d->owner);
+	free(d->link_first);
+	free(d->link_next);
+	d->owner = NULL;
+	d->link_first = d->link_next = NULL;
+}
+
+void fs_defrag_destroy(file_system *fs)
+{
+	if (fs->defrag == NULL) return;
+	free_maps(fs->defrag);
+	free(fs->defrag);
+	fs->defrag = NULL;
+}
+
+static int block_free(file_system *fs, uint32_t b)
+{
+	return FS_LOAD(fs->free_list[b]) == 1;
+}
+
+static void build_owner(file_system *fs, fs_defrag_state *d)
+{
+	uint32_t n = fs->s_block->num_blocks;
+
+	memset(d->owner, 0xff, n * sizeof(uint64_t));
+	for (uint32_t i = 0; i < n; i++) {
+		if (fs->inodes[i].n_type != reg_file) continue;
+		for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+			int b = fs->inodes[i].direct_blocks[k];
+			if (b >= 0 && (uint32_t)b < n) d->owner[b] = ((uint64_t)i << SLOT_BITS) | k;
+		}
+	}
+	d->fresh = 1;
+}
+
+// Inode holding block b in *slot according to the map, -1 if the entry is stale
+static int holder(file_system *fs, fs_defrag_state *d, uint32_t b, int *slot)
+{
+	uint64_t e = d->owner[b];
+	if (e == NO_OWNER) return -1;
+	uint32_t i = e >> SLOT_BITS;
+	int k = e & ((1 << SLOT_BITS) - 1);
+	if (i >= fs->s_block->num_blocks || fs->inodes[i].n_type != reg_file ||
+	    fs->inodes[i].direct_blocks[k] != (int)b) return -1;
+	*slot = k;
+	return (int)i;
+}
+
+// What is in used block b: the inode holding it, OCCUPANT_FREE if it was
+// only waiting for a grace period or OCCUPANT_UNKNOWN if no file holds it
+static int occupant(file_system *fs, fs_defrag_state *d, uint32_t b, int *slot)
+{
+	int h = holder(fs, d, b, slot);
+	if (h >= 0) return h;
+	fs_reclaim_all(fs);
+	if (block_free(fs, b)) return OCCUPANT_FREE;
+	if (!d->fresh) {
+		build_owner(fs, d);
+		h = holder(fs, d, b, slot);
+	}
+	return h >= 0 ? h : OCCUPANT_UNKNOWN;
+}
+
+// Highest free block at or above lo, -1 if there is none
+static int64_t free_from_top(file_system *fs, fs_defrag_state *d, uint32_t lo)
+{
+	while (d->top > lo) {
+		uint32_t b = --d->top;
+		if (block_free(fs, b)) return b;
+	}
+	return -1;
+}
+
+// Moves block slot k of file i to the free block to
+static void move_block(file_system *fs, fs_defrag_state *d, int i, int k, uint32_t to)
+{
+	int from = fs->inodes[i].direct_blocks[k];
+
+	memcpy(fs_block_new(fs, to), fs_block_get(fs, from), sizeof(data_block));
+	fs_block_put(fs, from, 0);
+	fs_block_put(fs, to, 1);
+	FS_PUBLISH(fs->free_list[to], 0);
+	__atomic_fetch_sub(&fs->s_block->free_blocks, 1, __ATOMIC_RELAXED);
+	fs_mark_block(fs, to);
+	fs_stats_count(fs, FS_CTR_BLOCKS_ALLOCATED, 1);
+	FS_PUBLISH(fs->inodes[i].direct_blocks[k], (int)to);
+	fs_mark_inode(fs, i);
+	fs_retire_block(fs, from);
+
+	d->owner[to] = ((uint64_t)i << SLOT_BITS) | k;
+	d->owner[from] = NO_OWNER;
+	d->moved_blocks++;
+}
+
+// Puts the blocks of file i at d->next onwards
+// @return blocks moved, -1 if the file has to be tried again at the new d->next
+static int place_file(file_system *fs, fs_defrag_state *d, int i)
+{
+	uint32_t n = fs->s_block->num_blocks;
+	inode *node = &fs->inodes[i];
+	int slots[DIRECT_BLOCKS_COUNT];
+	uint32_t count = 0;
+	int moved = 0;
+
+	for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+		int b = node->direct_blocks[k];
+		if (b >= 0 && (uint32_t)b < n) slots[count++] = k;
+	}
+	if (count == 0 || d->next + count > n) return 0;
+
+	// blocks in the way (of other files or misplaced ones of this file) move out
+	for (uint32_t j = 0; j < count; j++) {
+		uint32_t p = d->next + j;
+		if (node->direct_blocks[slots[j]] == (int)p || block_free(fs, p)) continue;
+		int slot;
+		int h = occupant(fs, d, p, &slot);
+		if (h == OCCUPANT_FREE) continue;
+		if (h == OCCUPANT_UNKNOWN) {
+			d->next = p + 1;
+			return -1;
+		}
+		int64_t q = free_from_top(fs, d, d->next + count);
+		if (q < 0) return moved; //full, the file stays where it is
+		move_block(fs, d, h, slot, q);
+		moved++;
+	}
+	//with -D FS_RCU the blocks moved out are free after a grace period
+	fs_reclaim_all(fs);
+
+	for (uint32_t j = 0; j < count; j++) {
+		uint32_t p = d->next + j;
+		if (node->direct_blocks[slots[j]] == (int)p) continue;
+		move_block(fs, d, i, slots[j], p);
+		moved++;
+	}
+	d->next += count;
+	return moved;
+}
+
+static int blocks_step(file_system *fs, fs_defrag_state *d, int budget)
+{
+	uint32_t n = fs->s_block->num_blocks;
+	int moved = 0;
+
+	while (moved < budget && d->file < n) {
+		if (fs->inodes[d->file].n_type != reg_file) {
+			d->file++;
+			continue;
+		}
+		int m = place_file(fs, d, d->file);
+		if (m < 0) continue;
+		moved += m;
+		d->file++;
+	}
+	if (d->file >= n) {
+		d->phase = DEFRAG_DONE;
+		fs_reclaim_all(fs);
+	}
+	return moved;
+}
+
+// 1 if idx is listed by its parent or a file only hard links name
+static int linked(file_system *fs, uint32_t idx)
+{
+	int p = fs->inodes[idx].parent;
+	if (p == UNLINKED_PARENT) return fs->inodes[idx].links > 0;
+	if (p < 0 || (uint32_t)p >= fs->s_block->num_blocks || fs->inodes[p].n_type != directory) return 0;
+	for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+		if (fs->inodes[p].direct_blocks[k] == (int)idx) return 1;
+	}
+	return 0;
+}
+
+// Chains the hard links of every file, once per step of the inode phase
+static void build_links(file_system *fs, fs_defrag_state *d)
+{
+	uint32_t n = fs->s_block->num_blocks;
+
+	memset(d->link_first, 0xff, n * sizeof(int32_t));
+	memset(d->link_next, 0xff, n * sizeof(int32_t));
+	for (uint32_t j = 0; j < n; j++) {
+		if (fs->inodes[j].n_type != hard_link) continue;
+		int t = fs->inodes[j].direct_blocks[0];
+		if (t < 0 || (uint32_t)t >= n) continue;
+		d->link_next[j] = d->link_first[t];
+		d->link_first[t] = j;
+	}
+}
+
+// Moves inode from to the free inode to, everything naming it follows
+static void move_inode(file_system *fs, fs_defrag_state *d, int from, int to)
+{
+	uint32_t n = fs->s_block->num_blocks;
+	inode *src = &fs->inodes[from];
+
+	//not reachable before the parent's entry is published
+	memcpy(&fs->inodes[to], src, sizeof(inode));
+	fs_mark_inode(fs, to);
+	fs_stats_count(fs, FS_CTR_INODES_ALLOCATED, 1);
+
+	if (src->parent >= 0) {
+		inode *parent = &fs->inodes[src->parent];
+		for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+			if (parent->direct_blocks[k] == from) FS_PUBLISH(parent->direct_blocks[k], to);
+		}
+		fs_mark_inode(fs, src->parent);
+	}
+	if (src->n_type == directory) {
+		for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+			int c = src->direct_blocks[k];
+			if (c < 0 || (uint32_t)c >= n) continue;
+			FS_PUBLISH(fs->inodes[c].parent, to);
+			fs_mark_inode(fs, c);
+		}
+	}
+	if (src->n_type == reg_file) {
+		for (int l = d->link_first[from]; l >= 0; l = d->link_next[l]) {
+			FS_PUBLISH(fs->inodes[l].direct_blocks[0], to);
+			fs_mark_inode(fs, l);
+		}
+		d->link_first[to] = d->link_first[from];
+		d->link_first[from] = -1;
+	}
+	if (src->n_type == hard_link) {
+		//the link keeps its place in the chain of its file
+		int t = src->direct_blocks[0];
+		if (t >= 0 && (uint32_t)t < n) {
+			int32_t *l = &d->link_first[t];
+			while (*l >= 0 && *l != from) l = &d->link_next[*l];
+			if (*l == from) *l = to;
+		}
+		d->link_next[to] = d->link_next[from];
+		d->link_next[from] = -1;
+	}
+	if (fs->dir_sizes) {
+		__atomic_store_n(&fs->dir_sizes[to], __atomic_load_n(&fs->dir_sizes[from], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_store_n(&fs->dir_sizes[from], 0, __ATOMIC_RELAXED);
+	}
+	fs_retire_inode(fs, from);
+	d->moved_inodes++;
+}
+
+static int inodes_step(file_system *fs, fs_defrag_state *d, int budget)
+{
+	int moved = 0;
+
+	build_links(fs, d);
+	while (moved < budget) {
+		while (d->lo < d->hi && fs->inodes[d->lo].n_type != free_block) d->lo++;
+		while (d->hi > d->lo && fs->inodes[d->hi].n_type == free_block) d->hi--;
+		if (d->lo >= d->hi) {
+			d->phase = DEFRAG_BLOCKS;
+			d->file = 0;
+			d->next = 0;
+			d->top = fs->s_block->num_blocks;
+			break;
+		}
+		//the root stays, so do inodes already retired
+		if ((int)d->hi == fs->root_node || !linked(fs, d->hi)) {
+			d->hi--;
+			continue;
+		}
+		move_inode(fs, d, d->hi, d->lo);
+		moved++;
+	}
+	return moved;
+}
+
+int fs_defrag_step(file_system *fs, int budget)
+{
+	if (!fs) return -1;
+
+	fs_defrag_state *d = defrag_state(fs);
+	if (d == NULL) return -1;
+	TRACE_START(start);
+
+	//queued removals hold inode numbers, they go first
+	fs_reclaim_drain(fs);
+	fs_write_begin(fs);
+	fs_reclaim_all(fs);
+	fs_alloc_drain(fs);
+
+	uint32_t n = fs->s_block->num_blocks;
+	int moved = 0;
+	if (d->phase == DEFRAG_DONE) {
+		free_maps(d);
+		d->owner = malloc(n * sizeof(uint64_t));
+		d->link_first = malloc(n * sizeof(int32_t));
+		d->link_next = malloc(n * sizeof(int32_t));
+		if (d->owner == NULL || d->link_first == NULL || d->link_next == NULL) {
+			free_maps(d);
+			fs_write_end(fs);
+			return -1;
+		}
+		d->phase = DEFRAG_INODES;
+		d->lo = 0;
+		d->hi = n - 1;
+		d->fresh = 0;
+	}
+
+	if (d->phase == DEFRAG_INODES) moved += inodes_step(fs, d, budget);
+	if (d->phase == DEFRAG_BLOCKS && moved < budget) {
+		//other operations or the inode phase changed owners since the last step
+		if (!d->fresh) build_owner(fs, d);
+		d->fresh = 0;
+		moved += blocks_step(fs, d, budget - moved);
+	}
+	if (d->phase == DEFRAG_DONE) free_maps(d);
+	fs_write_end(fs);
+
+	TRACE_SPAN(TR_DEFRAG_STEP, start, moved, d->phase);
+	return moved;
+}
+
+int64_t fs_defrag(file_system *fs)
+{
+	int64_t total = 0;
+
+	//the step completing the pass ends it, another one would start a new pass
+	do {
+		int moved = fs_defrag_step(fs, DEFRAG_BUDGET);
+		if (moved < 0) return -1;
+		total += moved;
+	} while (fs->defrag->phase != DEFRAG_DONE);
+	return total;
+}
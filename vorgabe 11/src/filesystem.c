@@ -2,13 +2,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include "../lib/alloc.h"
+#include "../lib/cache.h"
+#include "../lib/concurrency.h"
+#include "../lib/defrag.h"
 #include "../lib/filesystem.h"
-#include "../lib/utils.h"
+#include "../lib/flush.h"
+#include "../lib/imageio.h"
+#include "../lib/journal.h"
+#include "../lib/reclaim.h"
+#include "../lib/stats.h"
+#include "../lib/trace.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-file_system* fs_load(const char* fs_file_path){
+// fs_load with frames > 0 is fs_load_lazy
+static file_system* load(const char* fs_file_path, uint32_t frames){
 	//open file
-	FILE* fs_file = fopen(fs_file_path,"r");
+	fs_io* fs_file = fs_io_open(fs_file_path, O_RDONLY, 0);
 	if(fs_file == NULL){
 		exit(1);
 	}
@@ -17,19 +29,36 @@ file_system* fs_load(const char* fs_file_path){
 	new_fs->s_block = malloc(sizeof(superblock));
 
 	//read size from superblock
-	fread(new_fs->s_block, sizeof(superblock), 1, fs_file);
+	fs_io_read(fs_file, new_fs->s_block, sizeof(superblock), 0);
+	fs_io_wait(fs_file);
+	uint32_t size = new_fs->s_block->num_blocks;
 
-	//allocate memory for the free list and load the free list from file
-	new_fs->free_list = malloc(new_fs->s_block->num_blocks);
-	fread(new_fs->free_list,sizeof(uint8_t), new_fs->s_block->num_blocks, fs_file);
+	//allocate memory for the free list, the inodes and the data blocks and
+	//load all of them from file at once (lazily: all but the data blocks)
+	new_fs->free_list = malloc(size);
+	new_fs->inodes = malloc(sizeof(inode) * size);
+	new_fs->data_blocks = frames == 0 ? malloc(sizeof(data_block) * size) : NULL;
+	fs_io_read(fs_file, new_fs->free_list, size, FREE_LIST_OFFSET(size));
+	fs_io_read(fs_file, new_fs->inodes, sizeof(inode) * size, INODES_OFFSET(size));
+	if (frames == 0) fs_io_read(fs_file, new_fs->data_blocks, sizeof(data_block) * size, DATA_OFFSET(size));
+	fs_io_close(fs_file);
 
-	//allocate memory for the inodes and read them from file
-	new_fs->inodes = malloc(sizeof(inode) * new_fs->s_block->num_blocks);
-	fread(new_fs->inodes,sizeof(inode), new_fs->s_block->num_blocks, fs_file);
+	new_fs->image_path = strdup(fs_file_path);
+	new_fs->cache = NULL;
+	if (frames > 0 && fs_cache_init(new_fs, frames) != 0) {
+		perror("Could not set up the block cache");
+		exit(1);
+	}
 
-	//allocate memory for the data blocks and read them from file
-	new_fs->data_blocks = malloc(sizeof(data_block)* new_fs->s_block->num_blocks);
-	fread(new_fs->data_blocks,sizeof(data_block), new_fs->s_block->num_blocks, fs_file);
+	//bring the image up to date with operations logged since the last dump
+	new_fs->journal = NULL;
+	new_fs->dir_sizes = NULL;
+	new_fs->defrag = NULL;
+	fs_stats_init(new_fs);
+	//replayed entries are dirty, a flush must write them before it drops the journal
+	fs_dirty_init(new_fs);
+	int replayed = fs_journal_replay(new_fs);
+	if (replayed > 0) TRACE(TR_JOURNAL_REPLAY, replayed, 0);
 
 	//find root node
 	for (int i = 0; i<new_fs->s_block->num_blocks; i++) {
@@ -38,13 +67,26 @@ file_system* fs_load(const char* fs_file_path){
 			break;
 		}
 	}
-	
-	LOG("Loaded filesystem from file\n");
+	fs_locks_init(new_fs);
+	fs_alloc_init(new_fs);
+	fs_reclaim_init(new_fs);
+
+	//free subtrees a deferred removal did not finish before a crash
+	fs_reclaim_orphans(new_fs);
+
+	TRACE(TR_LOAD, new_fs->s_block->num_blocks, frames);
 
-	fclose(fs_file);
 	return new_fs;
 }
 
+file_system* fs_load(const char* fs_file_path){
+	return load(fs_file_path, 0);
+}
+
+file_system* fs_load_lazy(const char* fs_file_path, uint32_t frames){
+	return load(fs_file_path, frames > 0 ? frames : FS_CACHE_DEFAULT_FRAMES);
+}
+
 file_system* fs_create(const char* fs_file_path, uint32_t size){
 	file_system* new_fs = malloc(sizeof(file_system));
 	if(new_fs == NULL){
@@ -90,8 +132,18 @@ file_system* fs_create(const char* fs_file_path, uint32_t size){
 	new_fs->inodes[0].n_type = directory;
 	strncpy(new_fs->inodes[0].name,"/",NAME_MAX_LENGTH);
 	new_fs->root_node = 0;
+	new_fs->image_path = strdup(fs_file_path);
+	new_fs->journal = NULL;
+	new_fs->dir_sizes = NULL;
+	new_fs->defrag = NULL;
+	new_fs->cache = NULL;
+	fs_stats_init(new_fs);
+
+	fs_locks_init(new_fs);
+	fs_alloc_init(new_fs);
+	fs_dirty_init(new_fs);
+	fs_reclaim_init(new_fs);
 
-	
 	new_fs->data_blocks = calloc(size,sizeof(data_block));
 	if (new_fs->data_blocks == NULL) {
 		perror("Calloc error");
@@ -101,7 +153,7 @@ file_system* fs_create(const char* fs_file_path, uint32_t size){
 
 	//write the components to file
 	fs_dump(new_fs, fs_file_path);
-	LOG("Created new file system.\n");
+	TRACE(TR_CREATE, size, 0);
 
 	return new_fs;
 
@@ -111,6 +163,7 @@ void inode_init(inode *i){
 	i->n_type=free_block;
 	i->size=0;
 	memset(i->name,0,NAME_MAX_LENGTH);
+	i->links=0;
 	for (int j=0; j<DIRECT_BLOCKS_COUNT; j++) {
 		i->direct_blocks[j] = -1;
 	}
@@ -119,21 +172,99 @@ void inode_init(inode *i){
 
 
 int fs_dump(file_system *fs, const char *file_path){
-	uint32_t size = fs->s_block->num_blocks;
+	uint64_t start = fs_stats_clock();
+
+	//writers and the flusher are excluded, entries waiting for reclamation or
+	//sitting in allocation caches are given back so the image is exact
+	pthread_mutex_lock(&fs->dirty->io_lock);
+	fs_write_begin(fs);
+	fs_reclaim_all(fs);
+	fs_alloc_drain(fs);
+	int ret = fs_dump_locked(fs, file_path);
+	fs_write_end(fs);
+	pthread_mutex_unlock(&fs->dirty->io_lock);
+
+	fs_stats_op(fs, FS_OP_DUMP, start, ret != 0);
+	return ret;
+
+}
 
-	FILE* fs_file = fopen(file_path,"w+b");
+int fs_dump_locked(file_system *fs, const char *file_path){
+	char tmp_path[strlen(file_path) + 5];
+	sprintf(tmp_path, "%s.tmp", file_path);
+
+	fs_io* fs_file = fs_io_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (fs_file == NULL){
 		exit(1);
 	}
 
-	fwrite(fs->s_block, sizeof(superblock), 1, fs_file);
-	fwrite(fs->free_list, sizeof(uint8_t),size,fs_file);
-	fwrite(fs->inodes, sizeof(inode),size,fs_file);
-	fwrite(fs->data_blocks, sizeof(data_block),size,fs_file);
-	fclose(fs_file);
+	int ret = fs_write_image(fs, fs_file);
+	if (fs_io_sync(fs_file) != 0) ret = -1;
+	if (fs_io_close(fs_file) != 0) ret = -1;
+	if (ret == 0 && rename(tmp_path, file_path) != 0) ret = -1;
+
+	//everything logged so far is part of the image now
+	if (ret == 0 && strcmp(file_path, fs->image_path) == 0) {
+		fs_journal_checkpoint(fs);
+		fs_dirty_clear(fs);
+		if (fs_cache_reopen(fs) != 0) ret = -1;
+	}
+
+	if (ret != 0) {
+		perror("Dump error");
+		unlink(tmp_path);
+	}
+	return ret;
+}
+
+
+// Data part of fs_write_image for a lazy load: the used blocks are copied
+// through the cache into a buffer written a chunk at a time
+static int write_cached_blocks(file_system *fs, fs_io *io){
+	uint32_t size = fs->s_block->num_blocks;
+	uint32_t chunk = FS_IO_CHUNK / sizeof(data_block);
+	data_block *buf = malloc(sizeof(data_block) * chunk);
+	if (buf == NULL) return -1;
+
+	uint32_t first = 0, count = 0;
+	for (uint32_t b = 0; b <= size; b++) {
+		int used = b < size && fs->free_list[b] == 0;
+		//a run ends at a free block or when the buffer is full
+		if (count > 0 && (!used || count == chunk)) {
+			fs_io_write(io, buf, sizeof(data_block) * count, DATA_OFFSET(size) + (uint64_t)first * sizeof(data_block));
+			if (fs_io_wait(io) != 0) break;
+			count = 0;
+		}
+		if (!used) continue;
+		if (count == 0) first = b;
+		memcpy(&buf[count++], fs_block_get(fs, b), sizeof(data_block));
+		fs_block_put(fs, b, 0);
+	}
+	free(buf);
+	return fs_io_truncate(io, DATA_OFFSET(size) + (uint64_t)size * sizeof(data_block));
+}
+
+int fs_write_image(file_system *fs, fs_io *io){
+	uint32_t size = fs->s_block->num_blocks;
+
+	fs_io_write(io, fs->s_block, sizeof(superblock), 0);
+	fs_io_write(io, fs->free_list, size, FREE_LIST_OFFSET(size));
+	fs_io_write(io, fs->inodes, sizeof(inode) * size, INODES_OFFSET(size));
 
-	return 0;
+	if (fs->cache != NULL) return write_cached_blocks(fs, io);
 
+	//one request per run of used blocks, the free ones between are holes
+	for (uint32_t b = 0; b < size;) {
+		if (fs->free_list[b] == 1) {
+			b++;
+			continue;
+		}
+		uint32_t first = b;
+		while (b < size && fs->free_list[b] == 0) b++;
+		fs_io_write(io, &fs->data_blocks[first], sizeof(data_block) * (b - first),
+		            DATA_OFFSET(size) + (uint64_t)first * sizeof(data_block));
+	}
+	return fs_io_truncate(io, DATA_OFFSET(size) + (uint64_t)size * sizeof(data_block));
 }
 
 
@@ -149,10 +280,22 @@ int find_free_inode(file_system* fs){
 
 void cleanup(file_system *fs){
 	
+	fs_reclaimer_stop(fs);
+	fs_flusher_stop(fs);
+	fs_journal_close(fs);
+	fs_alloc_destroy(fs);
+	fs_locks_destroy(fs);
+	fs_dirty_destroy(fs);
+	fs_reclaim_destroy(fs);
+	fs_stats_destroy(fs);
+	fs_defrag_destroy(fs);
+	fs_cache_destroy(fs);
+	free(fs->dir_sizes);
 	free(fs->s_block);
 	free(fs->inodes);
 	free(fs->free_list);
 	free(fs->data_blocks);
+	free(fs->image_path);
 	free(fs);
 
 }
@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/alloc.h"
+#include "../lib/cache.h"
+#include "../lib/concurrency.h"
+#include "../lib/flush.h"
+#include "../lib/imageio.h"
+#include "../lib/trace.h"
+
+// A contiguous region of the image and where its new content is staged
+typedef struct _segment {
+	uint64_t off;
+	size_t len;
+	size_t pos;
+} segment;
+
+typedef struct _staging {
+	segment *segs;
+	size_t count, cap;
+	uint8_t *buf;
+	size_t len, buf_cap;
+	segment *holes; //freed data blocks, only off and len are used
+	size_t hole_count, hole_cap;
+} staging;
+
+static size_t bitmap_words(file_system *fs)
+{
+	return (fs->s_block->num_blocks + 63) / 64;
+}
+
+void fs_dirty_init(file_system *fs)
+{
+	size_t words = bitmap_words(fs);
+
+	fs->dirty = calloc(1, sizeof(fs_dirty));
+	if (fs->dirty == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	fs->dirty->inodes = calloc(words, sizeof(uint64_t));
+	fs->dirty->blocks = calloc(words, sizeof(uint64_t));
+	if (fs->dirty->inodes == NULL || fs->dirty->blocks == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	pthread_mutex_init(&fs->dirty->io_lock, NULL);
+	pthread_mutex_init(&fs->dirty->lock, NULL);
+	pthread_cond_init(&fs->dirty->wake, NULL);
+	pthread_cond_init(&fs->dirty->done, NULL);
+}
+
+void fs_dirty_destroy(file_system *fs)
+{
+	fs_dirty *d = fs->dirty;
+
+	pthread_mutex_destroy(&d->io_lock);
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->wake);
+	pthread_cond_destroy(&d->done);
+	free(d->inodes);
+	free(d->blocks);
+	free(d);
+	fs->dirty = NULL;
+}
+
+void fs_dirty_clear(file_system *fs)
+{
+	size_t words = bitmap_words(fs);
+
+	memset(fs->dirty->inodes, 0, words * sizeof(uint64_t));
+	memset(fs->dirty->blocks, 0, words * sizeof(uint64_t));
+	fs->dirty->count = 0;
+}
+
+// Signalled under the lock: the flusher tests count and starts waiting
+// atomically with it, a signal in between would get lost and no later mark
+// signals again once count is past the threshold
+static void wake_flusher(fs_dirty *d)
+{
+	pthread_mutex_lock(&d->lock);
+	pthread_cond_signal(&d->wake);
+	pthread_mutex_unlock(&d->lock);
+}
+
+void fs_dirty_mark(file_system *fs, uint64_t *map, int i)
+{
+	fs_dirty *d = fs->dirty;
+	uint64_t bit = 1ull << (i & 63);
+
+	if (__atomic_load_n(&map[i >> 6], __ATOMIC_RELAXED) & bit) return;
+	if (__atomic_fetch_or(&map[i >> 6], bit, __ATOMIC_RELAXED) & bit) return;
+	if (__atomic_add_fetch(&d->count, 1, __ATOMIC_RELAXED) == d->threshold && d->running) wake_flusher(d);
+}
+
+void fs_dirty_mark_range(file_system *fs, uint64_t *map, int first, int count)
+{
+	fs_dirty *d = fs->dirty;
+	uint32_t added = 0;
+
+	for (int i = first, end = first + count; i < end;) {
+		int bits = 64 - (i & 63) < end - i ? 64 - (i & 63) : end - i;
+		uint64_t mask = (bits == 64 ? ~0ull : ((1ull << bits) - 1)) << (i & 63);
+		uint64_t old = __atomic_fetch_or(&map[i >> 6], mask, __ATOMIC_RELAXED);
+		added += __builtin_popcountll(mask & ~old);
+		i += bits;
+	}
+	if (added == 0) return;
+	uint32_t total = __atomic_add_fetch(&d->count, added, __ATOMIC_RELAXED);
+	if (total >= d->threshold && total - added < d->threshold && d->running) wake_flusher(d);
+}
+
+static void *grow(void *p, size_t *cap, size_t needed, size_t elem)
+{
+	if (needed <= *cap) return p;
+	size_t new_cap = *cap ? *cap : 64;
+	while (new_cap < needed) new_cap *= 2;
+	p = realloc(p, new_cap * elem);
+	if (p == NULL) {
+		perror("Realloc error");
+		exit(errno);
+	}
+	*cap = new_cap;
+	return p;
+}
+
+// Copies len bytes destined for image offset off, merging with the previous
+// segment if the regions touch
+static void stage(staging *s, uint64_t off, const void *src, size_t len)
+{
+	s->buf = grow(s->buf, &s->buf_cap, s->len + len, 1);
+	memcpy(s->buf + s->len, src, len);
+
+	segment *last = s->count ? &s->segs[s->count - 1] : NULL;
+	if (last && last->off + last->len == off && last->pos + last->len == s->len) {
+		last->len += len;
+	} else {
+		s->segs = grow(s->segs, &s->cap, s->count + 1, sizeof(segment));
+		s->segs[s->count].off = off;
+		s->segs[s->count].len = len;
+		s->segs[s->count].pos = s->len;
+		s->count++;
+	}
+	s->len += len;
+}
+
+static void stage_hole(staging *s, uint64_t off, size_t len)
+{
+	segment *last = s->hole_count ? &s->holes[s->hole_count - 1] : NULL;
+	if (last && last->off + last->len == off) {
+		last->len += len;
+	} else {
+		s->holes = grow(s->holes, &s->hole_cap, s->hole_count + 1, sizeof(segment));
+		s->holes[s->hole_count].off = off;
+		s->holes[s->hole_count].len = len;
+		s->hole_count++;
+	}
+}
+
+// Takes the dirty bits of one bitmap, remembering them in saved
+static void take(uint64_t *map, uint64_t *saved, size_t words)
+{
+	for (size_t k = 0; k < words; k++) {
+		saved[k] = map[k] ? __atomic_exchange_n(&map[k], 0, __ATOMIC_RELAXED) : 0;
+	}
+}
+
+// Marks everything taken dirty again after a failed write
+static void give_back(uint64_t *map, uint64_t *saved, size_t words)
+{
+	for (size_t k = 0; k < words; k++) {
+		if (saved[k]) __atomic_fetch_or(&map[k], saved[k], __ATOMIC_RELAXED);
+	}
+}
+
+int fs_flush(file_system *fs)
+{
+	fs_dirty *d = fs->dirty;
+	uint32_t n = fs->s_block->num_blocks;
+	size_t words = bitmap_words(fs);
+	staging s = {0};
+	uint64_t *inodes = malloc(words * sizeof(uint64_t));
+	uint64_t *blocks = malloc(words * sizeof(uint64_t));
+	if (inodes == NULL || blocks == NULL) {
+		perror("Malloc error");
+		exit(errno);
+	}
+	TRACE_START(start);
+
+	pthread_mutex_lock(&d->io_lock);
+
+	// snapshot: memory copies only, the filesystem is held exclusively
+	fs_write_begin(fs);
+	fs_reclaim_all(fs);
+	fs_alloc_drain(fs);
+	take(d->inodes, inodes, words);
+	take(d->blocks, blocks, words);
+	d->count = 0;
+
+	stage(&s, 0, fs->s_block, sizeof(superblock));
+	for (size_t k = 0; k < words; k++) {
+		for (uint64_t w = blocks[k]; w; w &= w - 1) {
+			uint32_t b = k * 64 + __builtin_ctzll(w);
+			stage(&s, FREE_LIST_OFFSET(n) + b, &fs->free_list[b], 1);
+		}
+	}
+	for (size_t k = 0; k < words; k++) {
+		for (uint64_t w = inodes[k]; w; w &= w - 1) {
+			uint32_t i = k * 64 + __builtin_ctzll(w);
+			stage(&s, INODES_OFFSET(n) + (uint64_t)i * sizeof(inode), &fs->inodes[i], sizeof(inode));
+		}
+	}
+	for (size_t k = 0; k < words; k++) {
+		for (uint64_t w = blocks[k]; w; w &= w - 1) {
+			uint32_t b = k * 64 + __builtin_ctzll(w);
+			uint64_t off = DATA_OFFSET(n) + (uint64_t)b * sizeof(data_block);
+			//a freed block gives its space on disk back
+			if (fs->free_list[b] == 1) {
+				stage_hole(&s, off, sizeof(data_block));
+			} else {
+				stage(&s, off, fs_block_get(fs, b), sizeof(data_block));
+				fs_block_put(fs, b, 0);
+			}
+			fs_cache_staged(fs, b);
+		}
+	}
+	// transactions from now on go to a new journal file, the old one is only
+	// needed until the image is on disk
+	fs_journal_rotate(fs);
+	fs_write_end(fs);
+
+	int ret = -1;
+	fs_io *io = fs_io_open(fs->image_path, O_WRONLY, 0);
+	if (io != NULL) {
+		for (size_t i = 0; i < s.count; i++) {
+			fs_io_write(io, s.buf + s.segs[i].pos, s.segs[i].len, s.segs[i].off);
+		}
+		for (size_t i = 0; i < s.hole_count; i++) {
+			fs_io_punch(io, s.holes[i].off, s.holes[i].len);
+		}
+		ret = fs_io_sync(io);
+		if (fs_io_close(io) != 0) ret = -1;
+	}
+
+	fs_cache_flushed(fs, ret == 0);
+	if (ret == 0) {
+		//without an open journal every replayed entry was dirty and is written now
+		if (fs->journal) fs_journal_drop_old(fs);
+		else fs_journal_checkpoint(fs);
+	} else {
+		perror("Flush error");
+		give_back(d->inodes, inodes, words);
+		give_back(d->blocks, blocks, words);
+	}
+	pthread_mutex_unlock(&d->io_lock);
+	TRACE_SPAN(TR_FLUSH, start, s.count, ret != 0);
+
+	free(s.segs);
+	free(s.buf);
+	free(s.holes);
+	free(inodes);
+	free(blocks);
+	return ret;
+}
+
+static void *flusher_main(void *arg)
+{
+	file_system *fs = arg;
+	fs_dirty *d = fs->dirty;
+
+	pthread_mutex_lock(&d->lock);
+	while (!d->stop) {
+		if (d->requested == d->completed && FS_LOAD(d->count) < d->threshold) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += d->interval_ms / 1000;
+			until.tv_nsec += (d->interval_ms % 1000) * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&d->wake, &d->lock, &until);
+		}
+		if (d->stop) break;
+
+		uint64_t gen = d->requested;
+		int pending = FS_LOAD(d->count) > 0 || gen != d->completed;
+		pthread_mutex_unlock(&d->lock);
+		int ret = pending ? fs_flush(fs) : 0;
+		pthread_mutex_lock(&d->lock);
+
+		d->error = ret;
+		if (gen > d->completed) d->completed = gen;
+		pthread_cond_broadcast(&d->done);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+int fs_flusher_start(file_system *fs, int interval_ms, uint32_t threshold)
+{
+	fs_dirty *d = fs->dirty;
+
+	d->interval_ms = interval_ms > 0 ? interval_ms : 1000;
+	d->threshold = threshold > 0 ? threshold : 1;
+	d->stop = 0;
+	if (pthread_create(&d->thread, NULL, flusher_main, fs) != 0) return -1;
+	d->running = 1;
+	return 0;
+}
+
+void fs_flusher_wake(file_system *fs)
+{
+	fs_dirty *d = fs->dirty;
+
+	if (!d->running) {
+		fs_flush(fs);
+		return;
+	}
+	pthread_mutex_lock(&d->lock);
+	d->requested++;
+	pthread_cond_signal(&d->wake);
+	pthread_mutex_unlock(&d->lock);
+}
+
+void fs_flusher_stop(file_system *fs)
+{
+	fs_dirty *d = fs->dirty;
+	if (!d->running) return;
+
+	pthread_mutex_lock(&d->lock);
+	d->stop = 1;
+	pthread_cond_signal(&d->wake);
+	pthread_mutex_unlock(&d->lock);
+	pthread_join(d->thread, NULL);
+	d->running = 0;
+
+	if (FS_LOAD(d->count) > 0) fs_flush(fs);
+}
+
+int fs_sync(file_system *fs)
+{
+	fs_dirty *d = fs->dirty;
+	int ret;
+
+	if (!d->running) {
+		ret = fs_flush(fs);
+	} else {
+		pthread_mutex_lock(&d->lock);
+		uint64_t gen = ++d->requested;
+		pthread_cond_signal(&d->wake);
+		while (d->completed < gen) pthread_cond_wait(&d->done, &d->lock);
+		ret = d->error;
+		pthread_mutex_unlock(&d->lock);
+	}
+	// with a journal nothing may stay buffered either
+	if (ret == 0) ret = fs_journal_sync(fs);
+	return ret;
+}
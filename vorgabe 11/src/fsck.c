@@ -0,0 +1,487 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../lib/alloc.h"
+#include "../lib/cache.h"
+#include "../lib/concurrency.h"
+#include "../lib/flush.h"
+#include "../lib/fsck.h"
+#include "../lib/imageio.h"
+#include "../lib/reclaim.h"
+
+#define NO_ONE -1
+#define SEVERAL -2 //lister of an inode that more than one directory lists
+
+static const char *problem_names[FSCK_PROBLEM_COUNT] = {
+	"bad inode", "bad block reference", "bad directory entry", "bad hard link",
+	"double allocation", "used block marked free", "orphaned block", "orphaned inode",
+	"listed twice", "broken parent link", "wrong link count", "wrong file size",
+	"wrong free block count"
+};
+
+typedef struct _fsck_state {
+	file_system *fs;
+	uint32_t n;
+	int root;
+	int32_t *owner; //lowest file holding each block, NO_ONE
+	int32_t *lister; //directory listing each inode, NO_ONE or SEVERAL
+	uint32_t *links; //hard links naming each inode
+	uint64_t *shared; //bitmap of blocks held by more than one file
+	uint64_t *reachable; //bitmap of inodes reachable from the root
+	fsck_report *report;
+	uint32_t free_count;
+} fsck_state;
+
+typedef struct _fsck_range {
+	fsck_state *st;
+	uint32_t first, end;
+	void *(*pass)(void *);
+} fsck_range;
+
+static inline int bit_test(const uint64_t *map, uint32_t i)
+{
+	return (__atomic_load_n(&map[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t *map, uint32_t i)
+{
+	__atomic_fetch_or(&map[i / 64], 1ull << (i % 64), __ATOMIC_RELAXED);
+}
+
+static void found(fsck_state *st, enum fsck_problem p, int64_t idx)
+{
+	fsck_report *r = st->report;
+	__atomic_add_fetch(&r->problems[p], 1, __ATOMIC_RELAXED);
+	int64_t cur = __atomic_load_n(&r->first[p], __ATOMIC_RELAXED);
+	while ((cur < 0 || idx < cur) &&
+	       !__atomic_compare_exchange_n(&r->first[p], &cur, idx, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+// The lowest file keeps a block several files claim
+static void claim_block(fsck_state *st, uint32_t b, int32_t file)
+{
+	int32_t cur = __atomic_load_n(&st->owner[b], __ATOMIC_RELAXED);
+	for (;;) {
+		if (cur != NO_ONE) bit_set(st->shared, b);
+		if (cur != NO_ONE && cur < file) return;
+		if (__atomic_compare_exchange_n(&st->owner[b], &cur, file, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+	}
+}
+
+static void list_inode(fsck_state *st, uint32_t child, int32_t dir)
+{
+	int32_t cur = __atomic_load_n(&st->lister[child], __ATOMIC_RELAXED);
+	for (;;) {
+		int32_t next = cur == NO_ONE ? dir : SEVERAL;
+		if (cur == SEVERAL || cur == dir) return;
+		if (__atomic_compare_exchange_n(&st->lister[child], &cur, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+	}
+}
+
+// Directory entry k of dir that can't name a child, whatever the child says
+static int bad_entry(fsck_state *st, const inode *dir, int k)
+{
+	int c = dir->direct_blocks[k];
+	if (c < 0 || (uint32_t)c >= st->n || c == st->root) return 1;
+	if (st->fs->inodes[c].n_type == free_block) return 1;
+	for (int j = 0; j < k; j++) {
+		if (dir->direct_blocks[j] == c) return 1;
+	}
+	return 0;
+}
+
+// Hard link target, -1 if it is no file
+static int link_target(fsck_state *st, const inode *link)
+{
+	int t = link->direct_blocks[0];
+	if (t < 0 || (uint32_t)t >= st->n || st->fs->inodes[t].n_type != reg_file) return -1;
+	return t;
+}
+
+// The parent an inode should have: the directory listing it, its own
+// parent field if several do
+static int expected_parent(fsck_state *st, uint32_t i)
+{
+	int32_t l = st->lister[i];
+	return l >= 0 ? l : st->fs->inodes[i].parent;
+}
+
+// First pass: who holds which block, who lists which inode
+static void *scan_pass(void *arg)
+{
+	fsck_range *r = arg;
+	fsck_state *st = r->st;
+
+	for (uint32_t i = r->first; i < r->end; i++) {
+		inode *node = &st->fs->inodes[i];
+		switch (node->n_type) {
+		case free_block:
+			break;
+		case reg_file:
+			for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+				int b = node->direct_blocks[k];
+				if (b == -1) continue;
+				if (b < 0 || (uint32_t)b >= st->n) {
+					found(st, FSCK_BAD_BLOCK_REF, i);
+				} else {
+					claim_block(st, b, i);
+				}
+			}
+			break;
+		case directory:
+			for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+				if (node->direct_blocks[k] == -1) continue;
+				if (bad_entry(st, node, k)) {
+					found(st, FSCK_BAD_ENTRY, i);
+				} else {
+					list_inode(st, node->direct_blocks[k], i);
+				}
+			}
+			break;
+		case hard_link: {
+			int t = link_target(st, node);
+			if (t < 0) {
+				found(st, FSCK_BAD_LINK, i);
+			} else {
+				__atomic_add_fetch(&st->links[t], 1, __ATOMIC_RELAXED);
+			}
+			break;
+		}
+		default:
+			found(st, FSCK_BAD_INODE, i);
+		}
+	}
+	return NULL;
+}
+
+// Breadth first from the root over entries whose child names the directory
+// as its (expected) parent
+static int mark_reachable(fsck_state *st)
+{
+	int *queue = malloc(st->n * sizeof(int));
+	if (queue == NULL) return -1;
+	size_t head = 0, tail = 0;
+
+	bit_set(st->reachable, st->root);
+	queue[tail++] = st->root;
+	while (head < tail) {
+		inode *dir = &st->fs->inodes[queue[head++]];
+		int d = (int)(dir - st->fs->inodes);
+		for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+			if (dir->direct_blocks[k] == -1 || bad_entry(st, dir, k)) continue;
+			uint32_t c = dir->direct_blocks[k];
+			if (expected_parent(st, c) != d || bit_test(st->reachable, c)) continue;
+			bit_set(st->reachable, c);
+			inode *child = &st->fs->inodes[c];
+			if (child->n_type == directory) {
+				queue[tail++] = c;
+			} else if (child->n_type == hard_link) {
+				int t = link_target(st, child);
+				if (t >= 0) bit_set(st->reachable, t);
+			}
+		}
+	}
+	free(queue);
+	return 0;
+}
+
+// Second pass: inodes and blocks against what the first one recorded
+static void *verify_pass(void *arg)
+{
+	fsck_range *r = arg;
+	fsck_state *st = r->st;
+	uint32_t used = 0, blocks_used = 0, free_count = 0;
+
+	for (uint32_t i = r->first; i < r->end; i++) {
+		inode *node = &st->fs->inodes[i];
+		if (node->n_type != free_block) {
+			used++;
+			if (!bit_test(st->reachable, i)) {
+				found(st, FSCK_ORPHAN_INODE, i);
+			} else if ((int)i == st->root) {
+				if (node->parent != -1) found(st, FSCK_BROKEN_PARENT, i);
+			} else {
+				if (st->lister[i] == SEVERAL) found(st, FSCK_MULTI_LISTED, i);
+				int want = st->lister[i] == NO_ONE ? UNLINKED_PARENT : expected_parent(st, i);
+				if (node->parent != want) found(st, FSCK_BROKEN_PARENT, i);
+			}
+			if (node->n_type == reg_file) {
+				if (node->links != st->links[i]) found(st, FSCK_LINK_COUNT, i);
+				uint32_t size = 0;
+				for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+					int b = node->direct_blocks[k];
+					if (b < 0 || (uint32_t)b >= st->n || st->owner[b] != (int32_t)i) continue;
+					size_t s = fs_block_get(st->fs, b)->size;
+					fs_block_put(st->fs, b, 0);
+					size += s < BLOCK_SIZE ? s : BLOCK_SIZE;
+				}
+				if (node->size != size) found(st, FSCK_FILE_SIZE, i);
+			}
+		}
+
+		uint8_t free = st->fs->free_list[i];
+		int held = st->owner[i] != NO_ONE;
+		if (held) blocks_used++;
+		if (free == 1) free_count++;
+		if (bit_test(st->shared, i)) found(st, FSCK_DOUBLE_ALLOC, i);
+		if (held && free != 0) found(st, FSCK_FREE_IN_USE, i);
+		if (!held && free != 1) found(st, FSCK_ORPHAN_BLOCK, i);
+	}
+	__atomic_add_fetch(&st->report->inodes_used, used, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->report->blocks_used, blocks_used, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->free_count, free_count, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *run_range(void *arg)
+{
+	fsck_range *r = arg;
+	return r->pass(r);
+}
+
+// Runs pass over the whole table, split into ranges of at least FSCK_CHUNK
+static void parallel(fsck_state *st, void *(*pass)(void *))
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t threads = st->n / FSCK_CHUNK + 1;
+	if (cpus > 0 && threads > (uint32_t)cpus) threads = cpus;
+
+	fsck_range ranges[threads];
+	pthread_t tids[threads];
+	uint32_t per = (st->n + threads - 1) / threads;
+	for (uint32_t t = 0; t < threads; t++) {
+		ranges[t].st = st;
+		ranges[t].first = t * per < st->n ? t * per : st->n;
+		ranges[t].end = (t + 1) * per < st->n ? (t + 1) * per : st->n;
+		ranges[t].pass = pass;
+	}
+	uint32_t started = 1;
+	for (; started < threads; started++) {
+		if (pthread_create(&tids[started], NULL, run_range, &ranges[started]) != 0) break;
+	}
+	pass(&ranges[0]);
+	//ranges whose thread could not be started run here
+	for (uint32_t t = started; t < threads; t++) pass(&ranges[t]);
+	for (uint32_t t = 1; t < started; t++) pthread_join(tids[t], NULL);
+}
+
+static void repair(fsck_state *st)
+{
+	file_system *fs = st->fs;
+	uint32_t n = st->n;
+
+	//unreachable and invalid inodes go, the others get their parent
+	for (uint32_t i = 0; i < n; i++) {
+		inode *node = &fs->inodes[i];
+		if (node->n_type == free_block) continue;
+		int bad = node->n_type < reg_file || node->n_type > hard_link ||
+		          (node->n_type == hard_link && link_target(st, node) < 0);
+		if (!bit_test(st->reachable, i) || bad) {
+			inode_init(node);
+		} else if ((int)i == st->root) {
+			node->parent = -1;
+		} else {
+			node->parent = st->lister[i] == NO_ONE ? UNLINKED_PARENT : expected_parent(st, i);
+		}
+	}
+
+	//directories keep the entries of children naming them
+	for (uint32_t i = 0; i < n; i++) {
+		inode *node = &fs->inodes[i];
+		if (node->n_type != directory) continue;
+		for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+			if (node->direct_blocks[k] == -1) continue;
+			if (bad_entry(st, node, k) || fs->inodes[node->direct_blocks[k]].parent != (int)i) {
+				node->direct_blocks[k] = -1;
+			}
+		}
+	}
+
+	//blocks go to the lowest remaining file claiming them
+	memset(fs->free_list, 1, n);
+	memset(st->links, 0, n * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; i++) {
+		inode *node = &fs->inodes[i];
+		if (node->n_type == hard_link) st->links[link_target(st, node)]++;
+		if (node->n_type != reg_file) continue;
+		uint32_t size = 0;
+		for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+			int b = node->direct_blocks[k];
+			if (b == -1) continue;
+			if (b < 0 || (uint32_t)b >= n || fs->free_list[b] == 0) {
+				node->direct_blocks[k] = -1;
+				continue;
+			}
+			fs->free_list[b] = 0;
+			data_block *db = fs_block_get(fs, b);
+			int clip = db->size > BLOCK_SIZE;
+			if (clip) db->size = BLOCK_SIZE;
+			size += db->size;
+			fs_block_put(fs, b, clip);
+		}
+		node->size = size;
+	}
+	uint32_t free_count = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		if (fs->inodes[i].n_type == reg_file) fs->inodes[i].links = st->links[i];
+		free_count += fs->free_list[i];
+	}
+	fs->s_block->free_blocks = free_count;
+}
+
+static int check(file_system *fs, int repair_it, fsck_report *report)
+{
+	fsck_state st = { .fs = fs, .n = fs->s_block->num_blocks, .root = fs->root_node, .report = report };
+	memset(report, 0, sizeof(*report));
+	for (int p = 0; p < FSCK_PROBLEM_COUNT; p++) report->first[p] = -1;
+	if (st.root < 0 || (uint32_t)st.root >= st.n || fs->inodes[st.root].n_type != directory) return -1;
+
+	size_t words = (st.n + 63) / 64;
+	st.owner = malloc(st.n * sizeof(int32_t));
+	st.lister = malloc(st.n * sizeof(int32_t));
+	st.links = calloc(st.n, sizeof(uint32_t));
+	st.shared = calloc(words, sizeof(uint64_t));
+	st.reachable = calloc(words, sizeof(uint64_t));
+	int ret = -1;
+	if (st.owner && st.lister && st.links && st.shared && st.reachable) {
+		memset(st.owner, 0xff, st.n * sizeof(int32_t)); //NO_ONE
+		memset(st.lister, 0xff, st.n * sizeof(int32_t));
+		parallel(&st, scan_pass);
+		if (mark_reachable(&st) == 0) {
+			parallel(&st, verify_pass);
+			if (st.free_count != fs->s_block->free_blocks) found(&st, FSCK_FREE_COUNT, 0);
+			ret = 0;
+			for (int p = 0; p < FSCK_PROBLEM_COUNT; p++) ret += report->problems[p];
+			if (ret > 0 && repair_it) {
+				repair(&st);
+				report->repaired = 1;
+			}
+		}
+	}
+	free(st.owner);
+	free(st.lister);
+	free(st.links);
+	free(st.shared);
+	free(st.reachable);
+	return ret;
+}
+
+int fs_check(file_system *fs, int repair, fsck_report *report)
+{
+	if (!fs) return -1;
+
+	fsck_report own;
+	if (report == NULL) report = &own;
+	//a loaded filesystem: removals and allocation caches are settled first
+	if (fs->locks) {
+		fs_reclaim_drain(fs);
+		fs_write_begin(fs);
+		fs_reclaim_all(fs);
+		fs_alloc_drain(fs);
+	}
+	int ret = check(fs, repair, report);
+	if (fs->locks) {
+		if (report->repaired) {
+			fs_dirty_mark_range(fs, fs->dirty->inodes, 0, fs->s_block->num_blocks);
+			fs_dirty_mark_range(fs, fs->dirty->blocks, 0, fs->s_block->num_blocks);
+		}
+		fs_write_end(fs);
+	}
+	return ret;
+}
+
+// A journal not replayed yet would be applied over a repaired image by the
+// next fs_load, undoing the repair
+static int journal_pending(const char *path)
+{
+	char jpath[strlen(path) + sizeof(JOURNAL_SUFFIX) + sizeof(JOURNAL_OLD_SUFFIX)];
+	struct stat sb;
+
+	sprintf(jpath, "%s%s", path, JOURNAL_SUFFIX);
+	if (stat(jpath, &sb) == 0 && sb.st_size > 0) return 1;
+	strcat(jpath, JOURNAL_OLD_SUFFIX);
+	return stat(jpath, &sb) == 0 && sb.st_size > 0;
+}
+
+int fs_check_image(const char *path, int repair, fsck_report *report)
+{
+	fsck_report own;
+	if (report == NULL) report = &own;
+
+	if (repair && journal_pending(path)) {
+		fprintf(stderr, "%s has a journal to replay, load and dump it before repairing\n", path);
+		return -1;
+	}
+
+	struct stat sb;
+	fs_io *io = stat(path, &sb) == 0 ? fs_io_open(path, O_RDONLY, 0) : NULL;
+	if (io == NULL) {
+		perror("Could not open image");
+		return -1;
+	}
+	superblock s_block = {0};
+	fs_io_read(io, &s_block, sizeof(superblock), 0);
+	fs_io_wait(io);
+	uint32_t n = s_block.num_blocks;
+	if (n == 0 || (uint64_t)sb.st_size < DATA_OFFSET(n) + (uint64_t)n * sizeof(data_block)) {
+		fprintf(stderr, "%s is no image or truncated\n", path);
+		fs_io_close(io);
+		return -1;
+	}
+
+	file_system fs = { .s_block = &s_block, .root_node = -1 };
+	fs.free_list = malloc(n);
+	fs.inodes = malloc((size_t)n * sizeof(inode));
+	fs.data_blocks = malloc((size_t)n * sizeof(data_block));
+	if (fs.free_list == NULL || fs.inodes == NULL || fs.data_blocks == NULL) {
+		perror("Malloc error");
+		exit(errno);
+	}
+	fs_io_read(io, fs.free_list, n, FREE_LIST_OFFSET(n));
+	fs_io_read(io, fs.inodes, (size_t)n * sizeof(inode), INODES_OFFSET(n));
+	fs_io_read(io, fs.data_blocks, (size_t)n * sizeof(data_block), DATA_OFFSET(n));
+	int ret = fs_io_close(io);
+
+	//the root as fs_load finds it
+	for (uint32_t i = 0; ret == 0 && i < n; i++) {
+		if (fs.inodes[i].n_type == directory && strncmp(fs.inodes[i].name, "/", NAME_MAX_LENGTH) == 0) {
+			fs.root_node = i;
+			break;
+		}
+	}
+	if (ret == 0) ret = check(&fs, repair, report);
+
+	if (ret > 0 && report->repaired) {
+		char tmp_path[strlen(path) + 5];
+		sprintf(tmp_path, "%s.tmp", path);
+		io = fs_io_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		int err = io == NULL;
+		if (io != NULL) {
+			err = fs_write_image(&fs, io) != 0;
+			if (fs_io_sync(io) != 0) err = 1;
+			if (fs_io_close(io) != 0) err = 1;
+		}
+		if (!err && rename(tmp_path, path) != 0) err = 1;
+		if (err) {
+			perror("Repair error");
+			unlink(tmp_path);
+			ret = -1;
+		}
+	}
+
+	free(fs.free_list);
+	free(fs.inodes);
+	free(fs.data_blocks);
+	return ret;
+}
+
+const char *fsck_problem_name(enum fsck_problem p)
+{
+	return p >= 0 && p < FSCK_PROBLEM_COUNT ? problem_names[p] : "?";
+}
@@ -2,16 +2,312 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "../lib/defrag.h"
 #include "../lib/filesystem.h"
+#include "../lib/flush.h"
+#include "../lib/fsck.h"
+#include "../lib/imageio.h"
+#include "../lib/journal.h"
 #include "../lib/linenoise.h"
 #include "../lib/operations.h"
+#include "../lib/reclaim.h"
+#include "../lib/resize.h"
+#include "../lib/server.h"
+#include "../lib/stats.h"
+#include "../lib/trace.h"
 #include "../lib/utils.h"
 
+#define COMMAND_HELP "Unknown command\nValid commands:\nlist\nmkfile\nmakedir\ncp\nmv\nln\nrm\nstat\ndu\nstats\nexport\nimport\nwritef\nreadf\ndump\nsync\ntrace\ndefrag\nresize\n"
+
+enum dump_mode {
+	DUMP_NOW, //write the image right away
+	DUMP_WAKE, //let the flusher do it
+	DUMP_AT_END, //batch mode: once after the last command
+};
+
+// Splits off the next word of a command line, NULL at the end
+static char *next_token(char **cursor)
+{
+	char *p = *cursor;
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+	if (*p == '\0') {
+		*cursor = p;
+		return NULL;
+	}
+	char *start = p;
+	while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+	if (*p != '\0') *p++ = '\0';
+	*cursor = p;
+	return start;
+}
+
+// Everything after the separator of the last token (text of writef), NULL if empty
+static char *rest_of_line(char **cursor)
+{
+	char *p = *cursor;
+	*cursor = p + strlen(p);
+	return *p != '\0' ? p : NULL;
+}
+
+// Table of the operations run so far plus the counters, see stats.h
+static void print_stats(file_system *fs)
+{
+	fs_stats *st = malloc(sizeof(fs_stats));
+	if (st == NULL) return;
+	fs_get_stats(fs, st);
+
+	printf("%-8s %10s %8s %10s %10s %10s\n", "op", "count", "errors", "mean_us", "p50_us", "p99_us");
+	for (int op = 0; op < FS_OP_COUNT; op++) {
+		fs_op_stats *s = &st->ops[op];
+		if (s->count == 0) continue;
+		printf("%-8s %10llu %8llu %10.2f %10.2f %10.2f\n", fs_op_name(op), (unsigned long long)s->count,
+		       (unsigned long long)s->errors, s->total_ns / 1e3 / s->count, fs_stats_percentile(s, 0.5) / 1e3,
+		       fs_stats_percentile(s, 0.99) / 1e3);
+	}
+	for (int c = 0; c < FS_CTR_COUNT; c++) {
+		printf("%s %llu\n", fs_counter_name(c), (unsigned long long)st->counters[c]);
+	}
+	printf("reclaim_pending %u\n", st->reclaim_pending);
+	free(st);
+}
+
+/*
+ * Runs one command line (modified in place)
+ * @return 1 if the session should end, 0 else
+ */
+static int run_command(file_system *fs, const char *image, char *line, enum dump_mode dump)
+{
+	char *cursor = line;
+	char *command = next_token(&cursor);
+	if(command == NULL){
+		return 0;
+	}
+
+	//determine which command to execute (only our build in commands are possible)
+	if (!strcmp(command, "mkdir")) {
+		fs_mkdir(fs, next_token(&cursor));
+	} else if (!strcmp(command, "mkfile")) {
+		fs_mkfile(fs, next_token(&cursor));
+	} else if (strcmp(command, "cp") == 0) {
+		char *src = next_token(&cursor);
+		fs_cp(fs, src, next_token(&cursor));
+	} else if (strcmp(command, "ln") == 0) {
+		char *target = next_token(&cursor);
+		fs_link(fs, target, next_token(&cursor));
+	} else if (strcmp(command, "mv") == 0) {
+		char *src = next_token(&cursor);
+		fs_mv(fs, src, next_token(&cursor));
+	} else if (!strcmp(command, "list")) {
+		char *path = next_token(&cursor);
+		if (path && !strcmp(path, "-l")) {
+			//long format straight from the iterator: type, size, name
+			fs_dir dir;
+			if (fs_opendir(fs, next_token(&cursor), &dir) == 0) {
+				for (fs_dirent *e; (e = fs_readdir(&dir)) != NULL;) {
+					printf("%s %6u %s\n", e->type == directory ? "DIR" : "FIL", e->size, e->name);
+				}
+				fs_closedir(&dir);
+			}
+		} else {
+			char *output = fs_list(fs, path);
+			if (output) fputs(output, stdout);
+			free(output);
+		}
+	} else if (!strcmp(command, "writef")) {
+		char *path = next_token(&cursor);
+		char *text = rest_of_line(&cursor);
+		fs_writef(fs, path, text);
+	} else if (!strcmp(command, "readf")) {
+		int file_size = 0;
+		char *output  = (char *)fs_readf(fs, next_token(&cursor), &file_size);
+		fwrite(output, file_size, 1, stdout);
+		if (dump != DUMP_AT_END) fflush(stdout);
+		free(output);
+	} else if (!strcmp(command, "rm")) {
+		char *path = next_token(&cursor);
+		if (path && !strcmp(path, "-d")) {
+			//unlink only, the reclaimer frees the tree in the background
+			fs_rm_deferred(fs, next_token(&cursor));
+		} else {
+			fs_rm(fs, path);
+		}
+	} else if (!strcmp(command, "stat")) {
+		fs_stat_info st;
+		if (fs_stat(fs, next_token(&cursor), &st) == 0) {
+			printf("inode %d type %s size %llu blocks %u parent %d links %u\n", st.inode,
+			       st.type == directory ? "DIR" : "FIL", (unsigned long long)st.size, st.blocks,
+			       st.parent, st.nlink);
+		}
+	} else if (!strcmp(command, "du")) {
+		//the first du turns on size tracking, from then on it is a lookup
+		fs_track_sizes(fs);
+		fs_stat_info st;
+		char *path = next_token(&cursor);
+		if (fs_stat(fs, path, &st) == 0) printf("%llu %s\n", (unsigned long long)st.size, path);
+	} else if (!strcmp(command, "stats")) {
+		char *arg = next_token(&cursor);
+		if (arg && !strcmp(arg, "reset")) {
+			fs_reset_stats(fs);
+		} else {
+			print_stats(fs);
+		}
+	} else if (!strcmp(command, "export")) {
+		char *int_path = next_token(&cursor);
+		char *ext_path = rest_of_line(&cursor);
+		fs_export(fs, int_path, ext_path);
+	} else if (!strcmp(command, "import")) {
+		char *int_path = next_token(&cursor);
+		char *ext_path = rest_of_line(&cursor);
+		fs_import(fs, int_path, ext_path);
+	} else if (!strcmp(command, "dump")) {
+		if (dump == DUMP_NOW) {
+			fs_dump(fs, image);
+		} else if (dump == DUMP_WAKE) {
+			fs_flusher_wake(fs);
+		}
+	} else if (!strcmp(command, "sync")) {
+		if (fs_sync(fs) != 0) fprintf(stderr, "sync failed\n");
+	} else if (!strcmp(command, "trace")) {
+		char *path = next_token(&cursor);
+		if (path == NULL || fs_trace_dump(path) != 0) fprintf(stderr, "trace failed\n");
+	} else if (!strcmp(command, "defrag")) {
+		char *arg = next_token(&cursor);
+		if (fs_defrag(fs) < 0) {
+			fprintf(stderr, "defrag failed\n");
+		} else {
+			printf("%llu blocks and %llu inodes moved\n", (unsigned long long)fs->defrag->moved_blocks,
+			       (unsigned long long)fs->defrag->moved_inodes);
+			fs->defrag->moved_blocks = fs->defrag->moved_inodes = 0;
+		}
+		if (arg && !strcmp(arg, "shrink")) {
+			int64_t size = fs_shrink(fs);
+			if (size < 0) {
+				fprintf(stderr, "shrink failed\n");
+			} else {
+				printf("%lld blocks\n", (long long)size);
+			}
+		}
+	} else if (!strcmp(command, "resize")) {
+		char *size = next_token(&cursor);
+		if (size == NULL || fs_resize(fs, (uint32_t)atol(size)) != 0) fprintf(stderr, "resize failed\n");
+	} else if (!strcmp(command, "exit") || !strcmp(command, "quit")) {
+		return 1;
+	} else {
+		fputs(COMMAND_HELP, stderr);
+	}
+	return 0;
+}
+
+/*
+ * Runs every line of path ("-" for stdin) without prompt or history, output
+ * is flushed only when the buffer is full. The image is written once at
+ * the end.
+ * @return exit status
+ */
+static int run_batch(file_system *fs, const char *image, const char *path)
+{
+	FILE *script = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (script == NULL) {
+		perror("Could not open script");
+		return 1;
+	}
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while ((len = getline(&line, &cap, script)) != -1) {
+		if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+		if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+		if (run_command(fs, image, line, DUMP_AT_END) != 0) break;
+	}
+	free(line);
+	if (script != stdin) fclose(script);
+	fflush(stdout);
+
+	fs_reclaim_drain(fs);
+	int ret = fs_dump(fs, image) == 0 ? 0 : 1;
+	cleanup(fs);
+	return ret;
+}
+
+/*
+ * ha2 --check: prints what fs_check_image found
+ * @return exit status as fsck(8): 0 clean, 1 repaired, 4 problems left, 8 error
+ */
+static int run_check(const char *image, int repair)
+{
+	fsck_report r;
+	int found = fs_check_image(image, repair, &r);
+	if (found < 0) {
+		fprintf(stderr, "Could not check %s\n", image);
+		return 8;
+	}
+	for (int p = 0; p < FSCK_PROBLEM_COUNT; p++) {
+		if (r.problems[p] == 0) continue;
+		printf("%-24s %10llu (first at %lld)\n", fsck_problem_name(p), (unsigned long long)r.problems[p],
+		       (long long)r.first[p]);
+	}
+	printf("%u inodes and %u blocks in use, %d problems%s\n", r.inodes_used, r.blocks_used, found,
+	       r.repaired ? ", repaired" : "");
+	if (found == 0) return 0;
+	return r.repaired ? 1 : 4;
+}
+
+static const char *trace_path;
+
+static void dump_trace(void)
+{
+	if (fs_trace_dump(trace_path) != 0) perror("Could not write trace");
+}
+
 int
 main(int argc, const char *argv[])
 {
 	file_system *fs = NULL;
+	int journal_flags = -1;
+	int flusher = 1;
+	const char *batch_path = NULL;
+	const char *serve_path = NULL;
+	int repair = 0;
+	uint32_t lazy_frames = 0;
+	enum fs_io_backend io_backend = FS_IO_PSYNC;
+	int queue_depth = FS_IO_DEFAULT_DEPTH;
+	//options follow the filename (and size with -c)
+	int opt_start = 3;
+	if (argc > 1 && (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "--create") == 0)) {
+		opt_start = 4;
+	}
+	for (int i = opt_start; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--journal") == 0) {
+			journal_flags = journal_flags < 0 ? 0 : journal_flags;
+		} else if (strcmp(argv[i], "--journal-data") == 0) {
+			journal_flags = (journal_flags < 0 ? 0 : journal_flags) | JOURNAL_DATA;
+		} else if (strcmp(argv[i], "--journal-sync") == 0) {
+			journal_flags = (journal_flags < 0 ? 0 : journal_flags) | JOURNAL_SYNC;
+		} else if (strcmp(argv[i], "--lazy") == 0 && i + 1 < argc) {
+			lazy_frames = (uint32_t)atol(argv[++i]);
+		} else if (strcmp(argv[i], "--no-flush") == 0) {
+			flusher = 0;
+		} else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+			io_backend = strcmp(argv[++i], "uring") == 0 ? FS_IO_URING : FS_IO_PSYNC;
+		} else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+			queue_depth = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) && i + 1 < argc) {
+			batch_path = argv[++i];
+		} else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			serve_path = argv[++i];
+		} else if (strcmp(argv[i], "--repair") == 0) {
+			repair = 1;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			trace_path = argv[++i];
+		}
+	}
+	fs_io_configure(io_backend, queue_depth);
+	if (trace_path != NULL) atexit(dump_trace);
+
 	if (argc < 2) {
 		fprintf(stderr,
 		        "No arguments given. You must either load a filesystem or create a new one.\n\n");
@@ -26,7 +322,9 @@ main(int argc, const char *argv[])
 			fs = fs_create(argv[2], (uint32_t)atol(argv[3]));
 		}
 	} else if (strcmp(argv[1], "-l") == 0 || strcmp(argv[1], "--load") == 0) {
-		fs = fs_load(argv[2]);
+		fs = lazy_frames > 0 ? fs_load_lazy(argv[2], lazy_frames) : fs_load(argv[2]);
+	} else if (strcmp(argv[1], "--check") == 0 && argc > 2) {
+		exit(run_check(argv[2], repair));
 	} else if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
 		printhelp();
 	}
@@ -36,6 +334,42 @@ main(int argc, const char *argv[])
 		exit(1);
 	}
 
+	if (fs && journal_flags >= 0 && fs_journal_open(fs, journal_flags, 32) != 0) {
+		perror("Could not open journal");
+		exit(1);
+	}
+	//writing back in place can tear the image in a crash and only a journal
+	//repairs that, without one the image is written whole by fs_dump
+	if (journal_flags < 0) flusher = 0;
+	if (fs && fs_reclaimer_start(fs, 4096) != 0) {
+		perror("Could not start reclaimer");
+		exit(1);
+	}
+	if (fs && serve_path != NULL) {
+		if (flusher && fs_flusher_start(fs, 1000, 256) != 0) {
+			perror("Could not start flusher");
+			exit(1);
+		}
+		//stat answers directory sizes without walking
+		fs_track_sizes(fs);
+		int ret = fs_serve(fs, serve_path);
+		//without the flusher nothing was written back yet
+		if (!flusher && fs_dump(fs, argv[2]) != 0) ret = -1;
+		cleanup(fs);
+		exit(ret == 0 ? 0 : 1);
+	}
+	if (batch_path == NULL && !isatty(STDIN_FILENO)) batch_path = "-";
+	if (batch_path != NULL) {
+		if (!fs) exit(0);
+		exit(run_batch(fs, argv[2], batch_path));
+	}
+
+	//with a journal changes are written back in the background, dump only
+	//wakes the flusher
+	if (fs && flusher && fs_flusher_start(fs, 1000, 256) != 0) {
+		perror("Could not start flusher");
+		exit(1);
+	}
 
 	linenoiseHistorySetMaxLen(20);
 
@@ -46,61 +380,10 @@ main(int argc, const char *argv[])
 		} else {
 			continue;
 		}
-		char *command = strtok(input_buf, " \n");
-		if(command == NULL){
-			LOG("Unknown command\nValid commands:\nlist\nmkfile\nmakedir\ncp\nrm\nexport\nimport\nwritef\nreadf\ndump\n");
-			free(input_buf);
-			continue;
-		}
-
-		//determine which command to execute (only our build in commands are possible)
-		if (!strcmp(command, "mkdir")) {
-			LOG("Chosen mkdir\n");
-			fs_mkdir(fs, strtok(NULL, " \n"));
-		} else if (!strcmp(command, "mkfile")) {
-			fs_mkfile(fs, strtok(NULL, " \n"));
-			LOG("Chosen mkfile\n");
-		} else if (strcmp(command, "cp") == 0) {
-        fs_cp(fs, strtok(NULL, " \n"),  strtok(NULL, " \n"));
-				LOG ("Chosen Copyfile\n");
-    } else if (!strcmp(command, "list")) {
-			LOG("Chosen list\n");
-			char *output = fs_list(fs, strtok(NULL, " \n"));
-			printf("%s", output);
-			free(output);
-		} else if (!strcmp(command, "writef")) {
-			char *path = strtok(NULL, " \n");
-			char *text = strtok(NULL, "\0");
-			fs_writef(fs, path, text);
-			LOG("Chosen writef\n");
-		} else if (!strcmp(command, "readf")) {
-			LOG("Chosen readf\n");
-			int file_size = 0;
-			char *output  = (char *)fs_readf(fs, strtok(NULL, " \n"), &file_size);
-			fwrite(output, file_size, 1, stdout);
-			fflush(stdout);
-			free(output);
-		} else if (!strcmp(command, "rm")) {
-			LOG("Chosen rm\n");
-			fs_rm(fs, strtok(NULL, " \n"));
-		} else if (!strcmp(command, "export")) {
-			char *int_path = strtok(NULL, " \n");
-			char *ext_path = strtok(NULL, "\0");
-			fs_export(fs, int_path, ext_path);
-			LOG("Chosen export\n");
-		} else if (!strcmp(command, "import")) {
-			char *int_path = strtok(NULL, " \n");
-			char *ext_path = strtok(NULL, "\0");
-			fs_import(fs, int_path, ext_path);
-		} else if (!strcmp(command, "dump")) {
-			LOG("Saving filesystem to disk\n");
-			fs_dump(fs, argv[2]);
-		} else if (!strcmp(command, "exit") || !strcmp(command, "quit")) {
+		if (run_command(fs, argv[2], input_buf, flusher ? DUMP_WAKE : DUMP_NOW) != 0) {
 			cleanup(fs);
 			free(input_buf);
 			exit(0);
-		} else {
-			LOG("Unknown command\nValid commands:\nlist\nmkfile\nmakedir\ncp\nrm\nexport\nimport\nwritef\nreadf\ndump\n");
 		}
 		free(input_buf);
 	}
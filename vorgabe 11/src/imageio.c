@@ -0,0 +1,339 @@
+#define _GNU_SOURCE //fallocate
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../lib/imageio.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define FS_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+enum { IO_READ, IO_WRITE };
+
+typedef struct _io_req {
+	int op;
+	uint8_t *buf;
+	size_t len;
+	uint64_t off;
+} io_req;
+
+// Mappings of the kernel's submission / completion rings
+typedef struct _uring {
+	int fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+#ifdef FS_HAVE_URING
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
+} uring;
+
+struct fs_io {
+	int fd;
+	int error;
+	int depth;
+	uring ring; //ring.fd < 0 with the psync backend
+	io_req *reqs; //one slot per request in flight
+	int *free_slots;
+	int nfree;
+	unsigned queued; //in the submission ring, not yet handed to the kernel
+	unsigned inflight;
+};
+
+static enum fs_io_backend cfg_backend = FS_IO_PSYNC;
+static int cfg_depth = FS_IO_DEFAULT_DEPTH;
+static int uring_state = -1; //-1 not probed, 0 unavailable, 1 works
+
+void fs_io_configure(enum fs_io_backend backend, int queue_depth)
+{
+	cfg_backend = backend;
+	cfg_depth = queue_depth > 0 ? queue_depth : FS_IO_DEFAULT_DEPTH;
+}
+
+// pread / pwrite until everything is done; reads stop at the end of the file
+static int do_sync(int fd, int op, uint8_t *buf, size_t len, uint64_t off)
+{
+	while (len > 0) {
+		ssize_t n = op == IO_READ ? pread(fd, buf, len, (off_t)off)
+		                          : pwrite(fd, buf, len, (off_t)off);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) {
+			if (op == IO_WRITE) return -1;
+			memset(buf, 0, len);
+			return 0;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+#ifdef FS_HAVE_URING
+
+static int ring_setup(uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) return -1;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+		r->cq_len = 0;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                 r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) goto fail_fd;
+	if (r->cq_len) {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                 r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) goto fail_sq;
+	} else {
+		r->cq_ptr = r->sq_ptr;
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto fail_cq;
+
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+	return 0;
+
+fail_cq:
+	if (r->cq_len) munmap(r->cq_ptr, r->cq_len);
+fail_sq:
+	munmap(r->sq_ptr, r->sq_len);
+fail_fd:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+static void ring_destroy(uring *r)
+{
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_len) munmap(r->cq_ptr, r->cq_len);
+	munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+	r->fd = -1;
+}
+
+static void complete(fs_io *io, struct io_uring_cqe *cqe)
+{
+	int slot = (int)cqe->user_data;
+	io_req *req = &io->reqs[slot];
+	int res = cqe->res;
+
+	if (res < 0 && res != -EINTR && res != -EAGAIN) {
+		io->error = -1;
+	} else if (res < 0 || (size_t)res < req->len) {
+		// short transfer, do the rest right here
+		size_t done = res < 0 ? 0 : (size_t)res;
+		if (do_sync(io->fd, req->op, req->buf + done, req->len - done, req->off + done) != 0) {
+			io->error = -1;
+		}
+	}
+	io->free_slots[io->nfree++] = slot;
+	io->inflight--;
+}
+
+// Submits everything queued and handles completions, waiting for at least
+// min of them
+static void reap(fs_io *io, unsigned min)
+{
+	uring *r = &io->ring;
+
+	for (;;) {
+		int ret = (int)syscall(__NR_io_uring_enter, r->fd, io->queued, min,
+		                       min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (ret >= 0) {
+			io->queued -= (unsigned)ret;
+			break;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			perror("io_uring_enter");
+			exit(errno);
+		}
+	}
+
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		complete(io, &r->cqes[head & *r->cq_mask]);
+		head++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void ring_queue(fs_io *io, int op, uint8_t *buf, size_t len, uint64_t off)
+{
+	uring *r = &io->ring;
+
+	while (io->nfree == 0) reap(io, 1);
+	int slot = io->free_slots[--io->nfree];
+	io->reqs[slot] = (io_req){ op, buf, len, off };
+
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe->fd = io->fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->off = off;
+	sqe->user_data = (uint64_t)slot;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	io->queued++;
+	io->inflight++;
+
+	// hand over in batches of a full queue, one syscall for depth requests
+	if (io->queued >= (unsigned)io->depth) reap(io, 0);
+}
+
+#endif //FS_HAVE_URING
+
+enum fs_io_backend fs_io_backend(void)
+{
+	if (cfg_backend != FS_IO_URING) return FS_IO_PSYNC;
+#ifdef FS_HAVE_URING
+	if (uring_state < 0) {
+		uring r;
+		uring_state = ring_setup(&r, 1) == 0;
+		if (uring_state) ring_destroy(&r);
+	}
+	return uring_state ? FS_IO_URING : FS_IO_PSYNC;
+#else
+	return FS_IO_PSYNC;
+#endif
+}
+
+fs_io *fs_io_open(const char *path, int flags, mode_t mode)
+{
+	int fd = open(path, flags, mode);
+	if (fd < 0) return NULL;
+
+	fs_io *io = calloc(1, sizeof(fs_io));
+	if (io == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	io->fd = fd;
+	io->ring.fd = -1;
+#ifdef FS_HAVE_URING
+	if (fs_io_backend() == FS_IO_URING && ring_setup(&io->ring, cfg_depth) == 0) {
+		io->depth = cfg_depth;
+		io->reqs = malloc(io->depth * sizeof(io_req));
+		io->free_slots = malloc(io->depth * sizeof(int));
+		if (io->reqs == NULL || io->free_slots == NULL) {
+			perror("Malloc error");
+			exit(errno);
+		}
+		for (int i = 0; i < io->depth; i++) io->free_slots[i] = i;
+		io->nfree = io->depth;
+	}
+#endif
+	return io;
+}
+
+static void queue(fs_io *io, int op, uint8_t *buf, size_t len, uint64_t off)
+{
+	while (len > 0) {
+		size_t n = len < FS_IO_CHUNK ? len : FS_IO_CHUNK;
+#ifdef FS_HAVE_URING
+		if (io->ring.fd >= 0) {
+			ring_queue(io, op, buf, n, off);
+		} else
+#endif
+		if (do_sync(io->fd, op, buf, n, off) != 0) {
+			io->error = -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+}
+
+void fs_io_read(fs_io *io, void *buf, size_t len, uint64_t off)
+{
+	queue(io, IO_READ, buf, len, off);
+}
+
+void fs_io_write(fs_io *io, const void *buf, size_t len, uint64_t off)
+{
+	queue(io, IO_WRITE, (uint8_t *)buf, len, off);
+}
+
+int fs_io_wait(fs_io *io)
+{
+#ifdef FS_HAVE_URING
+	if (io->ring.fd >= 0) {
+		while (io->inflight > 0) reap(io, 1);
+	}
+#endif
+	return io->error;
+}
+
+int fs_io_sync(fs_io *io)
+{
+	if (fs_io_wait(io) != 0) return -1;
+	if (fdatasync(io->fd) != 0) io->error = -1;
+	return io->error;
+}
+
+int fs_io_truncate(fs_io *io, uint64_t len)
+{
+	if (fs_io_wait(io) != 0) return -1;
+	if (ftruncate(io->fd, (off_t)len) != 0) io->error = -1;
+	return io->error;
+}
+
+void fs_io_punch(fs_io *io, uint64_t off, uint64_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (len == 0) return;
+	if (fallocate(io->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len) != 0 &&
+	    errno != EOPNOTSUPP && errno != ENOSYS) {
+		io->error = -1;
+	}
+#else
+	(void)io;
+	(void)off;
+	(void)len;
+#endif
+}
+
+int fs_io_close(fs_io *io)
+{
+	int ret = fs_io_wait(io);
+#ifdef FS_HAVE_URING
+	if (io->ring.fd >= 0) ring_destroy(&io->ring);
+#endif
+	if (close(io->fd) != 0) ret = -1;
+	free(io->reqs);
+	free(io->free_slots);
+	free(io);
+	return ret;
+}
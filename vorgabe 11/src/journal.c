@@ -0,0 +1,420 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../lib/cache.h"
+#include "../lib/flush.h"
+#include "../lib/journal.h"
+
+typedef struct _txn_item {
+	int kind;
+	int index;
+} txn_item;
+
+// entries noted by the operation currently running on this thread
+static _Thread_local struct {
+	txn_item *items;
+	size_t count, cap;
+	uint64_t seq; //last transaction committed, 0 if already waited for
+} txn;
+
+static char *journal_path_suffix(const char *image_path, const char *suffix)
+{
+	char *path = malloc(strlen(image_path) + sizeof(JOURNAL_SUFFIX) + strlen(suffix));
+	if (path == NULL) {
+		perror("Malloc error");
+		exit(errno);
+	}
+	strcpy(path, image_path);
+	strcat(path, JOURNAL_SUFFIX);
+	strcat(path, suffix);
+	return path;
+}
+
+static char *journal_path(const char *image_path)
+{
+	return journal_path_suffix(image_path, "");
+}
+
+static uint32_t fnv1a(const uint8_t *p, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+static void reserve(uint8_t **buf, size_t *cap, size_t needed)
+{
+	if (needed <= *cap) return;
+	size_t new_cap = *cap ? *cap : 4096;
+	while (new_cap < needed) new_cap *= 2;
+	*buf = realloc(*buf, new_cap);
+	if (*buf == NULL) {
+		perror("Realloc error");
+		exit(errno);
+	}
+	*cap = new_cap;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int fs_journal_open(file_system *fs, int flags, int group_size)
+{
+	char *path = journal_path(fs->image_path);
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	free(path);
+	if (fd < 0) return -1;
+
+	fs_journal *j = calloc(1, sizeof(fs_journal));
+	if (j == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	j->fd = fd;
+	j->flags = flags;
+	j->group_size = group_size > 0 ? group_size : 1;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	fs->journal = j;
+	return 0;
+}
+
+// Writes the buffer out and fsyncs. Called and returns with j->lock held,
+// the lock is dropped during the I/O so new transactions can be committed.
+static int flush_locked(fs_journal *j)
+{
+	while (j->flushing) pthread_cond_wait(&j->cond, &j->lock);
+	if (j->len == 0) return 0;
+
+	uint8_t *buf = j->buf;
+	size_t len = j->len;
+	uint64_t upto = j->seq;
+	j->buf = j->spare;
+	j->spare = buf;
+	size_t cap = j->cap;
+	j->cap = j->spare_cap;
+	j->spare_cap = cap;
+	j->len = 0;
+	j->buffered = 0;
+	j->flushing = 1;
+	pthread_mutex_unlock(&j->lock);
+
+	int ret = write_all(j->fd, buf, len);
+	if (ret == 0) ret = fdatasync(j->fd);
+	if (ret != 0) perror("Journal write error");
+
+	pthread_mutex_lock(&j->lock);
+	if (ret == 0 && upto > j->durable) j->durable = upto;
+	j->flushing = 0;
+	pthread_cond_broadcast(&j->cond);
+	return ret;
+}
+
+int fs_journal_sync(file_system *fs)
+{
+	fs_journal *j = fs->journal;
+	if (!j) return 0;
+
+	pthread_mutex_lock(&j->lock);
+	int ret = flush_locked(j);
+	pthread_mutex_unlock(&j->lock);
+	return ret;
+}
+
+void fs_journal_close(file_system *fs)
+{
+	if (!fs->journal) return;
+
+	fs_journal_sync(fs);
+	fs_journal *j = fs->journal;
+	close(j->fd);
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+	free(j->buf);
+	free(j->spare);
+	free(j);
+	fs->journal = NULL;
+}
+
+void fs_journal_note(file_system *fs, int kind, int index)
+{
+	if (txn.count == txn.cap) {
+		txn.cap = txn.cap ? txn.cap * 2 : 32;
+		txn.items = realloc(txn.items, txn.cap * sizeof(txn_item));
+		if (txn.items == NULL) {
+			perror("Realloc error");
+			exit(errno);
+		}
+	}
+	txn.items[txn.count].kind = kind;
+	txn.items[txn.count].index = index;
+	txn.count++;
+}
+
+static uint32_t block_size(file_system *fs, int b)
+{
+	size_t size = fs_block_get(fs, b)->size;
+	fs_block_put(fs, b, 0);
+	return size < BLOCK_SIZE ? (uint32_t)size : BLOCK_SIZE;
+}
+
+// Records: kind, index, then the inode or
+// free_list entry, has_data, size[, size bytes of data]
+static size_t record_size(fs_journal *j, txn_item *it, file_system *fs)
+{
+	size_t size = 1 + sizeof(uint32_t);
+	if (it->kind == JREC_INODE) return size + sizeof(inode);
+
+	size += 2 + sizeof(uint32_t);
+	if (j->flags & JOURNAL_DATA) size += block_size(fs, it->index);
+	return size;
+}
+
+void fs_journal_commit(file_system *fs)
+{
+	fs_journal *j = fs->journal;
+	if (!j || txn.count == 0) {
+		txn.count = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	size_t payload = 0;
+	for (size_t i = 0; i < txn.count; i++) {
+		payload += record_size(j, &txn.items[i], fs);
+	}
+	reserve(&j->buf, &j->cap, j->len + sizeof(journal_header) + payload);
+
+	journal_header h;
+	uint8_t *p = j->buf + j->len + sizeof(journal_header);
+	uint8_t *start = p;
+	for (size_t i = 0; i < txn.count; i++) {
+		uint8_t kind = (uint8_t)txn.items[i].kind;
+		uint32_t index = (uint32_t)txn.items[i].index;
+		*p++ = kind;
+		memcpy(p, &index, sizeof(index));
+		p += sizeof(index);
+		if (kind == JREC_INODE) {
+			memcpy(p, &fs->inodes[index], sizeof(inode));
+			p += sizeof(inode);
+		} else {
+			uint32_t size = block_size(fs, index);
+			*p++ = fs->free_list[index];
+			*p++ = (j->flags & JOURNAL_DATA) != 0;
+			memcpy(p, &size, sizeof(size));
+			p += sizeof(size);
+			if (j->flags & JOURNAL_DATA) {
+				memcpy(p, fs_block_get(fs, index)->block, size);
+				fs_block_put(fs, index, 0);
+				p += size;
+			}
+		}
+	}
+
+	h.magic = JOURNAL_MAGIC;
+	h.length = (uint32_t)payload;
+	h.seq = ++j->seq;
+	h.checksum = fnv1a(start, payload);
+	h.count = (uint32_t)txn.count;
+	memcpy(j->buf + j->len, &h, sizeof(h));
+	j->len += sizeof(journal_header) + payload;
+	j->buffered++;
+	txn.seq = j->seq;
+	pthread_mutex_unlock(&j->lock);
+
+	txn.count = 0;
+}
+
+void fs_journal_wait(file_system *fs)
+{
+	fs_journal *j = fs->journal;
+	uint64_t seq = txn.seq;
+	if (!j || seq == 0) return;
+	txn.seq = 0;
+
+	pthread_mutex_lock(&j->lock);
+	if (j->flags & JOURNAL_SYNC) {
+		// whoever gets here first writes the transactions of all waiters
+		while (j->durable < seq) {
+			if (j->flushing) {
+				pthread_cond_wait(&j->cond, &j->lock);
+			} else if (flush_locked(j) != 0) {
+				break;
+			}
+		}
+	} else if (j->buffered >= j->group_size) {
+		flush_locked(j);
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+void fs_journal_checkpoint(file_system *fs)
+{
+	fs_journal *j = fs->journal;
+	if (!j) {
+		// a journal left by an earlier session was replayed by fs_load, the
+		// image holds its changes now and a later load must not replay it
+		// over newer ones
+		char *path = journal_path(fs->image_path);
+		if (unlink(path) != 0 && errno != ENOENT) perror("Journal unlink error");
+		free(path);
+		fs_journal_drop_old(fs);
+		return;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	while (j->flushing) pthread_cond_wait(&j->cond, &j->lock);
+	j->len = 0;
+	j->buffered = 0;
+	j->durable = j->seq;
+	if (ftruncate(j->fd, 0) != 0) perror("Journal truncate error");
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+
+	fs_journal_drop_old(fs);
+}
+
+void fs_journal_rotate(file_system *fs)
+{
+	fs_journal *j = fs->journal;
+	if (!j) return;
+
+	pthread_mutex_lock(&j->lock);
+	flush_locked(j);
+	char *path = journal_path(fs->image_path);
+	char *old = journal_path_suffix(fs->image_path, JOURNAL_OLD_SUFFIX);
+	// an old journal still there belongs to a failed flush, keep it and go on
+	// appending to the current one
+	if (access(old, F_OK) != 0 && rename(path, old) == 0) {
+		int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (fd >= 0) {
+			close(j->fd);
+			j->fd = fd;
+		} else {
+			perror("Journal open error");
+			rename(old, path);
+		}
+	}
+	free(path);
+	free(old);
+	pthread_mutex_unlock(&j->lock);
+}
+
+void fs_journal_drop_old(file_system *fs)
+{
+	char *old = journal_path_suffix(fs->image_path, JOURNAL_OLD_SUFFIX);
+	if (unlink(old) != 0 && errno != ENOENT) perror("Journal unlink error");
+	free(old);
+}
+
+// Applies the records of one transaction, they were validated before. The
+// entries are marked dirty: they are not in the image until the next flush.
+static void apply(file_system *fs, const uint8_t *p, const uint8_t *end)
+{
+	uint32_t n = fs->s_block->num_blocks;
+
+	while (p < end) {
+		uint8_t kind = *p++;
+		uint32_t index;
+		memcpy(&index, p, sizeof(index));
+		p += sizeof(index);
+		if (kind == JREC_INODE) {
+			if (index < n) {
+				memcpy(&fs->inodes[index], p, sizeof(inode));
+				fs_mark_inode(fs, index);
+			}
+			p += sizeof(inode);
+		} else {
+			uint8_t is_free = *p++;
+			uint8_t has_data = *p++;
+			uint32_t size;
+			memcpy(&size, p, sizeof(size));
+			p += sizeof(size);
+			if (index < n && size <= BLOCK_SIZE) {
+				fs->free_list[index] = is_free;
+				data_block *db = fs_block_get(fs, index);
+				db->size = size;
+				if (has_data) memcpy(db->block, p, size);
+				fs_block_put(fs, index, 1);
+				fs_mark_block(fs, index);
+			}
+			if (has_data) p += size;
+		}
+	}
+}
+
+// Replays one journal file, truncating a torn tail
+static int replay_file(file_system *fs, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) return 0;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf = malloc(size > 0 ? size : 1);
+	if (buf == NULL || fread(buf, 1, size, f) != (size_t)size) {
+		free(buf);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	int replayed = 0;
+	size_t off = 0;
+	while (off + sizeof(journal_header) <= (size_t)size) {
+		journal_header h;
+		memcpy(&h, buf + off, sizeof(h));
+		const uint8_t *p = buf + off + sizeof(h);
+		// a torn or foreign tail ends the replay
+		if (h.magic != JOURNAL_MAGIC || h.length > size - off - sizeof(h)) break;
+		if (fnv1a(p, h.length) != h.checksum) break;
+		apply(fs, p, p + h.length);
+		off += sizeof(h) + h.length;
+		replayed++;
+	}
+	free(buf);
+
+	// new transactions must not end up behind a torn tail
+	if (off < (size_t)size && truncate(path, off) != 0) perror("Journal truncate error");
+	return replayed;
+}
+
+int fs_journal_replay(file_system *fs)
+{
+	// the journal rotated away by an unfinished flush comes first
+	char *old = journal_path_suffix(fs->image_path, JOURNAL_OLD_SUFFIX);
+	char *path = journal_path(fs->image_path);
+	int replayed = replay_file(fs, old);
+	int current = replayed < 0 ? -1 : replay_file(fs, path);
+	free(old);
+	free(path);
+	if (current < 0) return -1;
+	replayed += current;
+
+	// free_blocks is not logged, it follows from the free list
+	uint32_t free_blocks = 0;
+	for (uint32_t i = 0; i < fs->s_block->num_blocks; i++) {
+		free_blocks += fs->free_list[i] == 1;
+	}
+	fs->s_block->free_blocks = free_blocks;
+	return replayed;
+}
@@ -1,55 +1,105 @@
 #include "../lib/operations.h"
+#include "../lib/alloc.h"
+#include "../lib/cache.h"
+#include "../lib/concurrency.h"
+#include "../lib/flush.h"
+#include "../lib/reclaim.h"
+#include "../lib/stats.h"
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
+// Compares an inode name with a path segment that is not 0-terminated
+static int name_matches(const char *name, const char *seg, size_t len)
+{
+    if (len > NAME_MAX_LENGTH) return 0;
+    if (strncmp(name, seg, len) != 0) return 0;
+    return len == NAME_MAX_LENGTH || name[len] == '\0';
+}
+
+// Sets an inode name, the bytes after a shorter name are 0
+static void set_name(char *dst, const char *name)
+{
+    size_t len = strnlen(name, NAME_MAX_LENGTH);
+    memcpy(dst, name, len);
+    memset(dst + len, 0, NAME_MAX_LENGTH - len);
+}
+
+// Returns the inode number of the entry called seg in directory dir or -1,
+// adds the number of names compared to *compares if not NULL
+static int lookup_child(file_system *fs, int dir, const char *seg, size_t len, int *compares)
+{
+    int n, found;
+    uint32_t seq;
+    do {
+        seq = fs_name_read_begin(fs);
+        n = 0;
+        found = -1;
+        for (int i = 0; i < DIRECT_BLOCKS_COUNT && found == -1; i++) {
+            int c = FS_LOAD(fs->inodes[dir].direct_blocks[i]);
+            if (c == -1) continue;
+            n++;
+            if (name_matches(fs->inodes[c].name, seg, len)) found = c;
+        }
+    } while (fs_name_read_retry(fs, seq));
+    if (compares) *compares += n;
+    return found;
+}
+
+// Resolves an absolute path without modifying or copying it, so it is safe
+// to call from several readers at once (unlike strtok)
 static int find_inode_by_path(file_system *fs, const char *path)
 {
     if (!path || path[0] != '/') return -1;
-    if (strcmp(path, "/") == 0) return fs->root_node;
 
     int curr = fs->root_node;
-    char temp[strlen(path) + 1];
-    strcpy(temp, path + 1); // skip initial slash
+    int compares = 0;
+    const char *p = path;
+    while (*p && curr != -1) {
+        while (*p == '/') p++;
+        if (!*p) break;
 
-    char *seg = strtok(temp, "/");
-    while (seg) {
-        int next = -1;
-        for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-            int c = fs->inodes[curr].direct_blocks[i];
-            if (c != -1 && strncmp(fs->inodes[c].name, seg, NAME_MAX_LENGTH) == 0) {
-                next = c;
-                break;
-            }
+        const char *end = p;
+        while (*end && *end != '/') end++;
+
+        if (FS_LOAD(fs->inodes[curr].n_type) != directory) {
+            curr = -1;
+            break;
         }
-        if (next == -1) return -1;
-        curr = next;
-        seg = strtok(NULL, "/");
+        curr = lookup_child(fs, curr, p, (size_t)(end - p), &compares);
+        p = end;
     }
+    fs_stats_count(fs, FS_CTR_NAME_COMPARES, compares);
     return curr;
 }
 
-// Searches for a free data block index
-static int find_free_block(file_system *fs)
-{
-    for (int i = 0; i < fs->s_block->num_blocks; ++i) {
-        if (fs->free_list[i]) return i;
-    }
-    return -1;
-}
-
 // Connects a child inode to a parent directory
 static int add_child_inode(file_system *fs, int parent, int child)
 {
     for (int i = 0; i < DIRECT_BLOCKS_COUNT; ++i) {
         if (fs->inodes[parent].direct_blocks[i] == -1) {
-            fs->inodes[parent].direct_blocks[i] = child;
+            FS_PUBLISH(fs->inodes[parent].direct_blocks[i], child);
+            fs_mark_inode(fs, parent);
             return 0;
         }
     }
     return -1; // No space left
 }
 
+// Disconnects a child inode from its parent directory
+static void remove_child_inode(file_system *fs, int parent, int child)
+{
+    for (int i = 0; i < DIRECT_BLOCKS_COUNT; ++i) {
+        if (fs->inodes[parent].direct_blocks[i] == child) {
+            FS_PUBLISH(fs->inodes[parent].direct_blocks[i], -1);
+            fs_mark_inode(fs, parent);
+            return;
+        }
+    }
+}
+
 // Splits a path into the parent and final component
 static int split_path(const char *path, char *parent_out, const char **name_out)
 {
@@ -71,36 +121,140 @@ static int split_path(const char *path, char *parent_out, const char **name_out)
     return 0;
 }
 
-// Makes a new directory under a given absolute path
-int fs_mkdir(file_system *fs, char *path)
+// Inodes and blocks reserved up front by fs_batch. Operations take from the
+// pool while it lasts and fall back to the allocator afterwards.
+typedef struct _alloc_pool {
+    int *inodes;
+    int inode_count, inode_pos;
+    int *blocks;
+    int block_count, block_pos;
+} alloc_pool;
+
+static int new_inode(file_system *fs, alloc_pool *pool, enum node_type type)
 {
-    if (!fs || !path || path[0] != '/') return -1;
+    if (!pool || pool->inode_pos == pool->inode_count) return fs_alloc_inode(fs, type);
+    int i = pool->inodes[pool->inode_pos++];
+    FS_PUBLISH(fs->inodes[i].n_type, type);
+    fs_mark_inode(fs, i);
+    return i;
+}
+
+static int new_block(file_system *fs, alloc_pool *pool)
+{
+    if (!pool || pool->block_pos == pool->block_count) return fs_alloc_block(fs);
+    return pool->blocks[pool->block_pos++];
+}
 
+// Undoes the last new_block (in reverse order of allocation)
+static void drop_block(file_system *fs, alloc_pool *pool, int b)
+{
+    if (pool && pool->block_pos > 0 && pool->blocks[pool->block_pos - 1] == b) {
+        pool->block_pos--;
+    } else {
+        fs_free_block(fs, b);
+    }
+}
+
+// Creates a new inode of the given type under path and returns its number,
+// a hard link gets target as direct_blocks[0].
+// Returns dup_ret if an entry with that name already exists, -1 on other errors
+static int create_entry(file_system *fs, alloc_pool *pool, char *path, enum node_type type, int dup_ret,
+                        int target)
+{
     char parent_path[strlen(path) + 1];
-    const char *dir_name;
-    if (split_path(path, parent_path, &dir_name) != 0) return -1;
+    const char *name;
+    if (split_path(path, parent_path, &name) != 0) return -1;
 
     int parent_idx = find_inode_by_path(fs, parent_path);
     if (parent_idx < 0 || fs->inodes[parent_idx].n_type != directory) return -1;
 
+    int has_slot = 0;
     for (int i = 0; i < DIRECT_BLOCKS_COUNT; ++i) {
         int ch = fs->inodes[parent_idx].direct_blocks[i];
-        if (ch != -1 && strncmp(fs->inodes[ch].name, dir_name, NAME_MAX_LENGTH) == 0) {
-            return -1; // already exists
+        if (ch == -1) {
+            has_slot = 1;
+        } else if (name_matches(fs->inodes[ch].name, name, strlen(name))) {
+            return dup_ret;
         }
     }
+    if (!has_slot) return -1;
 
-    int free_i = find_free_inode(fs);
+    int free_i = new_inode(fs, pool, type);
     if (free_i < 0) return -1;
 
-    inode_init(&fs->inodes[free_i]);
-    fs->inodes[free_i].n_type = directory;
-    strncpy(fs->inodes[free_i].name, dir_name, NAME_MAX_LENGTH);
+    // the inode is completely set up before add_child_inode publishes it
+    set_name(fs->inodes[free_i].name, name);
     fs->inodes[free_i].parent = parent_idx;
+    if (type == hard_link) fs->inodes[free_i].direct_blocks[0] = target;
+    if (type == directory && fs->dir_sizes) fs->dir_sizes[free_i] = 0;
 
-    if (add_child_inode(fs, parent_idx, free_i) != 0) return -1;
+    add_child_inode(fs, parent_idx, free_i);
+    return free_i;
+}
 
-    return 0;
+static int create_node(file_system *fs, alloc_pool *pool, char *path, enum node_type type, int dup_ret)
+{
+    return create_entry(fs, pool, path, type, dup_ret, -1);
+}
+
+// The file a directory entry stands for: the target of a hard link, else idx
+static int resolve_link(file_system *fs, int idx)
+{
+    if (idx >= 0 && FS_LOAD(fs->inodes[idx].n_type) == hard_link) {
+        return FS_LOAD(fs->inodes[idx].direct_blocks[0]);
+    }
+    return idx;
+}
+
+// find_inode_by_path, following a hard link in the last component
+static int find_file_by_path(file_system *fs, const char *path)
+{
+    return resolve_link(fs, find_inode_by_path(fs, path));
+}
+
+// Bytes idx adds to the directories above it: the size of a file, the total
+// of a directory and nothing for a hard link (its file counts where it lives)
+static uint64_t entry_size(file_system *fs, int idx)
+{
+    inode *node = &fs->inodes[idx];
+    if (node->n_type == directory) return __atomic_load_n(&fs->dir_sizes[idx], __ATOMIC_RELAXED);
+    return node->n_type == reg_file ? node->size : 0;
+}
+
+// Adds delta to sizes[dir] and the entries of every directory above it.
+// Atomic, writers of different files get here at the same time.
+static void add_size(file_system *fs, uint64_t *sizes, int dir, int64_t delta)
+{
+    for (int i = dir; i >= 0; i = fs->inodes[i].parent) {
+        __atomic_add_fetch(&sizes[i], (uint64_t)delta, __ATOMIC_RELAXED);
+        if (i == fs->root_node) break;
+    }
+}
+
+// Keeps the tracked directory sizes (if any) up to date
+static void add_dir_size(file_system *fs, int dir, int64_t delta)
+{
+    if (fs->dir_sizes && delta != 0) add_size(fs, fs->dir_sizes, dir, delta);
+}
+
+// Adds (sign 1) or removes (sign -1) the bytes below idx to / from the
+// directories above it, around linking or unlinking idx
+static void count_entry(file_system *fs, int idx, int sign)
+{
+    if (fs->dir_sizes) add_dir_size(fs, fs->inodes[idx].parent, sign * (int64_t)entry_size(fs, idx));
+}
+
+// Makes a new directory under a given absolute path
+int fs_mkdir(file_system *fs, char *path)
+{
+    if (!fs || !path || path[0] != '/') return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_write_begin(fs);
+    int ret = create_node(fs, NULL, path, directory, -1);
+    fs_write_end(fs);
+    fs_stats_op(fs, FS_OP_MKDIR, start, ret < 0);
+    return ret < 0 ? ret : 0;
 }
 
 // Creates a new regular file
@@ -108,29 +262,788 @@ int fs_mkfile(file_system *fs, char *path_and_name)
 {
     if (!fs || !path_and_name || path_and_name[0] != '/') return -1;
 
-    char parent_path[strlen(path_and_name) + 1];
-    const char *filename;
-    if (split_path(path_and_name, parent_path, &filename) != 0) return -1;
+    uint64_t start = fs_stats_clock();
+    fs_write_begin(fs);
+    int ret = create_node(fs, NULL, path_and_name, reg_file, -2);
+    fs_write_end(fs);
+    fs_stats_op(fs, FS_OP_MKFILE, start, ret < 0);
+    return ret < 0 ? ret : 0;
+}
 
-    int parent_idx = find_inode_by_path(fs, parent_path);
-    if (parent_idx < 0 || fs->inodes[parent_idx].n_type != directory) return -1;
+// Copies the content of a regular file into a new buffer (0-terminated for
+// convenience). Every block size is loaded once, so a concurrent append is
+// either seen completely or not at all.
+static uint8_t *read_file(file_system *fs, int idx, int *file_size)
+{
+    int blocks[DIRECT_BLOCKS_COUNT];
+    data_block *dbs[DIRECT_BLOCKS_COUNT];
+    size_t sizes[DIRECT_BLOCKS_COUNT];
+    size_t total = 0;
+    int n = 0;
 
-    for (int i = 0; i < DIRECT_BLOCKS_COUNT; ++i) {
-        int ch = fs->inodes[parent_idx].direct_blocks[i];
-        if (ch != -1 && strncmp(fs->inodes[ch].name, filename, NAME_MAX_LENGTH) == 0) {
-            return -2; // duplicate
+    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+        int b = FS_LOAD(fs->inodes[idx].direct_blocks[i]);
+        if (b == -1) continue;
+        blocks[n] = b;
+        dbs[n] = fs_block_get(fs, b);
+        sizes[n] = MIN(FS_LOAD(dbs[n]->size), BLOCK_SIZE);
+        total += sizes[n++];
+    }
+
+    uint8_t *buf = total > 0 ? malloc(total + 1) : NULL;
+    size_t off = 0;
+    for (int i = 0; i < n; i++) {
+        if (buf) memcpy(buf + off, dbs[i]->block, sizes[i]);
+        fs_block_put(fs, blocks[i], 0);
+        off += sizes[i];
+    }
+    if (!buf) return NULL;
+    buf[total] = '\0';
+    *file_size = (int)total;
+    fs_stats_count(fs, FS_CTR_BYTES_READ, total);
+    return buf;
+}
+
+uint8_t *fs_readf(file_system *fs, char *filename, int *file_size)
+{
+    if (!fs || !filename || !file_size) return NULL;
+    *file_size = 0;
+
+    uint64_t start = fs_stats_clock();
+    fs_read_begin(fs);
+    uint8_t *buf = NULL;
+    int idx = find_file_by_path(fs, filename);
+    int is_file = idx >= 0 && FS_LOAD(fs->inodes[idx].n_type) == reg_file;
+    if (is_file) buf = read_file(fs, idx, file_size);
+    fs_read_end(fs);
+    fs_stats_op(fs, FS_OP_READF, start, !is_file);
+    return buf;
+}
+
+int fs_stat(file_system *fs, char *path, fs_stat_info *st)
+{
+    if (!fs || !path || !st) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_read_begin(fs);
+    int idx = find_file_by_path(fs, path);
+    if (idx >= 0) {
+        inode *node = &fs->inodes[idx];
+        uint64_t *dir_sizes = FS_LOAD(fs->dir_sizes);
+        st->inode = idx;
+        st->type = FS_LOAD(node->n_type);
+        st->size = FS_LOAD(node->size);
+        if (st->type == directory) st->size = dir_sizes ? __atomic_load_n(&dir_sizes[idx], __ATOMIC_RELAXED) : 0;
+        st->blocks = 0;
+        for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+            st->blocks += FS_LOAD(node->direct_blocks[i]) != -1;
         }
+        st->parent = FS_LOAD(node->parent);
+        // the own name (unless removed) plus every hard link
+        st->nlink = FS_LOAD(node->links) + (st->parent != UNLINKED_PARENT);
     }
+    fs_read_end(fs);
+    fs_stats_op(fs, FS_OP_STAT, start, idx < 0);
+    return idx < 0 ? -1 : 0;
+}
 
-    int free_i = find_free_inode(fs);
-    if (free_i < 0) return -1;
+int fs_track_sizes(file_system *fs)
+{
+    if (!fs) return -1;
 
-    inode_init(&fs->inodes[free_i]);
-    fs->inodes[free_i].n_type = reg_file;
-    strncpy(fs->inodes[free_i].name, filename, NAME_MAX_LENGTH);
-    fs->inodes[free_i].parent = parent_idx;
+    fs_write_begin(fs);
+    int ret = 0;
+    if (!fs->dir_sizes) {
+        uint64_t *sizes = calloc(fs->s_block->num_blocks, sizeof(uint64_t));
+        if (sizes) {
+            // published once complete, lock-free readers never see partial totals
+            for (uint32_t i = 0; i < fs->s_block->num_blocks; i++) {
+                if (fs->inodes[i].n_type == reg_file) add_size(fs, sizes, fs->inodes[i].parent, fs->inodes[i].size);
+            }
+            FS_PUBLISH(fs->dir_sizes, sizes);
+        } else {
+            ret = -1;
+        }
+    }
+    fs_write_end(fs);
+    return ret;
+}
+
+int fs_lookup(file_system *fs, char *path, inode *out)
+{
+    if (!fs || !path) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_read_begin(fs);
+    int idx = find_file_by_path(fs, path);
+    if (idx >= 0 && out) memcpy(out, &fs->inodes[idx], sizeof(inode));
+    fs_read_end(fs);
+    fs_stats_op(fs, FS_OP_LOOKUP, start, idx < 0);
+    return idx;
+}
+
+int fs_opendir(file_system *fs, char *path, fs_dir *dir)
+{
+    if (!fs || !path || !dir) return -1;
 
-    if (add_child_inode(fs, parent_idx, free_i) != 0) return -1;
+    fs_read_begin(fs);
+    int idx = find_inode_by_path(fs, path);
+    if (idx < 0 || FS_LOAD(fs->inodes[idx].n_type) != directory) {
+        fs_read_end(fs);
+        return -1;
+    }
 
+    // snapshot of the children, sorted by inode number
+    dir->fs = fs;
+    dir->inode = idx;
+    dir->count = 0;
+    dir->pos = 0;
+    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+        int c = FS_LOAD(fs->inodes[idx].direct_blocks[i]);
+        if (c == -1) continue;
+        int j = dir->count++;
+        while (j > 0 && dir->children[j - 1] > c) {
+            dir->children[j] = dir->children[j - 1];
+            j--;
+        }
+        dir->children[j] = c;
+    }
+    fs_read_end(fs);
     return 0;
 }
+
+fs_dirent *fs_readdir(fs_dir *dir)
+{
+    file_system *fs = dir->fs;
+    fs_dirent *e = &dir->entry;
+
+    fs_read_begin(fs);
+    while (dir->pos < dir->count) {
+        int c = dir->children[dir->pos++];
+        // skip entries removed since fs_opendir
+        inode *node = &fs->inodes[c];
+        enum node_type type = FS_LOAD(node->n_type);
+        if (type == free_block || FS_LOAD(node->parent) != dir->inode) continue;
+
+        // a hard link looks like the file it names
+        int file = resolve_link(fs, c);
+        e->inode = file;
+        e->type = FS_LOAD(fs->inodes[file].n_type);
+        e->size = FS_LOAD(fs->inodes[file].size);
+        uint32_t seq;
+        do {
+            seq = fs_name_read_begin(fs);
+            memcpy(e->name, node->name, NAME_MAX_LENGTH);
+        } while (fs_name_read_retry(fs, seq));
+        e->name[NAME_MAX_LENGTH] = '\0';
+        fs_read_end(fs);
+        return e;
+    }
+    fs_read_end(fs);
+    return NULL;
+}
+
+void fs_closedir(fs_dir *dir)
+{
+    dir->count = dir->pos = 0;
+}
+
+char *fs_list(file_system *fs, char *path)
+{
+    if (!fs) return NULL;
+
+    uint64_t start = fs_stats_clock();
+    fs_dir dir;
+    if (fs_opendir(fs, path, &dir) != 0) {
+        fs_stats_op(fs, FS_OP_LIST, start, 1);
+        return NULL;
+    }
+
+    // "DIR " / "FIL " + name + '\n' per entry, counted while reading
+    fs_dirent entries[DIRECT_BLOCKS_COUNT];
+    size_t lengths[DIRECT_BLOCKS_COUNT];
+    size_t total = 0;
+    int n = 0;
+    for (fs_dirent *e; (e = fs_readdir(&dir)) != NULL; n++) {
+        entries[n] = *e;
+        lengths[n] = strlen(e->name);
+        total += lengths[n] + 5;
+    }
+    fs_closedir(&dir);
+
+    char *out = malloc(total + 1);
+    if (out) {
+        char *p = out;
+        for (int i = 0; i < n; i++) {
+            memcpy(p, entries[i].type == directory ? "DIR " : "FIL ", 4);
+            memcpy(p + 4, entries[i].name, lengths[i]);
+            p[4 + lengths[i]] = '\n';
+            p += lengths[i] + 5;
+        }
+        *p = '\0';
+    }
+    fs_stats_op(fs, FS_OP_LIST, start, 0);
+    return out;
+}
+
+int fs_export(file_system *fs, char *int_path, char *ext_path)
+{
+    if (!fs || !int_path || !ext_path) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_read_begin(fs);
+    uint8_t *buf = NULL;
+    int file_size = 0;
+    int idx = find_file_by_path(fs, int_path);
+    int is_file = idx >= 0 && FS_LOAD(fs->inodes[idx].n_type) == reg_file;
+    if (is_file) buf = read_file(fs, idx, &file_size);
+    fs_read_end(fs);
+
+    // the external write happens without holding the filesystem
+    int ret = -1;
+    FILE *ext = is_file ? fopen(ext_path, "wb") : NULL;
+    if (ext) {
+        size_t written = buf ? fwrite(buf, 1, file_size, ext) : 0;
+        fclose(ext);
+        ret = written == (size_t)file_size ? 0 : -1;
+    }
+    free(buf);
+    fs_stats_op(fs, FS_OP_EXPORT, start, ret < 0);
+    return ret;
+}
+
+// Appends len bytes to the regular file idx: first into the free space of its
+// last block, then into newly allocated blocks. Either everything is written
+// or nothing (-2 if it does not fit). The caller serialises updates of idx.
+static int append_data(file_system *fs, alloc_pool *pool, int idx, const uint8_t *data, size_t len)
+{
+    inode *node = &fs->inodes[idx];
+
+    int tail = -1;
+    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+        if (node->direct_blocks[i] != -1) tail = i;
+    }
+
+    size_t room = 0;
+    if (tail >= 0) {
+        size_t used = fs_block_get(fs, node->direct_blocks[tail])->size;
+        fs_block_put(fs, node->direct_blocks[tail], 0);
+        room = BLOCK_SIZE - MIN(used, BLOCK_SIZE);
+    }
+
+    int new_blocks = len > room ? (int)((len - room + BLOCK_SIZE - 1) / BLOCK_SIZE) : 0;
+    if (tail + 1 + new_blocks > DIRECT_BLOCKS_COUNT) return -2;
+
+    int blocks[DIRECT_BLOCKS_COUNT];
+    for (int i = 0; i < new_blocks; i++) {
+        blocks[i] = new_block(fs, pool);
+        if (blocks[i] < 0) {
+            while (i-- > 0) drop_block(fs, pool, blocks[i]);
+            return -2;
+        }
+    }
+
+    // data is always in place before the size / slot that makes it visible
+    size_t off = 0;
+    if (room > 0) {
+        data_block *db = fs_block_get(fs, node->direct_blocks[tail]);
+        off = MIN(room, len);
+        memcpy(db->block + db->size, data, off);
+        FS_PUBLISH(db->size, db->size + off);
+        fs_block_put(fs, node->direct_blocks[tail], 1);
+        fs_mark_block(fs, node->direct_blocks[tail]);
+    }
+    for (int i = 0; i < new_blocks; i++) {
+        data_block *db = fs_block_get(fs, blocks[i]);
+        size_t n = MIN((size_t)BLOCK_SIZE, len - off);
+        memcpy(db->block, data + off, n);
+        db->size = n;
+        fs_block_put(fs, blocks[i], 1);
+        FS_PUBLISH(node->direct_blocks[tail + 1 + i], blocks[i]);
+        off += n;
+    }
+    FS_PUBLISH(node->size, (uint16_t)(node->size + len));
+    fs_mark_inode(fs, idx);
+    add_dir_size(fs, node->parent, (int64_t)len);
+    fs_stats_count(fs, FS_CTR_BYTES_WRITTEN, len);
+    return (int)len;
+}
+
+int fs_writef(file_system *fs, char *filename, char *text)
+{
+    if (!fs || !filename || !text) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_update_begin(fs);
+    int ret = -1;
+    int idx = find_file_by_path(fs, filename);
+    if (idx >= 0 && fs->inodes[idx].n_type == reg_file) {
+        fs_inode_lock(fs, idx);
+        ret = append_data(fs, NULL, idx, (const uint8_t *)text, strlen(text));
+        fs_journal_commit(fs); // while the inode is still locked
+        fs_inode_unlock(fs, idx);
+    }
+    fs_update_end(fs);
+    fs_stats_op(fs, FS_OP_WRITEF, start, ret < 0);
+    return ret;
+}
+
+// Replaces the content of the regular file idx with len bytes. The new
+// blocks are filled before the old ones are released, so the file is
+// unchanged if they can't be allocated (-2). Called with the write lock held.
+static int replace_data(file_system *fs, int idx, const uint8_t *data, size_t len)
+{
+    inode *node = &fs->inodes[idx];
+    int count = (int)((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (count > DIRECT_BLOCKS_COUNT) return -2;
+
+    int blocks[DIRECT_BLOCKS_COUNT];
+    for (int i = 0; i < count; i++) {
+        blocks[i] = fs_alloc_block(fs);
+        if (blocks[i] < 0) {
+            while (i-- > 0) fs_free_block(fs, blocks[i]);
+            return -2;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        data_block *db = fs_block_get(fs, blocks[i]);
+        size_t off = (size_t)i * BLOCK_SIZE;
+        size_t n = MIN((size_t)BLOCK_SIZE, len - off);
+        memcpy(db->block, data + off, n);
+        db->size = n;
+        fs_block_put(fs, blocks[i], 1);
+    }
+
+    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+        int old = node->direct_blocks[i];
+        FS_PUBLISH(node->direct_blocks[i], i < count ? blocks[i] : -1);
+        if (old != -1) fs_retire_block(fs, old);
+    }
+    add_dir_size(fs, node->parent, (int64_t)len - (int64_t)node->size);
+    FS_PUBLISH(node->size, (uint16_t)len);
+    fs_mark_inode(fs, idx);
+    fs_stats_count(fs, FS_CTR_BYTES_WRITTEN, len);
+    return (int)len;
+}
+
+int fs_import(file_system *fs, char *int_path, char *ext_path)
+{
+    if (!fs || !int_path || !ext_path) return -1;
+
+    // the external file is read before the filesystem is locked
+    uint64_t start = fs_stats_clock();
+    FILE *ext = fopen(ext_path, "rb");
+    uint8_t buf[DIRECT_BLOCKS_COUNT * BLOCK_SIZE + 1];
+    size_t len = 0;
+    if (ext) {
+        len = fread(buf, 1, sizeof(buf), ext);
+        fclose(ext);
+    }
+
+    int ret = -1;
+    if (ext && len <= DIRECT_BLOCKS_COUNT * BLOCK_SIZE) {
+        fs_write_begin(fs);
+        int idx = find_file_by_path(fs, int_path);
+        int created = 0;
+        if (idx < 0) {
+            idx = create_node(fs, NULL, int_path, reg_file, -1);
+            created = idx >= 0;
+        }
+
+        if (idx >= 0 && fs->inodes[idx].n_type == reg_file) {
+            ret = replace_data(fs, idx, buf, len) < 0 ? -1 : 0;
+        }
+        // a failed import leaves nothing behind
+        if (ret < 0 && created) {
+            remove_child_inode(fs, fs->inodes[idx].parent, idx);
+            fs_free_tree(fs, idx);
+        }
+        fs_write_end(fs);
+    }
+    fs_stats_op(fs, FS_OP_IMPORT, start, ret < 0);
+    return ret;
+}
+
+// Unlinks path and frees its subtree before returning
+int fs_rm(file_system *fs, char *path)
+{
+    if (!fs || !path) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_write_begin(fs);
+    int ret = -1;
+    int idx = find_inode_by_path(fs, path);
+    if (idx >= 0 && idx != fs->root_node) {
+        count_entry(fs, idx, -1);
+        remove_child_inode(fs, fs->inodes[idx].parent, idx);
+        fs_free_tree(fs, idx);
+        ret = 0;
+    }
+    fs_write_end(fs);
+    fs_stats_op(fs, FS_OP_RM, start, ret < 0);
+    return ret;
+}
+
+int fs_rm_deferred(file_system *fs, char *path)
+{
+    if (!fs || !path) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_write_begin(fs);
+    int ret = -1;
+    int idx = find_inode_by_path(fs, path);
+    if (idx >= 0 && idx != fs->root_node) {
+        count_entry(fs, idx, -1);
+        remove_child_inode(fs, fs->inodes[idx].parent, idx);
+        fs_reclaim_defer(fs, idx);
+        ret = 0;
+    }
+    fs_write_end(fs);
+    fs_stats_op(fs, FS_OP_RM_DEFERRED, start, ret < 0);
+    return ret;
+}
+
+// Returns 1 if node lies in the subtree of ancestor (or is ancestor itself)
+static int in_subtree(file_system *fs, int ancestor, int node)
+{
+    for (int i = node; i != -1; i = fs->inodes[i].parent) {
+        if (i == ancestor) return 1;
+        if (i == fs->root_node) break;
+    }
+    return 0;
+}
+
+// Copies src recursively into a new inode called name below parent. The copy
+// is linked into parent only once it is complete, on failure everything
+// allocated so far is released again. Returns the new inode number or -1.
+static int copy_tree(file_system *fs, int src, int parent, const char *name)
+{
+    src = resolve_link(fs, src); // a copy does not share data
+    int dst = fs_alloc_inode(fs, fs->inodes[src].n_type);
+    if (dst < 0) return -1;
+    set_name(fs->inodes[dst].name, name);
+    fs->inodes[dst].parent = parent;
+    if (fs->inodes[dst].n_type == directory && fs->dir_sizes) fs->dir_sizes[dst] = 0;
+
+    int ok = 1;
+    if (fs->inodes[src].n_type == reg_file) {
+        int size = 0;
+        uint8_t *buf = read_file(fs, src, &size);
+        if (buf) ok = append_data(fs, NULL, dst, buf, size) >= 0;
+        free(buf);
+    } else {
+        for (int i = 0; i < DIRECT_BLOCKS_COUNT && ok; i++) {
+            int c = fs->inodes[src].direct_blocks[i];
+            if (c == -1) continue;
+            char child_name[NAME_MAX_LENGTH + 1];
+            strncpy(child_name, fs->inodes[c].name, NAME_MAX_LENGTH);
+            child_name[NAME_MAX_LENGTH] = '\0';
+            int copy = copy_tree(fs, c, dst, child_name);
+            ok = copy >= 0 && add_child_inode(fs, dst, copy) == 0;
+        }
+    }
+    if (!ok) {
+        count_entry(fs, dst, -1); // appends counted the data already
+        fs_free_tree(fs, dst);
+        return -1;
+    }
+    return dst;
+}
+
+int fs_cp(file_system *fs, char *src_path, char *dst_path_and_name)
+{
+    if (!fs || !src_path || !dst_path_and_name) return -1;
+
+    char parent_path[strlen(dst_path_and_name) + 1];
+    const char *name;
+    if (split_path(dst_path_and_name, parent_path, &name) != 0) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_write_begin(fs);
+    int ret = -1;
+    int src = find_inode_by_path(fs, src_path);
+    int parent = find_inode_by_path(fs, parent_path);
+    if (src >= 0 && parent >= 0 && fs->inodes[parent].n_type == directory
+        && !in_subtree(fs, src, parent)) {
+        if (lookup_child(fs, parent, name, strlen(name), NULL) != -1) {
+            ret = -2;
+        } else {
+            int dst = copy_tree(fs, src, parent, name);
+            if (dst >= 0 && add_child_inode(fs, parent, dst) == 0) {
+                ret = 0;
+            } else if (dst >= 0) {
+                count_entry(fs, dst, -1);
+                fs_free_tree(fs, dst);
+            }
+        }
+    }
+    fs_write_end(fs);
+    fs_stats_op(fs, FS_OP_CP, start, ret < 0);
+    return ret;
+}
+
+int fs_mv(file_system *fs, char *src_path, char *dst_path_and_name)
+{
+    if (!fs || !src_path || !dst_path_and_name) return -1;
+
+    char parent_path[strlen(dst_path_and_name) + 1];
+    const char *name;
+    if (split_path(dst_path_and_name, parent_path, &name) != 0) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_write_begin(fs);
+    int ret = -1;
+    int src = find_inode_by_path(fs, src_path);
+    int parent = find_inode_by_path(fs, parent_path);
+    if (src >= 0 && src != fs->root_node && parent >= 0 && fs->inodes[parent].n_type == directory
+        && !in_subtree(fs, src, parent)) {
+        int old_parent = fs->inodes[src].parent;
+        int existing = lookup_child(fs, parent, name, strlen(name), NULL);
+        if (existing == src) {
+            ret = 0;
+        } else if (existing != -1) {
+            ret = -2;
+        } else if (parent == old_parent || add_child_inode(fs, parent, src) == 0) {
+            // linked into the new parent before it leaves the old one, so a
+            // concurrent reader finds it under one of the two names
+            fs_name_write_begin(fs);
+            set_name(fs->inodes[src].name, name);
+            fs_name_write_end(fs);
+            count_entry(fs, src, -1);
+            FS_PUBLISH(fs->inodes[src].parent, parent);
+            count_entry(fs, src, 1);
+            fs_mark_inode(fs, src);
+            if (parent != old_parent) remove_child_inode(fs, old_parent, src);
+            ret = 0;
+        }
+    }
+    fs_write_end(fs);
+    fs_stats_op(fs, FS_OP_MV, start, ret < 0);
+    return ret;
+}
+
+int fs_link(file_system *fs, char *target_path, char *link_path)
+{
+    if (!fs || !target_path || !link_path) return -1;
+
+    uint64_t start = fs_stats_clock();
+    fs_write_begin(fs);
+    int ret = -1;
+    int target = find_file_by_path(fs, target_path);
+    if (target >= 0 && fs->inodes[target].n_type == reg_file && fs->inodes[target].links < UINT16_MAX) {
+        int idx = create_entry(fs, NULL, link_path, hard_link, -2, target);
+        if (idx >= 0) {
+            fs->inodes[target].links++;
+            fs_mark_inode(fs, target);
+            ret = 0;
+        } else {
+            ret = idx;
+        }
+    }
+    fs_write_end(fs);
+    fs_stats_op(fs, FS_OP_LINK, start, ret < 0);
+    return ret;
+}
+
+// What fs_batch has to do to take back one applied operation
+typedef struct _undo_entry {
+    enum { UNDO_CREATE, UNDO_WRITE, UNDO_UNLINK } kind;
+    int idx;
+    int parent, slot;                         // UNDO_UNLINK
+    int old_blocks[DIRECT_BLOCKS_COUNT];      // UNDO_WRITE
+    uint16_t old_size;
+    int tail;
+    size_t tail_size;
+} undo_entry;
+
+// Reserves what the batch will need at most. Falls short silently when the
+// filesystem is nearly full, the operations then allocate on their own.
+static void reserve_pool(file_system *fs, alloc_pool *pool, fs_batch_entry *ops, int count)
+{
+    int inodes = 0, blocks = 0;
+    for (int i = 0; i < count; i++) {
+        if (ops[i].op == FS_BATCH_MKDIR || ops[i].op == FS_BATCH_MKFILE) inodes++;
+        if (ops[i].op == FS_BATCH_WRITEF) {
+            blocks += (int)MIN((strlen(ops[i].text) + BLOCK_SIZE - 1) / BLOCK_SIZE,
+                               (size_t)DIRECT_BLOCKS_COUNT);
+        }
+    }
+    pool->inodes = malloc((inodes ? inodes : 1) * sizeof(int));
+    pool->blocks = malloc((blocks ? blocks : 1) * sizeof(int));
+    if (!pool->inodes || !pool->blocks) {
+        perror("Malloc error");
+        exit(1);
+    }
+    // placeholder type until the inode is used, free_block would make it
+    // look free to everyone else
+    while (pool->inode_count < inodes) {
+        int i = fs_alloc_inode(fs, directory);
+        if (i < 0) break;
+        pool->inodes[pool->inode_count++] = i;
+    }
+    while (pool->block_count < blocks) {
+        int b = fs_alloc_block(fs);
+        if (b < 0) break;
+        pool->blocks[pool->block_count++] = b;
+    }
+}
+
+static void release_pool(file_system *fs, alloc_pool *pool)
+{
+    for (int i = pool->inode_pos; i < pool->inode_count; i++) fs_free_inode(fs, pool->inodes[i]);
+    for (int i = pool->block_pos; i < pool->block_count; i++) fs_free_block(fs, pool->blocks[i]);
+    free(pool->inodes);
+    free(pool->blocks);
+}
+
+static int batch_create(file_system *fs, alloc_pool *pool, fs_batch_entry *op, undo_entry *u)
+{
+    int mkdir = op->op == FS_BATCH_MKDIR;
+    int idx = create_node(fs, pool, op->path, mkdir ? directory : reg_file, mkdir ? -1 : -2);
+    if (idx < 0) return idx;
+    u->kind = UNDO_CREATE;
+    u->idx = idx;
+    return 0;
+}
+
+static int batch_write(file_system *fs, alloc_pool *pool, fs_batch_entry *op, undo_entry *u)
+{
+    int idx = find_file_by_path(fs, op->path);
+    if (idx < 0 || fs->inodes[idx].n_type != reg_file) return -1;
+
+    inode *node = &fs->inodes[idx];
+    u->kind = UNDO_WRITE;
+    u->idx = idx;
+    memcpy(u->old_blocks, node->direct_blocks, sizeof(u->old_blocks));
+    u->old_size = node->size;
+    u->tail = -1;
+    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+        if (node->direct_blocks[i] != -1) u->tail = node->direct_blocks[i];
+    }
+    if (u->tail != -1) {
+        u->tail_size = fs_block_get(fs, u->tail)->size;
+        fs_block_put(fs, u->tail, 0);
+    }
+    return append_data(fs, pool, idx, (const uint8_t *)op->text, strlen(op->text));
+}
+
+// Only unlinks, the tree is released once the whole batch succeeded
+static int batch_unlink(file_system *fs, fs_batch_entry *op, undo_entry *u)
+{
+    int idx = find_inode_by_path(fs, op->path);
+    if (idx < 0 || idx == fs->root_node) return -1;
+
+    int parent = fs->inodes[idx].parent;
+    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+        if (fs->inodes[parent].direct_blocks[i] == idx) {
+            count_entry(fs, idx, -1);
+            FS_PUBLISH(fs->inodes[parent].direct_blocks[i], -1);
+            fs_mark_inode(fs, parent);
+            u->kind = UNDO_UNLINK;
+            u->idx = idx;
+            u->parent = parent;
+            u->slot = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void undo(file_system *fs, undo_entry *u)
+{
+    inode *node = &fs->inodes[u->idx];
+
+    switch (u->kind) {
+    case UNDO_CREATE:
+        remove_child_inode(fs, node->parent, u->idx);
+        fs_retire_inode(fs, u->idx);
+        break;
+    case UNDO_WRITE:
+        for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+            int b = node->direct_blocks[i];
+            if (b == u->old_blocks[i]) continue;
+            FS_PUBLISH(node->direct_blocks[i], u->old_blocks[i]);
+            fs_retire_block(fs, b);
+        }
+        add_dir_size(fs, node->parent, (int64_t)u->old_size - node->size);
+        FS_PUBLISH(node->size, u->old_size);
+        fs_mark_inode(fs, u->idx);
+        if (u->tail != -1) {
+            FS_PUBLISH(fs_block_get(fs, u->tail)->size, u->tail_size);
+            fs_block_put(fs, u->tail, 1);
+            fs_mark_block(fs, u->tail);
+        }
+        break;
+    case UNDO_UNLINK:
+        FS_PUBLISH(fs->inodes[u->parent].direct_blocks[u->slot], u->idx);
+        fs_mark_inode(fs, u->parent);
+        count_entry(fs, u->idx, 1);
+        break;
+    }
+}
+
+int fs_batch(file_system *fs, fs_batch_entry *ops, int count)
+{
+    if (!fs || !ops || count < 0) return -1;
+
+    // arguments are checked before anything is touched
+    int bad = -1;
+    for (int i = 0; i < count; i++) {
+        ops[i].status = FS_BATCH_SKIPPED;
+        if (bad < 0 && (!ops[i].path || ops[i].path[0] != '/'
+                        || (ops[i].op == FS_BATCH_WRITEF && !ops[i].text)
+                        || ops[i].op < FS_BATCH_MKDIR || ops[i].op > FS_BATCH_RM)) {
+            bad = i;
+        }
+    }
+    if (bad >= 0) {
+        ops[bad].status = -1;
+        return -1;
+    }
+
+    undo_entry *log = malloc((count ? count : 1) * sizeof(undo_entry));
+    if (!log) {
+        perror("Malloc error");
+        exit(1);
+    }
+    alloc_pool pool = {0};
+
+    uint64_t start = fs_stats_clock();
+    fs_write_begin(fs);
+    reserve_pool(fs, &pool, ops, count);
+
+    int done = 0, failed = 0;
+    for (; done < count && !failed; done++) {
+        fs_batch_entry *op = &ops[done];
+        switch (op->op) {
+        case FS_BATCH_MKDIR:
+        case FS_BATCH_MKFILE:
+            op->status = batch_create(fs, &pool, op, &log[done]);
+            failed = op->status < 0;
+            break;
+        case FS_BATCH_WRITEF:
+            op->status = batch_write(fs, &pool, op, &log[done]);
+            failed = op->status < 0;
+            break;
+        case FS_BATCH_RM:
+            op->status = batch_unlink(fs, op, &log[done]);
+            failed = op->status < 0;
+            break;
+        }
+    }
+
+    if (failed) {
+        // the failed operation itself changed nothing
+        for (int i = done - 2; i >= 0; i--) undo(fs, &log[i]);
+    } else {
+        for (int i = 0; i < count; i++) {
+            if (ops[i].op == FS_BATCH_RM) fs_free_tree(fs, log[i].idx);
+        }
+    }
+    release_pool(fs, &pool);
+    fs_write_end(fs);
+
+    free(log);
+    fs_stats_op(fs, FS_OP_BATCH, start, failed);
+    return failed ? -1 : 0;
+}
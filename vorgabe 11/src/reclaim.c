@@ -0,0 +1,310 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/concurrency.h"
+#include "../lib/flush.h"
+#include "../lib/reclaim.h"
+#include "../lib/trace.h"
+
+static void tree_push(tree_stack *s, int x)
+{
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 64;
+		s->v = realloc(s->v, s->cap * sizeof(int));
+		if (s->v == NULL) {
+			perror("Realloc error");
+			exit(errno);
+		}
+	}
+	s->v[s->n++] = x;
+}
+
+// Empties set for numbers below n. The bitmap is kept from one use to the
+// next (id_set_release clears what was used), it is only replaced when the
+// filesystem changed its size.
+static void id_set_reset(id_set *set, uint32_t n)
+{
+	if (set->n != n) {
+		free(set->bits);
+		set->bits = calloc((n + 63) / 64, sizeof(uint64_t));
+		if (set->bits == NULL) {
+			perror("Calloc error");
+			exit(errno);
+		}
+		set->n = n;
+	}
+	set->lo = (int)n;
+	set->hi = -1;
+}
+
+static void id_set_add(id_set *set, int i)
+{
+	set->bits[i >> 6] |= 1ull << (i & 63);
+	if (i < set->lo) set->lo = i;
+	if (i > set->hi) set->hi = i;
+}
+
+// Hands every run of consecutive numbers in set to release and empties it
+static void id_set_release(file_system *fs, id_set *set, void (*release)(file_system *, int, int))
+{
+	int i = set->lo;
+	while (i <= set->hi) {
+		uint64_t ones = set->bits[i >> 6] >> (i & 63);
+		if (ones == 0) {
+			i = (i | 63) + 1;
+			continue;
+		}
+		int first = i + __builtin_ctzll(ones);
+		i = first;
+		while (i <= set->hi) {
+			uint64_t zeros = ~set->bits[i >> 6] >> (i & 63);
+			if (zeros) {
+				i += __builtin_ctzll(zeros);
+				break;
+			}
+			i = (i | 63) + 1;
+		}
+		if (i > set->hi + 1) i = set->hi + 1;
+		release(fs, first, i - first);
+	}
+	if (set->hi >= set->lo) {
+		memset(&set->bits[set->lo >> 6], 0, ((set->hi >> 6) - (set->lo >> 6) + 1) * sizeof(uint64_t));
+	}
+}
+
+static void add_file(id_set *inodes, id_set *blocks, inode *node, int i)
+{
+	id_set_add(inodes, i);
+	for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+		if (node->direct_blocks[k] != -1) id_set_add(blocks, node->direct_blocks[k]);
+	}
+}
+
+// Visits up to budget inodes of the stack (-1: all), pushing the children of
+// directories and releasing inodes and blocks in ranges at the end.
+// A file that is still named by hard links only loses its own name, the
+// file of a removed link goes with it once no name is left.
+// Returns the number of inodes visited.
+static int free_from_stack(file_system *fs, tree_stack *stack, int budget)
+{
+	id_set *inodes = &fs->reclaim->inodes, *blocks = &fs->reclaim->blocks;
+	id_set_reset(inodes, fs->s_block->num_blocks);
+	id_set_reset(blocks, fs->s_block->num_blocks);
+
+	int visited = 0;
+	while (stack->n > 0 && visited != budget) {
+		int i = stack->v[--stack->n];
+		inode *node = &fs->inodes[i];
+		visited++;
+		if (node->n_type == directory) {
+			id_set_add(inodes, i);
+			for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+				if (node->direct_blocks[k] != -1) tree_push(stack, node->direct_blocks[k]);
+			}
+		} else if (node->n_type == hard_link) {
+			id_set_add(inodes, i);
+			int t = node->direct_blocks[0];
+			inode *file = &fs->inodes[t];
+			file->links--;
+			fs_mark_inode(fs, t);
+			if (file->links == 0 && file->parent == UNLINKED_PARENT) add_file(inodes, blocks, file, t);
+		} else if (node->links > 0) {
+			FS_PUBLISH(node->parent, UNLINKED_PARENT);
+			fs_mark_inode(fs, i);
+		} else {
+			add_file(inodes, blocks, node, i);
+		}
+	}
+	id_set_release(fs, blocks, fs_retire_block_range);
+	id_set_release(fs, inodes, fs_retire_inode_range);
+	return visited;
+}
+
+// Retires idx and everything below it. idx must already be unreachable.
+void fs_free_tree(file_system *fs, int idx)
+{
+	inode *node = &fs->inodes[idx];
+	if (node->n_type == reg_file && node->links == 0) {
+		for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+			if (node->direct_blocks[i] != -1) fs_retire_block(fs, node->direct_blocks[i]);
+		}
+		fs_retire_inode(fs, idx);
+		return;
+	}
+
+	tree_stack stack = { 0 };
+	tree_push(&stack, idx);
+	free_from_stack(fs, &stack, -1);
+	free(stack.v);
+}
+
+void fs_reclaim_init(file_system *fs)
+{
+	fs->reclaim = calloc(1, sizeof(fs_reclaim));
+	if (fs->reclaim == NULL) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	pthread_mutex_init(&fs->reclaim->lock, NULL);
+	pthread_cond_init(&fs->reclaim->wake, NULL);
+}
+
+void fs_reclaim_destroy(file_system *fs)
+{
+	fs_reclaim *r = fs->reclaim;
+
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->wake);
+	free(r->queue);
+	free(r->stack.v);
+	free(r->inodes.bits);
+	free(r->blocks.bits);
+	free(r);
+	fs->reclaim = NULL;
+}
+
+void fs_reclaim_defer(file_system *fs, int idx)
+{
+	fs_reclaim *r = fs->reclaim;
+
+	// mark it an orphan on disk as well, see fs_reclaim_orphans
+	fs->inodes[idx].parent = -1;
+	fs_mark_inode(fs, idx);
+
+	if (r->tail == r->cap) {
+		if (r->head > 0) {
+			memmove(r->queue, r->queue + r->head, (r->tail - r->head) * sizeof(int));
+			r->tail -= r->head;
+			r->head = 0;
+		}
+		if (r->tail == r->cap) {
+			r->cap = r->cap ? r->cap * 2 : 64;
+			r->queue = realloc(r->queue, r->cap * sizeof(int));
+			if (r->queue == NULL) {
+				perror("Realloc error");
+				exit(errno);
+			}
+		}
+	}
+	r->queue[r->tail++] = idx;
+	__atomic_add_fetch(&r->pending, 1, __ATOMIC_RELAXED);
+
+	if (r->running) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->wake);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+int fs_reclaim_step(file_system *fs, int budget)
+{
+	fs_reclaim *r = fs->reclaim;
+	int done = 0;
+	TRACE_START(start);
+
+	fs_write_begin(fs);
+	while (done < budget) {
+		if (r->stack.n == 0) {
+			if (r->head == r->tail) break;
+			tree_push(&r->stack, r->queue[r->head++]);
+		}
+		done += free_from_stack(fs, &r->stack, budget - done);
+		if (r->stack.n == 0) __atomic_sub_fetch(&r->pending, 1, __ATOMIC_RELAXED);
+	}
+	r->reclaimed += done;
+	fs_write_end(fs);
+	TRACE_SPAN(TR_RECLAIM_STEP, start, done, fs_reclaim_pending(fs));
+	return done;
+}
+
+void fs_reclaim_drain(file_system *fs)
+{
+	while (fs_reclaim_pending(fs) > 0) fs_reclaim_step(fs, 1 << 16);
+}
+
+uint32_t fs_reclaim_pending(file_system *fs)
+{
+	return __atomic_load_n(&fs->reclaim->pending, __ATOMIC_RELAXED);
+}
+
+// Returns 1 if idx is listed by the directory it names as parent (or is a
+// file only hard links name)
+static int is_linked(file_system *fs, int idx)
+{
+	int p = fs->inodes[idx].parent;
+	if (p == UNLINKED_PARENT) return fs->inodes[idx].links > 0;
+	if (p < 0 || (uint32_t)p >= fs->s_block->num_blocks || fs->inodes[p].n_type != directory) return 0;
+	for (int k = 0; k < DIRECT_BLOCKS_COUNT; k++) {
+		if (fs->inodes[p].direct_blocks[k] == idx) return 1;
+	}
+	return 0;
+}
+
+int fs_reclaim_orphans(file_system *fs)
+{
+	int found = 0;
+
+	fs_write_begin(fs);
+	for (uint32_t i = 0; i < fs->s_block->num_blocks; i++) {
+		if ((int)i == fs->root_node || fs->inodes[i].n_type == free_block) continue;
+		if (!is_linked(fs, (int)i)) {
+			fs_reclaim_defer(fs, (int)i);
+			found++;
+		}
+	}
+	fs_write_end(fs);
+
+	if (found > 0) {
+		TRACE(TR_ORPHANS, found, 0);
+		fs_reclaim_drain(fs);
+	}
+	return found;
+}
+
+static void *reclaimer_main(void *arg)
+{
+	file_system *fs = arg;
+	fs_reclaim *r = fs->reclaim;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->stop) {
+		if (fs_reclaim_pending(fs) == 0) {
+			pthread_cond_wait(&r->wake, &r->lock);
+			continue;
+		}
+		// one step per write lock hold, so writers get in between
+		pthread_mutex_unlock(&r->lock);
+		fs_reclaim_step(fs, r->budget);
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+int fs_reclaimer_start(file_system *fs, int budget)
+{
+	fs_reclaim *r = fs->reclaim;
+
+	r->budget = budget > 0 ? budget : 1;
+	r->stop = 0;
+	if (pthread_create(&r->thread, NULL, reclaimer_main, fs) != 0) return -1;
+	r->running = 1;
+	return 0;
+}
+
+void fs_reclaimer_stop(file_system *fs)
+{
+	fs_reclaim *r = fs->reclaim;
+
+	if (r->running) {
+		pthread_mutex_lock(&r->lock);
+		r->stop = 1;
+		pthread_cond_signal(&r->wake);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread, NULL);
+		r->running = 0;
+	}
+	fs_reclaim_drain(fs);
+}
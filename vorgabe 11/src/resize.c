@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/alloc.h"
+#include "../lib/concurrency.h"
+#include "../lib/defrag.h"
+#include "../lib/flush.h"
+#include "../lib/reclaim.h"
+#include "../lib/resize.h"
+#include "../lib/trace.h"
+
+// Arrays of one size, the new ones until they are swapped with those of fs
+typedef struct _layout {
+	uint8_t *free_list;
+	inode *inodes;
+	data_block *data_blocks;
+	uint8_t *block_reserved;
+	uint8_t *inode_reserved;
+	uint64_t *dirty_inodes;
+	uint64_t *dirty_blocks;
+	uint64_t *dir_sizes;
+} layout;
+
+static void layout_free(layout *l)
+{
+	free(l->free_list);
+	free(l->inodes);
+	free(l->data_blocks);
+	free(l->block_reserved);
+	free(l->inode_reserved);
+	free(l->dirty_inodes);
+	free(l->dirty_blocks);
+	free(l->dir_sizes);
+}
+
+// Copies the first min(n, m) entries of fs, the ones added are free
+static int layout_build(file_system *fs, layout *l, uint32_t m)
+{
+	uint32_t n = fs->s_block->num_blocks;
+	uint32_t keep = n < m ? n : m;
+	size_t words = (m + 63) / 64;
+
+	l->free_list = malloc(m);
+	l->inodes = malloc((size_t)m * sizeof(inode));
+	l->data_blocks = calloc(m, sizeof(data_block));
+	l->block_reserved = calloc(m, 1);
+	l->inode_reserved = calloc(m, 1);
+	l->dirty_inodes = calloc(words, sizeof(uint64_t));
+	l->dirty_blocks = calloc(words, sizeof(uint64_t));
+	l->dir_sizes = fs->dir_sizes ? calloc(m, sizeof(uint64_t)) : NULL;
+	if (!l->free_list || !l->inodes || !l->data_blocks || !l->block_reserved || !l->inode_reserved ||
+	    !l->dirty_inodes || !l->dirty_blocks || (fs->dir_sizes && !l->dir_sizes)) {
+		return -1;
+	}
+
+	memcpy(l->free_list, fs->free_list, keep);
+	memcpy(l->inodes, fs->inodes, (size_t)keep * sizeof(inode));
+	memcpy(l->data_blocks, fs->data_blocks, (size_t)keep * sizeof(data_block));
+	if (l->dir_sizes) memcpy(l->dir_sizes, fs->dir_sizes, (size_t)keep * sizeof(uint64_t));
+	for (uint32_t i = keep; i < m; i++) {
+		l->free_list[i] = 1;
+		inode_init(&l->inodes[i]);
+	}
+	return 0;
+}
+
+// Publishes the arrays of l in fs, l gets the old ones
+static void layout_swap(file_system *fs, layout *l)
+{
+	layout old = {
+		fs->free_list, fs->inodes, fs->data_blocks, fs->alloc->block_reserved,
+		fs->alloc->inode_reserved, fs->dirty->inodes, fs->dirty->blocks, fs->dir_sizes
+	};
+
+	FS_PUBLISH(fs->free_list, l->free_list);
+	FS_PUBLISH(fs->inodes, l->inodes);
+	FS_PUBLISH(fs->data_blocks, l->data_blocks);
+	FS_PUBLISH(fs->dir_sizes, l->dir_sizes);
+	fs->alloc->block_reserved = l->block_reserved;
+	fs->alloc->inode_reserved = l->inode_reserved;
+	fs->alloc->block_hint = 0;
+	fs->alloc->inode_hint = 0;
+	fs->dirty->inodes = l->dirty_inodes;
+	fs->dirty->blocks = l->dirty_blocks;
+	fs->dirty->count = 0;
+	*l = old;
+}
+
+// Sets fs to m blocks and inodes and writes the image at that size. Nothing
+// changes if the image can't be written.
+// Called with io_lock and the write lock held, the allocation caches drained.
+static int relayout(file_system *fs, uint32_t m)
+{
+	uint32_t n = fs->s_block->num_blocks;
+	layout l = { 0 };
+
+	if (layout_build(fs, &l, m) != 0) {
+		layout_free(&l);
+		return -1;
+	}
+
+	//the image is written at the new size before anything is swapped, the
+	//new dirty bitmaps stand in for the old ones that dumping clears
+	superblock s_block = { .num_blocks = m, .free_blocks = fs->s_block->free_blocks + m - n };
+	fs_dirty dirty = *fs->dirty;
+	dirty.inodes = l.dirty_inodes;
+	dirty.blocks = l.dirty_blocks;
+	file_system view = *fs;
+	view.s_block = &s_block;
+	view.free_list = l.free_list;
+	view.inodes = l.inodes;
+	view.data_blocks = l.data_blocks;
+	view.dirty = &dirty;
+	if (fs_dump_locked(&view, fs->image_path) != 0) {
+		layout_free(&l);
+		return -1;
+	}
+
+	//a pass in progress has block numbers of the old size
+	fs_defrag_destroy(fs);
+
+	//fs_reclaim_all waits for a grace period: readers see a num_blocks that
+	//fits every array they may still hold
+	if (m > n) {
+		layout_swap(fs, &l);
+		fs_reclaim_all(fs);
+		fs->s_block->free_blocks = s_block.free_blocks;
+		FS_PUBLISH(fs->s_block->num_blocks, m);
+	} else {
+		fs->s_block->free_blocks = s_block.free_blocks;
+		FS_PUBLISH(fs->s_block->num_blocks, m);
+		fs_reclaim_all(fs);
+		layout_swap(fs, &l);
+	}
+	fs_reclaim_all(fs);
+	layout_free(&l);
+
+	TRACE(TR_RESIZE, n, m);
+	return 0;
+}
+
+// First block / inode of the free tail that can be cut off
+static uint32_t free_tail(file_system *fs)
+{
+	uint32_t m = fs->s_block->num_blocks;
+	while (m > 1 && (int)m - 1 != fs->root_node && fs->free_list[m - 1] == 1 &&
+	       fs->inodes[m - 1].n_type == free_block) {
+		m--;
+	}
+	return m;
+}
+
+// Excludes everything touching the image, returns with nothing pending
+static void resize_begin(file_system *fs)
+{
+	//queued removals hold inode numbers, they go first
+	fs_reclaim_drain(fs);
+	pthread_mutex_lock(&fs->dirty->io_lock);
+	fs_write_begin(fs);
+	fs_reclaim_all(fs);
+	fs_alloc_drain(fs);
+}
+
+static void resize_end(file_system *fs)
+{
+	fs_write_end(fs);
+	pthread_mutex_unlock(&fs->dirty->io_lock);
+}
+
+int fs_resize(file_system *fs, uint32_t num_blocks)
+{
+	//the block cache of a lazy load is sized for the image it was loaded from
+	if (!fs || fs->cache || num_blocks == 0 || num_blocks > INT32_MAX) return -1;
+
+	resize_begin(fs);
+	int ret = 0;
+	if (num_blocks < free_tail(fs)) {
+		ret = -1;
+	} else if (num_blocks != fs->s_block->num_blocks) {
+		ret = relayout(fs, num_blocks);
+	}
+	resize_end(fs);
+	return ret;
+}
+
+int64_t fs_shrink(file_system *fs)
+{
+	if (!fs || fs->cache) return -1;
+
+	resize_begin(fs);
+	uint32_t m = free_tail(fs);
+	int64_t ret = m;
+	if (m < fs->s_block->num_blocks && relayout(fs, m) != 0) ret = -1;
+	resize_end(fs);
+	return ret;
+}
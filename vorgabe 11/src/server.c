@@ -0,0 +1,399 @@
+#define _GNU_SOURCE //accept4
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../lib/operations.h"
+#include "../lib/server.h"
+
+#define MAX_EVENTS 64
+#define READ_CHUNK (64 * 1024)
+// pending output above which a connection is not read from anymore
+#define OUT_LIMIT (4 * RPC_MAX_FRAME)
+// unprocessed input above which a connection is not read from anymore, it
+// always holds a complete request then
+#define IN_LIMIT (RPC_MAX_FRAME + sizeof(rpc_request_header))
+
+typedef struct _buffer {
+	uint8_t *data;
+	size_t pos; //consumed (input) / sent (output)
+	size_t len;
+	size_t cap;
+} buffer;
+
+typedef struct _conn {
+	int fd;
+	uint32_t events; //currently registered with epoll
+	int eof; //the client won't send anything more
+	buffer in;
+	buffer out;
+	struct _conn *prev, *next;
+} conn;
+
+// written to by the signal handler, read end is watched by the event loop
+static int stop_pipe[2] = { -1, -1 };
+
+static void on_stop_signal(int sig)
+{
+	int saved = errno;
+	(void)sig;
+	if (write(stop_pipe[1], "", 1) < 0) {
+		// the loop is woken up already
+	}
+	errno = saved;
+}
+
+static void reserve(buffer *b, size_t extra)
+{
+	if (b->len + extra <= b->cap) return;
+	// reuse consumed space first
+	if (b->pos > 0) {
+		memmove(b->data, b->data + b->pos, b->len - b->pos);
+		b->len -= b->pos;
+		b->pos = 0;
+		if (b->len + extra <= b->cap) return;
+	}
+	size_t cap = b->cap ? b->cap : READ_CHUNK;
+	while (cap < b->len + extra) cap *= 2;
+	b->data = realloc(b->data, cap);
+	if (b->data == NULL) {
+		perror("Realloc error");
+		exit(errno);
+	}
+	b->cap = cap;
+}
+
+static void append(buffer *b, const void *p, size_t len)
+{
+	reserve(b, len);
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+}
+
+static void respond(conn *c, uint32_t id, int32_t status, const void *payload, uint32_t len)
+{
+	rpc_response_header h = { .length = len, .id = id, .status = status };
+	append(&c->out, &h, sizeof(h));
+	if (len) append(&c->out, payload, len);
+}
+
+static void stat_reply(file_system *fs, conn *c, uint32_t id, char *path)
+{
+	fs_stat_info info;
+	if (fs_stat(fs, path, &info) != 0) {
+		respond(c, id, -1, NULL, 0);
+		return;
+	}
+	rpc_stat st = {
+		.inode = info.inode,
+		.type = info.type,
+		.size = (uint32_t)info.size,
+		.blocks = info.blocks,
+		.parent = info.parent,
+		.nlink = info.nlink,
+	};
+	respond(c, id, 0, &st, sizeof(st));
+}
+
+// Executes one request whose body has been received completely
+static void execute(file_system *fs, conn *c, const rpc_request_header *h, const uint8_t *body)
+{
+	char *args[2] = { NULL, NULL };
+	const uint8_t *p = body, *end = body + h->length;
+
+	int valid = h->argc <= 2;
+	for (int i = 0; valid && i < h->argc; i++) {
+		uint32_t len;
+		if (end - p < (ptrdiff_t)sizeof(len)) {
+			valid = 0;
+			break;
+		}
+		memcpy(&len, p, sizeof(len));
+		p += sizeof(len);
+		if ((size_t)(end - p) < len) {
+			valid = 0;
+			break;
+		}
+		args[i] = malloc(len + 1);
+		if (args[i] == NULL) {
+			perror("Malloc error");
+			exit(errno);
+		}
+		memcpy(args[i], p, len);
+		args[i][len] = '\0';
+		p += len;
+	}
+
+	int needed = h->op == RPC_WRITEF || h->op == RPC_CP || h->op == RPC_MV ? 2 : 1;
+	if (!valid || h->argc < needed) {
+		respond(c, h->id, -1, NULL, 0);
+	} else {
+		switch (h->op) {
+		case RPC_MKDIR:
+			respond(c, h->id, fs_mkdir(fs, args[0]), NULL, 0);
+			break;
+		case RPC_MKFILE:
+			respond(c, h->id, fs_mkfile(fs, args[0]), NULL, 0);
+			break;
+		case RPC_WRITEF:
+			respond(c, h->id, fs_writef(fs, args[0], args[1]), NULL, 0);
+			break;
+		case RPC_READF: {
+			int size = 0;
+			uint8_t *data = fs_readf(fs, args[0], &size);
+			// an empty file reads as NULL as well, tell it apart from a missing one
+			int status = data || fs_lookup(fs, args[0], NULL) >= 0 ? size : -1;
+			respond(c, h->id, status, data, data ? (uint32_t)size : 0);
+			free(data);
+			break;
+		}
+		case RPC_LIST: {
+			char *list = fs_list(fs, args[0]);
+			respond(c, h->id, list ? 0 : -1, list, list ? (uint32_t)strlen(list) : 0);
+			free(list);
+			break;
+		}
+		case RPC_RM:
+			respond(c, h->id, fs_rm(fs, args[0]), NULL, 0);
+			break;
+		case RPC_CP:
+			respond(c, h->id, fs_cp(fs, args[0], args[1]), NULL, 0);
+			break;
+		case RPC_MV:
+			respond(c, h->id, fs_mv(fs, args[0], args[1]), NULL, 0);
+			break;
+		case RPC_STAT:
+			stat_reply(fs, c, h->id, args[0]);
+			break;
+		default:
+			respond(c, h->id, -1, NULL, 0);
+		}
+	}
+	free(args[0]);
+	free(args[1]);
+}
+
+// Runs every complete request in the input buffer
+// @return -1 if the client sent garbage
+static int process(file_system *fs, conn *c)
+{
+	buffer *in = &c->in;
+
+	while (c->out.len - c->out.pos < OUT_LIMIT && in->len - in->pos >= sizeof(rpc_request_header)) {
+		rpc_request_header h;
+		memcpy(&h, in->data + in->pos, sizeof(h));
+		if (h.length > RPC_MAX_FRAME) return -1;
+		if (in->len - in->pos < sizeof(h) + h.length) {
+			// make room for the rest of the frame up front
+			reserve(in, sizeof(h) + h.length - (in->len - in->pos));
+			break;
+		}
+		execute(fs, c, &h, in->data + in->pos + sizeof(h));
+		in->pos += sizeof(h) + h.length;
+	}
+	if (in->pos == in->len) in->pos = in->len = 0;
+	return 0;
+}
+
+// @return -1 if the connection is gone
+static int drain_output(conn *c)
+{
+	buffer *out = &c->out;
+
+	while (out->pos < out->len) {
+		ssize_t n = send(c->fd, out->data + out->pos, out->len - out->pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		out->pos += n;
+	}
+	out->pos = out->len = 0;
+	return 0;
+}
+
+// @return -1 on error
+static int fill_input(conn *c)
+{
+	for (;;) {
+		if (c->in.len - c->in.pos >= IN_LIMIT) return 0;
+		reserve(&c->in, READ_CHUNK);
+		ssize_t n = recv(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len, 0);
+		if (n > 0) {
+			c->in.len += n;
+			// stop early when responses back up, the rest stays in the socket
+			if (c->out.len - c->out.pos >= OUT_LIMIT) return 0;
+			continue;
+		}
+		if (n == 0) {
+			c->eof = 1;
+			return 0;
+		}
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		return -1;
+	}
+}
+
+// @return 1 if the input holds a complete request
+static int has_request(conn *c)
+{
+	rpc_request_header h;
+	if (c->in.len - c->in.pos < sizeof(h)) return 0;
+	memcpy(&h, c->in.data + c->in.pos, sizeof(h));
+	return c->in.len - c->in.pos >= sizeof(h) + h.length;
+}
+
+// Answers what can be answered and sends as much as the socket takes
+// @return -1 if the connection has to be closed
+static int serve_conn(file_system *fs, conn *c)
+{
+	do {
+		if (process(fs, c) != 0 || drain_output(c) != 0) return -1;
+	} while (c->out.pos == c->out.len && has_request(c));
+	return 0;
+}
+
+static void update_events(int epfd, conn *c)
+{
+	uint32_t events = 0;
+	if (!c->eof && c->out.len - c->out.pos < OUT_LIMIT && c->in.len - c->in.pos < IN_LIMIT) events |= EPOLLIN;
+	if (c->out.pos < c->out.len) events |= EPOLLOUT;
+	if (events == c->events) return;
+
+	struct epoll_event ev = { .events = events, .data.ptr = c };
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = events;
+}
+
+static void close_conn(conn **list, conn *c)
+{
+	if (c->prev) c->prev->next = c->next;
+	else *list = c->next;
+	if (c->next) c->next->prev = c->prev;
+	close(c->fd);
+	free(c->in.data);
+	free(c->out.data);
+	free(c);
+}
+
+static void accept_all(int epfd, int lfd, conn **list)
+{
+	for (;;) {
+		int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept error");
+			return;
+		}
+		conn *c = calloc(1, sizeof(conn));
+		if (c == NULL) {
+			perror("Calloc error");
+			exit(errno);
+		}
+		c->fd = fd;
+		c->events = EPOLLIN;
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->next = *list;
+		if (*list) (*list)->prev = c;
+		*list = c;
+	}
+}
+
+int fs_serve(file_system *fs, const char *socket_path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lfd < 0) return -1;
+	unlink(socket_path);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 128) != 0) {
+		perror("Socket error");
+		close(lfd);
+		return -1;
+	}
+
+	// shutdown requests arrive as events like everything else, whichever
+	// thread the signal is delivered to
+	if (pipe2(stop_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+		close(lfd);
+		return -1;
+	}
+	int sfd = stop_pipe[0];
+	struct sigaction sa = { .sa_handler = on_stop_signal }, old_int, old_term;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	conn listener = { .fd = lfd }, signals = { .fd = sfd };
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listener };
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.ptr = &signals;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+
+	conn *clients = NULL;
+	int running = 1;
+	struct epoll_event events[MAX_EVENTS];
+	while (running) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			conn *c = events[i].data.ptr;
+			if (c == &listener) {
+				accept_all(epfd, lfd, &clients);
+				continue;
+			}
+			if (c == &signals) {
+				running = 0;
+				continue;
+			}
+
+			int failed = 0;
+			if (events[i].events & (EPOLLHUP | EPOLLERR) && !(events[i].events & EPOLLIN)) failed = 1;
+			if (!failed && events[i].events & EPOLLIN) failed = fill_input(c) != 0;
+			if (!failed) failed = serve_conn(fs, c) != 0;
+			// a client that is done gets its last responses before the close
+			if (c->eof && c->out.pos == c->out.len) failed = 1;
+			if (failed) {
+				close_conn(&clients, c);
+			} else {
+				update_events(epfd, c);
+			}
+		}
+	}
+
+	while (clients) close_conn(&clients, clients);
+	close(epfd);
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	stop_pipe[0] = stop_pipe[1] = -1;
+	close(lfd);
+	unlink(socket_path);
+	return 0;
+}
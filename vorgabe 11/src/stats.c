@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/reclaim.h"
+#include "../lib/stats.h"
+#include "../lib/trace.h"
+
+static const char *op_names[FS_OP_COUNT] = {
+	"mkdir", "mkfile", "writef", "readf", "lookup", "stat", "list", "cp",
+	"mv", "ln", "rm", "rm -d", "import", "export", "batch", "dump"
+};
+
+static const char *counter_names[FS_CTR_COUNT] = {
+	"inodes_allocated", "inodes_freed", "blocks_allocated", "blocks_freed",
+	"bytes_written", "bytes_read", "name_compares", "cache_hits", "cache_misses",
+	"cache_writebacks"
+};
+
+static uint32_t next_shard;
+static _Thread_local int my_shard = -1;
+
+static stats_shard *thread_shard(file_system *fs)
+{
+	if (my_shard < 0) {
+		my_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+	}
+	return &fs->stats->shards[my_shard];
+}
+
+void fs_stats_init(file_system *fs)
+{
+	fs->stats = aligned_alloc(CACHE_LINE, sizeof(fs_stats_shards));
+	if (fs->stats == NULL) {
+		perror("Malloc error");
+		exit(errno);
+	}
+	memset(fs->stats, 0, sizeof(fs_stats_shards));
+}
+
+void fs_stats_destroy(file_system *fs)
+{
+	free(fs->stats);
+	fs->stats = NULL;
+}
+
+uint64_t fs_stats_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Values below 2^STATS_SUB_BITS get a bucket each, above that every power of
+// two is split into 2^STATS_SUB_BITS buckets
+static int bucket_of(uint64_t ns)
+{
+	if (ns < (1u << STATS_SUB_BITS)) return (int)ns;
+	int e = 63 - __builtin_clzll(ns);
+	int b = ((e - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + (int)((ns >> (e - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1));
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// Smallest value of bucket b
+static uint64_t bucket_start(int b)
+{
+	if (b < (1 << STATS_SUB_BITS)) return (uint64_t)b;
+	int e = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+	uint64_t sub = (uint64_t)(b & ((1 << STATS_SUB_BITS) - 1));
+	return ((1ull << STATS_SUB_BITS) + sub) << (e - STATS_SUB_BITS);
+}
+
+void fs_stats_op(file_system *fs, enum fs_op op, uint64_t start, int failed)
+{
+	uint64_t ns = fs_stats_clock() - start;
+	fs_op_stats *s = &thread_shard(fs)->ops[op];
+
+	__atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+	if (failed) __atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->hist[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+	TRACE_SPAN(TR_OP, start, op, failed != 0);
+}
+
+void fs_stats_count(file_system *fs, enum fs_counter c, uint64_t n)
+{
+	__atomic_add_fetch(&thread_shard(fs)->counters[c], n, __ATOMIC_RELAXED);
+}
+
+void fs_get_stats(file_system *fs, fs_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+	for (int i = 0; i < STATS_SHARDS; i++) {
+		stats_shard *sh = &fs->stats->shards[i];
+		for (int c = 0; c < FS_CTR_COUNT; c++) {
+			out->counters[c] += __atomic_load_n(&sh->counters[c], __ATOMIC_RELAXED);
+		}
+		for (int op = 0; op < FS_OP_COUNT; op++) {
+			fs_op_stats *s = &sh->ops[op];
+			out->ops[op].count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+			out->ops[op].errors += __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+			out->ops[op].total_ns += __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+			for (int b = 0; b < STATS_BUCKETS; b++) {
+				out->ops[op].hist[b] += __atomic_load_n(&s->hist[b], __ATOMIC_RELAXED);
+			}
+		}
+	}
+	out->reclaim_pending = fs_reclaim_pending(fs);
+}
+
+void fs_reset_stats(file_system *fs)
+{
+	uint64_t *words = (uint64_t *)fs->stats;
+	for (size_t i = 0; i < sizeof(fs_stats_shards) / sizeof(uint64_t); i++) {
+		__atomic_store_n(&words[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t fs_stats_percentile(const fs_op_stats *s, double q)
+{
+	if (s->count == 0) return 0;
+	uint64_t seen = 0;
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+		seen += s->hist[b];
+		if (seen > 0 && seen >= q * s->count) {
+			return b + 1 < STATS_BUCKETS ? bucket_start(b + 1) - 1 : bucket_start(b);
+		}
+	}
+	return bucket_start(STATS_BUCKETS - 1);
+}
+
+const char *fs_op_name(enum fs_op op)
+{
+	return op >= 0 && op < FS_OP_COUNT ? op_names[op] : "?";
+}
+
+const char *fs_counter_name(enum fs_counter c)
+{
+	return c >= 0 && c < FS_CTR_COUNT ? counter_names[c] : "?";
+}
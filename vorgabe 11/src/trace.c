@@ -0,0 +1,163 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../lib/stats.h"
+#include "../lib/trace.h"
+
+typedef struct _trace_record {
+	uint64_t ts;
+	uint64_t dur; //0 for a point in time
+	int64_t a, b;
+	uint32_t ev;
+} trace_record;
+
+typedef struct _trace_ring {
+	trace_record records[TRACE_RING_SIZE];
+	uint64_t head; //records written so far, only the owner writes it
+	uint32_t tid;
+	struct _trace_ring *next;
+} trace_ring;
+
+static const char *event_names[TR_EVENT_COUNT] = {
+	"op", "create", "load", "journal_replay", "orphans", "inode_alloc",
+	"block_alloc", "inode_free", "block_free", "flush", "reclaim_step", "defrag_step",
+	"resize"
+};
+
+// the rings of live threads and of exited ones not dumped yet (the newest
+// TRACE_RETIRED_MAX of them). Only linking, unlinking and dumps take the
+// lock, emitting doesn't.
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings;
+static trace_ring *retired_rings;
+static uint32_t retired_count;
+static uint32_t next_tid;
+static _Thread_local trace_ring *my_ring;
+static pthread_key_t ring_key;
+static int ring_key_ok;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+uint64_t fs_trace_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Thread exit: moves the thread's ring to the retired ones, the next dump
+// still writes it
+static void ring_release(void *ring)
+{
+	trace_ring *r = ring, *drop = NULL;
+
+	pthread_mutex_lock(&rings_lock);
+	trace_ring **link = &rings;
+	while (*link != r) link = &(*link)->next;
+	*link = r->next;
+	r->next = retired_rings;
+	retired_rings = r;
+	//the oldest one goes once there are too many
+	if (++retired_count > TRACE_RETIRED_MAX) {
+		link = &retired_rings;
+		while ((*link)->next != NULL) link = &(*link)->next;
+		drop = *link;
+		*link = NULL;
+		retired_count--;
+	}
+	pthread_mutex_unlock(&rings_lock);
+	free(drop);
+}
+
+static void ring_key_init(void)
+{
+	ring_key_ok = pthread_key_create(&ring_key, ring_release) == 0;
+}
+
+static trace_ring *ring_register(void)
+{
+	pthread_once(&ring_key_once, ring_key_init);
+	trace_ring *r = calloc(1, sizeof(trace_ring));
+	if (r == NULL) return NULL;
+	r->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&rings_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	//without the key the ring stays until the process ends
+	if (ring_key_ok) pthread_setspecific(ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+void fs_trace_emit(enum fs_trace_event ev, uint64_t ts, uint64_t dur, int64_t a, int64_t b)
+{
+	trace_ring *r = my_ring ? my_ring : ring_register();
+	if (r == NULL) return;
+
+	uint64_t n = r->head;
+	trace_record *rec = &r->records[n & (TRACE_RING_SIZE - 1)];
+	rec->ts = ts;
+	rec->dur = dur;
+	rec->a = a;
+	rec->b = b;
+	rec->ev = ev;
+	__atomic_store_n(&r->head, n + 1, __ATOMIC_RELEASE);
+}
+
+// Name and arguments of one record in Chrome's JSON
+static void write_record(FILE *out, const trace_record *rec, uint32_t tid)
+{
+	const char *name = rec->ev < TR_EVENT_COUNT ? event_names[rec->ev] : "?";
+	if (rec->ev == TR_OP) name = fs_op_name((enum fs_op)rec->a);
+
+	fprintf(out, "{\"name\":\"%s\",\"cat\":\"fs\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,", name, tid, rec->ts / 1e3);
+	if (rec->dur) {
+		fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,", rec->dur / 1e3);
+	} else {
+		fprintf(out, "\"ph\":\"i\",\"s\":\"t\",");
+	}
+	fprintf(out, "\"args\":{\"a\":%lld,\"b\":%lld}}", (long long)rec->a, (long long)rec->b);
+}
+
+// Writes the records of r up to its head as read now. A record the owner
+// wraps around onto while it is copied is left out.
+static void write_ring(FILE *out, trace_ring *r, int *first)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	//the slot of the oldest record is the next one written
+	uint64_t start = head >= TRACE_RING_SIZE ? head - TRACE_RING_SIZE + 1 : 0;
+
+	for (uint64_t n = start; n < head; n++) {
+		trace_record rec = r->records[n & (TRACE_RING_SIZE - 1)];
+		//record n + TRACE_RING_SIZE is written while head is at it
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->head, __ATOMIC_RELAXED) >= n + TRACE_RING_SIZE) continue;
+		fprintf(out, *first ? "\n" : ",\n");
+		write_record(out, &rec, r->tid);
+		*first = 0;
+	}
+}
+
+int fs_trace_dump(const char *path)
+{
+	FILE *out = fopen(path, "w");
+	if (out == NULL) return -1;
+
+	fprintf(out, "{\"traceEvents\":[");
+	int first = 1;
+	pthread_mutex_lock(&rings_lock);
+	for (trace_ring *r = rings; r != NULL; r = r->next) write_ring(out, r, &first);
+	//exited threads are dumped once
+	while (retired_rings != NULL) {
+		trace_ring *r = retired_rings;
+		write_ring(out, r, &first);
+		retired_rings = r->next;
+		free(r);
+	}
+	retired_count = 0;
+	pthread_mutex_unlock(&rings_lock);
+	fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	return fclose(out) == 0 ? 0 : -1;
+}
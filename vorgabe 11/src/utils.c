@@ -4,5 +4,18 @@ void printhelp(){
 	printf("Usage:\n"
 	"-l, --load <filename>\n\tLoads an existing filesystem\n"
 	"-c, --create <filename> <size>\n\tCreates a new filesystem with given filename and size (amount of INodes/Blocks)\n"
-	"-h, --help\n\tPrint this help\n");
+	"--check <filename> [--repair]\n\tCheck the image (without its journal) for inconsistencies, --repair fixes them\n"
+	"-h, --help\n\tPrint this help\n"
+	"\nOptions after -l / -c:\n"
+	"-j, --journal\n\tLog every operation to <filename>.journal (replayed on load, emptied by dump)\n"
+	"--journal-data\n\tLog file content as well, not only metadata\n"
+	"--journal-sync\n\tEvery command returns only after its log entry is on disk\n"
+	"--lazy <frames>\n\tWith -l read data blocks on first use, keeping about frames of them in memory\n"
+	"--no-flush\n\tDon't write changes back in the background, only dump saves the filesystem (always so without -j)\n"
+	"--io <uring|sync>\n\tBackend for image I/O, uring falls back to sync where unavailable (default: sync)\n"
+	"--queue-depth <n>\n\tImage I/O requests in flight with uring (default: 32)\n"
+	"-b, --batch <script>\n\tRun the commands of script (- for stdin) without prompt and save once at the end, dump is ignored\n"
+	"--serve <socket>\n\tKeep the filesystem loaded and serve requests on a Unix socket until SIGINT / SIGTERM\n"
+	"--trace <file>\n\tWrite the trace events (builds with TRACE=1) to file in Chrome trace format at exit\n"
+	"\nIf stdin is no terminal (a pipe or a file), -l and -c run in batch mode as with -b -\n");
 }
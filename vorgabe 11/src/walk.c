@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/concurrency.h"
+#include "../lib/operations.h"
+#include "../lib/walk.h"
+
+static void *walk_realloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		perror("Realloc error");
+		exit(errno);
+	}
+	return p;
+}
+
+// Growable path, "/" for the root and "/a/b" below it
+typedef struct _path_buf {
+	char *s;
+	size_t len, cap;
+} path_buf;
+
+static void path_reserve(path_buf *p, size_t needed)
+{
+	if (needed <= p->cap) return;
+	size_t cap = p->cap ? p->cap : 256;
+	while (cap < needed) cap *= 2;
+	p->s = walk_realloc(p->s, cap);
+	p->cap = cap;
+}
+
+static void path_set(path_buf *p, const char *path, size_t len)
+{
+	while (len > 1 && path[len - 1] == '/') len--;
+	path_reserve(p, len + 1);
+	memcpy(p->s, path, len);
+	p->s[len] = '\0';
+	p->len = len;
+}
+
+static void path_push(path_buf *p, const char *name)
+{
+	size_t n = strnlen(name, NAME_MAX_LENGTH);
+	int slash = !(p->len == 1 && p->s[0] == '/');
+	path_reserve(p, p->len + slash + n + 1);
+	if (slash) p->s[p->len++] = '/';
+	memcpy(p->s + p->len, name, n);
+	p->len += n;
+	p->s[p->len] = '\0';
+}
+
+static void path_truncate(path_buf *p, size_t len)
+{
+	p->len = len;
+	p->s[len] = '\0';
+}
+
+// Children of dir that still belong to it, sorted by inode number
+static int collect_children(file_system *fs, int dir, int *children)
+{
+	int count = 0;
+	for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+		int c = FS_LOAD(fs->inodes[dir].direct_blocks[i]);
+		if (c == -1) continue;
+		if (FS_LOAD(fs->inodes[c].n_type) == free_block || FS_LOAD(fs->inodes[c].parent) != dir) continue;
+		int j = count++;
+		while (j > 0 && children[j - 1] > c) {
+			children[j] = children[j - 1];
+			j--;
+		}
+		children[j] = c;
+	}
+	return count;
+}
+
+static int visit(file_system *fs, fs_walk_fn fn, void *arg, const char *path, int i, int depth, int post)
+{
+	inode *node = &fs->inodes[i];
+	int parent = FS_LOAD(node->parent);
+	// a hard link is reported as the file it names
+	if (FS_LOAD(node->n_type) == hard_link) {
+		i = FS_LOAD(node->direct_blocks[0]);
+		node = &fs->inodes[i];
+	}
+	fs_walk_entry e = {
+		.path = path,
+		.inode = i,
+		.parent = parent,
+		.type = FS_LOAD(node->n_type),
+		.size = FS_LOAD(node->size),
+		.depth = depth,
+		.post = post,
+	};
+	return fn(&e, arg);
+}
+
+// Pre visit of a directory (if requested), 1 if its children should be walked
+static int enter_dir(file_system *fs, fs_walk_fn fn, void *arg, const char *path, int i, int depth, int flags,
+                     int max_depth, int *ret)
+{
+	*ret = 0;
+	if (flags & FS_WALK_PRE) {
+		*ret = visit(fs, fn, arg, path, i, depth, 0);
+		if (*ret < 0) return 0;
+	}
+	if (*ret == FS_WALK_SKIP || (max_depth >= 0 && depth >= max_depth)) {
+		*ret = (flags & FS_WALK_POST) ? visit(fs, fn, arg, path, i, depth, 1) : 0;
+		return 0;
+	}
+	*ret = 0;
+	return 1;
+}
+
+static int normalize_flags(int flags)
+{
+	return (flags & (FS_WALK_PRE | FS_WALK_POST)) ? flags : flags | FS_WALK_PRE;
+}
+
+typedef struct _walk_frame {
+	int inode;
+	int children[DIRECT_BLOCKS_COUNT];
+	int count, pos;
+	size_t path_len;
+} walk_frame;
+
+int fs_walk(file_system *fs, char *path, fs_walk_fn fn, void *arg, int flags, int max_depth)
+{
+	if (!fs || !path || !fn) return -1;
+	flags = normalize_flags(flags);
+
+	fs_read_begin(fs);
+	int root = fs_lookup(fs, path, NULL);
+	if (root < 0) {
+		fs_read_end(fs);
+		return -1;
+	}
+
+	path_buf p = { 0 };
+	path_set(&p, path, strlen(path));
+	int ret;
+	if (FS_LOAD(fs->inodes[root].n_type) != directory) {
+		ret = visit(fs, fn, arg, p.s, root, 0, 0);
+		goto out;
+	}
+	if (!enter_dir(fs, fn, arg, p.s, root, 0, flags, max_depth, &ret)) goto out;
+
+	// explicit stack, a chain of directories can be as deep as there are inodes
+	size_t cap = 16, depth = 0;
+	walk_frame *stack = walk_realloc(NULL, cap * sizeof(walk_frame));
+	stack[0].inode = root;
+	stack[0].count = collect_children(fs, root, stack[0].children);
+	stack[0].pos = 0;
+	stack[0].path_len = p.len;
+
+	for (;;) {
+		walk_frame *top = &stack[depth];
+		if (top->pos == top->count) {
+			path_truncate(&p, top->path_len);
+			if (flags & FS_WALK_POST) ret = visit(fs, fn, arg, p.s, top->inode, (int)depth, 1);
+			if (ret < 0 || depth == 0) break;
+			depth--;
+			continue;
+		}
+
+		int c = top->children[top->pos++];
+		int child_depth = (int)depth + 1;
+		path_truncate(&p, top->path_len);
+		path_push(&p, fs->inodes[c].name);
+		if (FS_LOAD(fs->inodes[c].n_type) != directory) {
+			ret = visit(fs, fn, arg, p.s, c, child_depth, 0);
+		} else if (enter_dir(fs, fn, arg, p.s, c, child_depth, flags, max_depth, &ret)) {
+			if (++depth == cap) {
+				cap *= 2;
+				stack = walk_realloc(stack, cap * sizeof(walk_frame));
+			}
+			stack[depth].inode = c;
+			stack[depth].count = collect_children(fs, c, stack[depth].children);
+			stack[depth].pos = 0;
+			stack[depth].path_len = p.len;
+		}
+		if (ret < 0) break;
+	}
+	free(stack);
+
+out:
+	fs_read_end(fs);
+	free(p.s);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Parallel walk
+ *
+ * A task is a directory whose pre visit is done and whose children still have
+ * to be walked. Workers push the subdirectories they find onto their own deque
+ * and pop from its back (depth first, good locality), idle workers steal from
+ * the front of a victim's deque (large subtrees). pending counts the
+ * unfinished children of a task plus one for the task itself; whoever drops it
+ * to zero does the post visit and passes the completion on to the parent.
+ */
+
+typedef struct _walk_task {
+	struct _walk_task *parent;
+	int inode;
+	int depth;
+	int pending;
+	char *path;
+} walk_task;
+
+typedef struct _walk_deque {
+	pthread_mutex_t lock;
+	walk_task **tasks;
+	size_t head, tail, cap; //tasks[head..tail)
+} walk_deque;
+
+typedef struct _walk_pool {
+	file_system *fs;
+	fs_walk_fn fn;
+	void *arg;
+	int flags, max_depth;
+	int threads;
+	walk_deque *deques;
+	long outstanding; //tasks pushed but not yet processed
+	int result; //first negative callback result, stops the walk
+} walk_pool;
+
+typedef struct _walk_worker {
+	walk_pool *pool;
+	int id;
+	path_buf path;
+} walk_worker;
+
+static void deque_push(walk_deque *d, walk_task *t)
+{
+	pthread_mutex_lock(&d->lock);
+	if (d->tail == d->cap) {
+		if (d->head > 0) {
+			memmove(d->tasks, d->tasks + d->head, (d->tail - d->head) * sizeof(walk_task *));
+			d->tail -= d->head;
+			d->head = 0;
+		}
+		if (d->tail == d->cap) {
+			d->cap = d->cap ? d->cap * 2 : 64;
+			d->tasks = walk_realloc(d->tasks, d->cap * sizeof(walk_task *));
+		}
+	}
+	d->tasks[d->tail++] = t;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static walk_task *deque_take(walk_deque *d, int steal)
+{
+	walk_task *t = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->head < d->tail) t = steal ? d->tasks[d->head++] : d->tasks[--d->tail];
+	pthread_mutex_unlock(&d->lock);
+	return t;
+}
+
+static int stopped(walk_pool *pool)
+{
+	return __atomic_load_n(&pool->result, __ATOMIC_RELAXED) < 0;
+}
+
+static void record(walk_pool *pool, int ret)
+{
+	int none = 0;
+	if (ret < 0) __atomic_compare_exchange_n(&pool->result, &none, ret, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static walk_task *new_task(walk_task *parent, int i, int depth, const char *path, size_t len)
+{
+	walk_task *t = walk_realloc(NULL, sizeof(walk_task));
+	t->parent = parent;
+	t->inode = i;
+	t->depth = depth;
+	t->pending = 1;
+	t->path = walk_realloc(NULL, len + 1);
+	memcpy(t->path, path, len + 1);
+	return t;
+}
+
+static void finish_task(walk_pool *pool, walk_task *t)
+{
+	while (t && __atomic_sub_fetch(&t->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		if ((pool->flags & FS_WALK_POST) && !stopped(pool)) {
+			record(pool, visit(pool->fs, pool->fn, pool->arg, t->path, t->inode, t->depth, 1));
+		}
+		walk_task *parent = t->parent;
+		free(t->path);
+		free(t);
+		t = parent;
+	}
+}
+
+static void run_task(walk_worker *w, walk_task *t)
+{
+	walk_pool *pool = w->pool;
+	file_system *fs = pool->fs;
+	int children[DIRECT_BLOCKS_COUNT];
+	int count = stopped(pool) ? 0 : collect_children(fs, t->inode, children);
+	size_t len = strlen(t->path);
+	path_set(&w->path, t->path, len);
+
+	for (int k = 0; k < count && !stopped(pool); k++) {
+		int c = children[k], ret;
+		path_truncate(&w->path, len);
+		path_push(&w->path, fs->inodes[c].name);
+		if (FS_LOAD(fs->inodes[c].n_type) != directory) {
+			ret = visit(fs, pool->fn, pool->arg, w->path.s, c, t->depth + 1, 0);
+		} else if (enter_dir(fs, pool->fn, pool->arg, w->path.s, c, t->depth + 1, pool->flags, pool->max_depth,
+		                     &ret)) {
+			__atomic_add_fetch(&t->pending, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&pool->outstanding, 1, __ATOMIC_RELAXED);
+			deque_push(&pool->deques[w->id], new_task(t, c, t->depth + 1, w->path.s, w->path.len));
+		}
+		record(pool, ret);
+	}
+	finish_task(pool, t);
+	__atomic_sub_fetch(&pool->outstanding, 1, __ATOMIC_RELEASE);
+}
+
+static void *worker_main(void *arg)
+{
+	walk_worker *w = arg;
+	walk_pool *pool = w->pool;
+	unsigned int seed = (unsigned int)w->id + 1;
+
+	fs_read_begin(pool->fs);
+	while (__atomic_load_n(&pool->outstanding, __ATOMIC_ACQUIRE) > 0) {
+		walk_task *t = deque_take(&pool->deques[w->id], 0);
+		for (int k = 0; !t && k < pool->threads; k++) {
+			int victim = rand_r(&seed) % pool->threads;
+			if (victim != w->id) t = deque_take(&pool->deques[victim], 1);
+		}
+		if (t) {
+			run_task(w, t);
+		} else {
+			sched_yield();
+		}
+	}
+	fs_read_end(pool->fs);
+	return NULL;
+}
+
+int fs_walk_parallel(file_system *fs, char *path, fs_walk_fn fn, void *arg, int flags, int max_depth,
+                     int threads)
+{
+	if (threads <= 1) return fs_walk(fs, path, fn, arg, flags, max_depth);
+	if (!fs || !path || !fn) return -1;
+	flags = normalize_flags(flags);
+
+	fs_read_begin(fs);
+	int root = fs_lookup(fs, path, NULL);
+	if (root < 0) {
+		fs_read_end(fs);
+		return -1;
+	}
+
+	path_buf p = { 0 };
+	path_set(&p, path, strlen(path));
+	int ret;
+	if (FS_LOAD(fs->inodes[root].n_type) != directory) {
+		ret = visit(fs, fn, arg, p.s, root, 0, 0);
+		goto out;
+	}
+	if (!enter_dir(fs, fn, arg, p.s, root, 0, flags, max_depth, &ret)) goto out;
+
+	walk_pool pool = {
+		.fs = fs,
+		.fn = fn,
+		.arg = arg,
+		.flags = flags,
+		.max_depth = max_depth,
+		.threads = threads,
+		.outstanding = 1,
+		.result = 0,
+	};
+	pool.deques = calloc(threads, sizeof(walk_deque));
+	walk_worker *workers = calloc(threads, sizeof(walk_worker));
+	pthread_t *tids = calloc(threads, sizeof(pthread_t));
+	if (!pool.deques || !workers || !tids) {
+		perror("Calloc error");
+		exit(errno);
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+	deque_push(&pool.deques[0], new_task(NULL, root, 0, p.s, p.len));
+
+	// the calling thread is worker 0
+	for (int i = 1; i < threads; i++) pthread_create(&tids[i], NULL, worker_main, &workers[i]);
+	worker_main(&workers[0]);
+	for (int i = 1; i < threads; i++) pthread_join(tids[i], NULL);
+
+	for (int i = 0; i < threads; i++) {
+		pthread_mutex_destroy(&pool.deques[i].lock);
+		free(pool.deques[i].tasks);
+		free(workers[i].path.s);
+	}
+	free(pool.deques);
+	free(workers);
+	free(tids);
+	ret = pool.result;
+
+out:
+	fs_read_end(fs);
+	free(p.s);
+	return ret < 0 ? ret : 0;
+}
@@ -0,0 +1,86 @@
+import ctypes
+from wrappers import *
+
+FS_BATCH_MKDIR = 0
+FS_BATCH_MKFILE = 1
+FS_BATCH_WRITEF = 2
+FS_BATCH_RM = 3
+FS_BATCH_SKIPPED = -3
+
+class BatchEntry(ctypes.Structure):
+    _fields_ = [
+        ("op", ctypes.c_int),
+        ("path", ctypes.c_char_p),
+        ("text", ctypes.c_char_p),
+        ("status", ctypes.c_int)
+    ]
+
+def make_batch(*ops):
+    batch = (BatchEntry * len(ops))()
+    for i, op in enumerate(ops):
+        batch[i].op = op[0]
+        batch[i].path = bytes(op[1], "UTF-8")
+        batch[i].text = bytes(op[2], "UTF-8") if len(op) > 2 else None
+        batch[i].status = 0
+    return batch
+
+class Test_Batch:
+    # Successful batch
+    # * creates a directory, a file inside and writes to it, then removes an existing file
+    # Expected outcome:
+    # * return value 0, every status is what the single call returns
+    # * all changes are visible
+    def test_batch_all_applied(self):
+        fs = setup(8)
+        fs = set_fil(name="old", inode=1, parent=0, parent_block=0, fs=fs)
+        batch = make_batch((FS_BATCH_MKDIR, "/dir"),
+                           (FS_BATCH_MKFILE, "/dir/file"),
+                           (FS_BATCH_WRITEF, "/dir/file", SHORT_DATA),
+                           (FS_BATCH_RM, "/old"))
+        retval = libc.fs_batch(ctypes.byref(fs), batch, len(batch))
+        assert retval == 0
+        assert [e.status for e in batch] == [0, 0, len(SHORT_DATA), 0]
+        assert fs.inodes[0].direct_blocks[0] == -1
+        assert fs.inodes[1].n_type == 3
+        dir_inode = fs.inodes[0].direct_blocks[1]
+        assert fs.inodes[dir_inode].name.decode("utf-8") == "dir"
+        file_inode = fs.inodes[dir_inode].direct_blocks[0]
+        assert fs.inodes[file_inode].size == len(SHORT_DATA)
+
+    # Failed batch
+    # * the third operation creates a file that already exists
+    # Expected outcome:
+    # * return value -1, the failing status is -2, the rest was skipped
+    # * the directory and the write of the first operations are undone
+    def test_batch_rolled_back(self):
+        fs = setup(8)
+        fs = set_fil(name="file", inode=1, parent=0, parent_block=0, fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data="abc", parent_inode=1, parent_block_num=0, fs=fs)
+        batch = make_batch((FS_BATCH_MKDIR, "/dir"),
+                           (FS_BATCH_WRITEF, "/file", LONG_DATA),
+                           (FS_BATCH_MKFILE, "/file"),
+                           (FS_BATCH_RM, "/file"))
+        retval = libc.fs_batch(ctypes.byref(fs), batch, len(batch))
+        assert retval == -1
+        assert [e.status for e in batch] == [0, len(LONG_DATA), -2, FS_BATCH_SKIPPED]
+        assert fs.inodes[0].direct_blocks[0] == 1
+        assert fs.inodes[0].direct_blocks[1] == -1
+        assert fs.inodes[1].size == 3
+        assert fs.inodes[1].direct_blocks[1] == -1
+        assert fs.data_blocks[0].size == 3
+        for i in range(2, 8):
+            assert fs.inodes[i].n_type == 3
+        for i in range(1, 8):
+            assert fs.free_list[i] == 1
+
+    # Invalid arguments are found before anything runs
+    # Expected outcome:
+    # * return value -1, status -1 for the bad entry, nothing created
+    def test_batch_invalid(self):
+        fs = setup(5)
+        batch = make_batch((FS_BATCH_MKDIR, "/dir"),
+                           (FS_BATCH_MKFILE, "nofile"))
+        retval = libc.fs_batch(ctypes.byref(fs), batch, len(batch))
+        assert retval == -1
+        assert [e.status for e in batch] == [FS_BATCH_SKIPPED, -1]
+        assert fs.inodes[0].direct_blocks[0] == -1
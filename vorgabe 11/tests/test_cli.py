@@ -0,0 +1,58 @@
+import ctypes
+import os
+import subprocess
+from wrappers import *
+
+HA2 = "./build/ha2"
+SCRIPT = "temp_test_script"
+
+def ha2(*args, stdin=""):
+    return subprocess.run([HA2, *args], input=stdin, capture_output=True, text=True, timeout=30)
+
+class Test_Cli:
+    def teardown_method(self):
+        if os.path.exists(SCRIPT):
+            os.remove(SCRIPT)
+
+    # Commands from a script given with -b
+    # Expected outcome:
+    # * every command runs, readf prints the content
+    # * the image is saved at the end
+    def test_batch_script(self):
+        create_temp_file(data="mkdir /d\nmkfile /d/f\nwritef /d/f " + SHORT_DATA + "\nreadf /d/f\n", filename=SCRIPT)
+        out = ha2("-c", IMAGE, "32", "-b", SCRIPT)
+        assert out.returncode == 0
+        assert out.stdout == SHORT_DATA
+
+        fs = load()
+        assert names(fs, fs.root_node) == ["d"]
+        assert read(fs, "/d/f") == SHORT_DATA
+
+    # Commands piped into stdin without -b
+    # Expected outcome:
+    # * batch mode is chosen because stdin is no terminal, no prompt is shown
+    # * exit ends the script, the image is saved anyway
+    def test_batch_stdin(self):
+        assert ha2("-c", IMAGE, "32", stdin="mkfile /a\n").returncode == 0
+        out = ha2("-l", IMAGE, stdin="mkfile /b\nlist /\nexit\nmkfile /c\n")
+        assert out.returncode == 0
+        assert "user@SPR" not in out.stdout
+        assert sorted(out.stdout.split()) == ["FIL", "FIL", "a", "b"]
+
+        fs = load()
+        assert names(fs, fs.root_node) == ["a", "b"]
+
+    # Lines with extra blanks, tabs, CRLF endings and quotes
+    # Expected outcome:
+    # * words are split at any run of blanks and tabs, quotes are no syntax
+    # * the text of writef is the rest of the line after one blank, verbatim
+    def test_batch_tokens(self):
+        script = "  mkdir \t /d  \r\nmkfile /d/\"q\"\r\nwritef /d/\"q\" say \"hi  there\"\t!\r\n\n"
+        out = ha2("-c", IMAGE, "32", stdin=script)
+        assert out.returncode == 0
+
+        fs = load()
+        assert names(fs, fs.root_node) == ["d"]
+        d = fs.inodes[fs.root_node].direct_blocks[0]
+        assert names(fs, d) == ["\"q\""]
+        assert read(fs, "/d/\"q\"") == "say \"hi  there\"\t!"
@@ -0,0 +1,83 @@
+import ctypes
+from wrappers import *
+
+libc.fs_defrag.restype = ctypes.c_int64
+
+def fragment(fs):
+    # files written in turns hold every other block, the removed ones leave holes
+    for name in ["a", "b", "c", "d"]:
+        assert call(libc.fs_mkfile, fs, "/" + name) == 0
+    for _ in range(3):
+        for name in ["a", "b", "c", "d"]:
+            assert call(libc.fs_writef, fs, "/" + name, LONG_DATA) == len(LONG_DATA)
+    assert call(libc.fs_rm, fs, "/a") == 0
+    assert call(libc.fs_rm, fs, "/c") == 0
+
+def used_blocks(fs):
+    n = fs.s_block[0].num_blocks
+    return [b for b in range(n) if fs.free_list[b] == 0]
+
+def file_blocks(fs, i):
+    return [b for b in fs.inodes[i].direct_blocks if b >= 0]
+
+class Test_Defrag:
+    # Files with interleaved blocks and holes left by removed ones
+    # Expected outcome:
+    # * every file is one run in inode order, the free blocks are at the end
+    # * the used inodes are at the front, contents and consistency are kept
+    def test_defrag_compacts(self):
+        fs = setup(64)
+        fragment(fs)
+        assert used_blocks(fs) != list(range(len(used_blocks(fs))))
+
+        assert libc.fs_defrag(ctypes.byref(fs)) > 0
+        used = used_blocks(fs)
+        assert used == list(range(len(used)))
+        files = [i for i in range(64) if fs.inodes[i].n_type == NodeType.reg_file]
+        assert files == [1, 2]
+        assert file_blocks(fs, 1) + file_blocks(fs, 2) == used
+        assert read(fs, "/b") == LONG_DATA * 3
+        assert read(fs, "/d") == LONG_DATA * 3
+        assert check(fs) == 0
+
+        # nothing left to move
+        assert libc.fs_defrag(ctypes.byref(fs)) == 0
+
+    # Directories and hard links above free inodes move down
+    # Expected outcome:
+    # * entries, parent links and link targets follow the moved inodes
+    def test_defrag_moves_inodes(self):
+        fs = setup(32)
+        fragment(fs)
+        assert call(libc.fs_mkdir, fs, "/x") == 0
+        assert call(libc.fs_mkfile, fs, "/x/f") == 0
+        assert call(libc.fs_writef, fs, "/x/f", SHORT_DATA) == len(SHORT_DATA)
+        assert call(libc.fs_link, fs, "/x/f", "/l") == 0
+
+        assert libc.fs_defrag(ctypes.byref(fs)) > 0
+        used = [i for i in range(32) if fs.inodes[i].n_type != NodeType.free_block]
+        assert used == list(range(len(used)))
+        assert read(fs, "/x/f") == SHORT_DATA
+        assert read(fs, "/l") == SHORT_DATA
+        assert check(fs) == 0
+
+    # Several hard links to files that move, defragmented in small steps
+    # Expected outcome:
+    # * every link follows its file, whether the file or the link moves first
+    def test_defrag_links_in_steps(self):
+        fs = setup(32)
+        fragment(fs)
+        assert call(libc.fs_mkfile, fs, "/f") == 0
+        assert call(libc.fs_writef, fs, "/f", SHORT_DATA) == len(SHORT_DATA)
+        for name in ["/l1", "/l2", "/l3"]:
+            assert call(libc.fs_link, fs, "/f", name) == 0
+        assert call(libc.fs_link, fs, "/d", "/l4") == 0
+
+        while libc.fs_defrag_step(ctypes.byref(fs), 1) > 0:
+            pass
+        used = [i for i in range(32) if fs.inodes[i].n_type != NodeType.free_block]
+        assert used == list(range(len(used)))
+        for name in ["/f", "/l1", "/l2", "/l3"]:
+            assert read(fs, name) == SHORT_DATA
+        assert read(fs, "/l4") == LONG_DATA * 3
+        assert check(fs) == 0
@@ -0,0 +1,130 @@
+import ctypes
+import os
+from wrappers import *
+
+FSCK_BAD_ENTRY, FSCK_DOUBLE_ALLOC, FSCK_FREE_IN_USE, FSCK_ORPHAN_BLOCK = 2, 4, 5, 6
+FSCK_ORPHAN_INODE, FSCK_MULTI_LISTED, FSCK_BROKEN_PARENT, FSCK_LINK_COUNT = 7, 8, 9, 10
+FSCK_FILE_SIZE, FSCK_FREE_COUNT = 11, 12
+FSCK_PROBLEM_COUNT = 13
+
+class Report(ctypes.Structure):
+    _fields_ = [
+        ("problems", ctypes.c_uint64 * FSCK_PROBLEM_COUNT),
+        ("first", ctypes.c_int64 * FSCK_PROBLEM_COUNT),
+        ("inodes_used", ctypes.c_uint32),
+        ("blocks_used", ctypes.c_uint32),
+        ("repaired", ctypes.c_int)
+    ]
+
+# problems found and the report of fs_check
+def fsck(fs, repair=0):
+    r = Report()
+    found = libc.fs_check(ctypes.byref(fs), repair, ctypes.byref(r))
+    return found, r
+
+def populate(fs):
+    assert call(libc.fs_mkdir, fs, "/d") == 0
+    assert call(libc.fs_mkfile, fs, "/d/f") == 0
+    assert call(libc.fs_writef, fs, "/d/f", LONG_DATA) == len(LONG_DATA)
+    assert call(libc.fs_mkfile, fs, "/g") == 0
+    assert call(libc.fs_writef, fs, "/g", SHORT_DATA) == len(SHORT_DATA)
+    assert call(libc.fs_link, fs, "/d/f", "/l") == 0
+
+def find(fs, name):
+    return [i for i in range(fs.s_block[0].num_blocks) if fs.inodes[i].n_type != NodeType.free_block and fs.inodes[i].name == bytes(name, "UTF-8")][0]
+
+class Test_Fsck:
+    # A filesystem built through the API
+    # Expected outcome:
+    # * no problems, every inode and block in use is counted
+    def test_fsck_clean(self):
+        fs = setup(32)
+        populate(fs)
+        found, r = fsck(fs)
+        assert found == 0
+        assert r.inodes_used == 5
+        assert r.blocks_used == 3
+        assert r.repaired == 0
+
+    # Free list, parent links, a block held twice, an orphan and a stale
+    # directory entry are broken by hand
+    # Expected outcome:
+    # * each problem is reported at the right inode / block
+    # * --repair fixes all of them and keeps the files
+    def test_fsck_repair(self):
+        fs = setup(32)
+        populate(fs)
+        d, f, g = find(fs, "d"), find(fs, "f"), find(fs, "g")
+        b = fs.inodes[f].direct_blocks[0]
+        fs.free_list[b] = 1
+        fs.inodes[f].parent = 0
+        fs.inodes[g].direct_blocks[1] = b
+        fs.inodes[20].n_type = NodeType.directory
+        fs.inodes[20].parent = 0
+        fs.inodes[d].direct_blocks[5] = 0
+        fs.inodes[f].links = 3
+        fs.inodes[g].size = 7
+        found, r = fsck(fs)
+        assert r.problems[FSCK_FREE_IN_USE] == 1
+        assert r.first[FSCK_FREE_IN_USE] == b
+        assert r.problems[FSCK_DOUBLE_ALLOC] == 1
+        assert r.problems[FSCK_BROKEN_PARENT] == 1
+        assert r.first[FSCK_BROKEN_PARENT] == f
+        assert r.problems[FSCK_ORPHAN_INODE] == 1
+        assert r.first[FSCK_ORPHAN_INODE] == 20
+        assert r.problems[FSCK_BAD_ENTRY] == 1
+        assert r.problems[FSCK_LINK_COUNT] == 1
+        assert r.problems[FSCK_FILE_SIZE] == 1
+        assert r.first[FSCK_FILE_SIZE] == g
+        assert r.problems[FSCK_FREE_COUNT] == 1
+        assert found == sum(r.problems)
+
+        found, r = fsck(fs, 1)
+        assert r.repaired == 1
+        found, r = fsck(fs)
+        assert found == 0
+        assert fs.inodes[f].parent == d
+        assert fs.inodes[f].links == 1
+        assert fs.inodes[20].n_type == NodeType.free_block
+        assert fs.inodes[g].direct_blocks[1] == -1
+        assert fs.inodes[g].size == len(SHORT_DATA)
+
+    # Two directories list the same file
+    # Expected outcome:
+    # * reported as listed twice, the entry in its parent stays
+    def test_fsck_listed_twice(self):
+        fs = setup(16)
+        populate(fs)
+        d, g = find(fs, "d"), find(fs, "g")
+        fs.inodes[d].direct_blocks[7] = g
+        found, r = fsck(fs, 1)
+        assert r.problems[FSCK_MULTI_LISTED] == 1
+        assert r.first[FSCK_MULTI_LISTED] == g
+        assert fsck(fs)[0] == 0
+        assert fs.inodes[d].direct_blocks[7] == -1
+        assert fs.inodes[g].parent == 0
+
+    # An image with a journal not replayed yet is checked on disk
+    # Expected outcome:
+    # * checking works, a repair is refused as the journal would be replayed
+    #   over it
+    # * once a load and dump replayed the journal, the repair runs
+    def test_fsck_image_journal(self):
+        journal = IMAGE + ".journal"
+        path = ctypes.c_char_p(bytes(IMAGE, "UTF-8"))
+        fs = setup(32)
+        populate(fs)
+        assert libc.fs_dump(ctypes.byref(fs), path) == 0
+        assert libc.fs_journal_open(ctypes.byref(fs), 3, 1) == 0
+        assert call(libc.fs_mkfile, fs, "/h") == 0
+        assert os.path.getsize(journal) > 0
+
+        r = Report()
+        assert libc.fs_check_image(path, 0, ctypes.byref(r)) == 0
+        assert libc.fs_check_image(path, 1, ctypes.byref(r)) == -1
+
+        loaded = load()
+        assert libc.fs_dump(ctypes.byref(loaded), path) == 0
+        assert not os.path.exists(journal)
+        assert libc.fs_check_image(path, 1, ctypes.byref(r)) == 0
+        assert read(load(), "/h") == ""
@@ -45,4 +45,37 @@ class Test_Imp:
         delete_temp_file()
 
 
-    # TODO: add test for failing operations
+    # Imports a file that needs more blocks than are free over an existing file
+    # Expected behaviour:
+    #  * retval is -1
+    #  * the old content is still there, no block was taken
+    def test_import_no_space_keeps_old(self):
+        fs = setup(3)
+        fs = set_fil(name="fil1",inode=1,parent=0,parent_block=0,fs=fs)
+        fs = set_data_block_with_string(block_num=0,string_data=SHORT_DATA,parent_inode=1,parent_block_num=0,fs=fs)
+        filename = create_temp_file(data=LONG_DATA*3)
+        retval = libc.fs_import(ctypes.byref(fs),ctypes.c_char_p(bytes("/fil1","UTF-8")),ctypes.c_char_p(bytes(filename,"utf-8")))
+
+        assert retval == -1
+        assert fs.inodes[1].direct_blocks[0] == 0
+        assert fs.inodes[1].direct_blocks[1] == -1
+        assert fs.inodes[1].size == len(SHORT_DATA)
+        assert fs.data_blocks[0].size == len(SHORT_DATA)
+        assert fs.free_list[1] == 1
+        assert fs.free_list[2] == 1
+        delete_temp_file()
+
+    # Imports a file that does not fit to a new path
+    # Expected behaviour:
+    #  * retval is -1
+    #  * no file was left behind
+    def test_import_no_space_new_file(self):
+        fs = setup(2)
+        filename = create_temp_file(data=LONG_DATA*2)
+        retval = libc.fs_import(ctypes.byref(fs),ctypes.c_char_p(bytes("/fil1","UTF-8")),ctypes.c_char_p(bytes(filename,"utf-8")))
+
+        assert retval == -1
+        assert fs.inodes[0].direct_blocks[0] == -1
+        assert fs.inodes[1].n_type == NodeType.free_block
+        assert fs.free_list[0] == 1
+        delete_temp_file()
@@ -0,0 +1,103 @@
+import ctypes
+import os
+from wrappers import *
+
+JOURNAL = IMAGE + ".journal"
+JOURNAL_DATA = 1
+JOURNAL_SYNC = 2
+
+def remove_journals():
+    for path in [JOURNAL, JOURNAL + ".old"]:
+        if os.path.exists(path):
+            os.remove(path)
+
+# a new filesystem logging every operation with its data before it returns
+def journaled(size):
+    remove_journals()
+    fs = setup(size)
+    assert libc.fs_journal_open(ctypes.byref(fs), JOURNAL_DATA | JOURNAL_SYNC, 1) == 0
+    return fs
+
+class Test_Journal:
+    def teardown_method(self):
+        remove_journals()
+
+    # Files are written, the filesystem is abandoned without a dump and the
+    # image loaded again
+    # Expected outcome:
+    # * the journal brings back every change, the result is consistent
+    def test_journal_replay(self):
+        fs = journaled(32)
+        assert call(libc.fs_mkdir, fs, "/d") == 0
+        assert call(libc.fs_mkfile, fs, "/d/f") == 0
+        assert call(libc.fs_writef, fs, "/d/f", LONG_DATA) == len(LONG_DATA)
+        assert call(libc.fs_mkfile, fs, "/g") == 0
+        assert call(libc.fs_writef, fs, "/g", SHORT_DATA) == len(SHORT_DATA)
+
+        loaded = load()
+        assert names(loaded, loaded.root_node) == ["d", "g"]
+        assert read(loaded, "/d/f") == LONG_DATA
+        assert read(loaded, "/g") == SHORT_DATA
+        assert check(loaded) == 0
+
+    # The last transaction is only partly written when the filesystem is
+    # abandoned
+    # Expected outcome:
+    # * every complete transaction is replayed, the torn one is not
+    # * the torn tail is cut off the journal
+    def test_journal_torn_tail(self):
+        fs = journaled(32)
+        assert call(libc.fs_mkfile, fs, "/f") == 0
+        assert call(libc.fs_writef, fs, "/f", SHORT_DATA) == len(SHORT_DATA)
+        complete = os.path.getsize(JOURNAL)
+        assert call(libc.fs_writef, fs, "/f", LONG_DATA) == len(LONG_DATA)
+        assert os.path.getsize(JOURNAL) > complete + 16
+        os.truncate(JOURNAL, complete + 16)
+
+        loaded = load()
+        assert read(loaded, "/f") == SHORT_DATA
+        assert check(loaded) == 0
+        assert os.path.getsize(JOURNAL) == complete
+
+    # A replayed filesystem is changed and flushed, then abandoned again
+    # Expected outcome:
+    # * the flush writes the replayed changes before it drops their journal,
+    #   both the replayed and the new entry survive
+    def test_journal_replay_flush(self):
+        fs = journaled(32)
+        assert call(libc.fs_mkdir, fs, "/a") == 0
+
+        loaded = load()
+        assert libc.fs_journal_open(ctypes.byref(loaded), JOURNAL_DATA | JOURNAL_SYNC, 1) == 0
+        assert call(libc.fs_mkdir, loaded, "/b") == 0
+        assert libc.fs_flush(ctypes.byref(loaded)) == 0
+
+        again = load()
+        assert names(again, again.root_node) == ["a", "b"]
+        assert check(again) == 0
+
+    # A replayed filesystem is changed without a journal and dumped, or
+    # flushed, then loaded again
+    # Expected outcome:
+    # * the write of the image removes the replayed journal, the second load
+    #   does not replay it over the newer changes
+    def test_journal_replay_then_unjournaled(self):
+        for save in [lambda fs: libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(bytes(IMAGE, "UTF-8"))),
+                     lambda fs: libc.fs_flush(ctypes.byref(fs))]:
+            fs = journaled(32)
+            assert call(libc.fs_mkfile, fs, "/a") == 0
+            assert call(libc.fs_writef, fs, "/a", SHORT_DATA) == len(SHORT_DATA)
+
+            loaded = load()
+            assert read(loaded, "/a") == SHORT_DATA
+            assert call(libc.fs_rm, loaded, "/a") == 0
+            assert call(libc.fs_mkfile, loaded, "/b") == 0
+            assert call(libc.fs_writef, loaded, "/b", LONG_DATA) == len(LONG_DATA)
+            assert save(loaded) == 0
+            assert not os.path.exists(JOURNAL)
+            assert not os.path.exists(JOURNAL + ".old")
+
+            again = load()
+            assert names(again, again.root_node) == ["b"]
+            assert read(again, "/b") == LONG_DATA
+            assert check(again) == 0
@@ -0,0 +1,119 @@
+import ctypes
+from wrappers import *
+from test_stats import get_stats, FS_CTR_CACHE_HITS, FS_CTR_CACHE_MISSES, FS_CTR_CACHE_WRITEBACKS
+from test_journal import remove_journals, JOURNAL_DATA, JOURNAL_SYNC
+
+libc.fs_load_lazy.restype = ctypes.POINTER(FileSystem)
+
+def populate():
+    # 10 files of 4 blocks each
+    fs = setup(128)
+    for i in range(10):
+        assert call(libc.fs_mkfile, fs, "/f%d" % i) == 0
+        assert call(libc.fs_writef, fs, "/f%d" % i, LONG_DATA * 3) == len(LONG_DATA) * 3
+    assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(bytes(IMAGE, "UTF-8"))) == 0
+
+def load_lazy(frames):
+    return libc.fs_load_lazy(ctypes.c_char_p(bytes(IMAGE, "UTF-8")), frames).contents
+
+class Test_Lazy:
+    # Loading lazily, then reading one file
+    # Expected outcome:
+    # * no data block is read by the load, only those of the file afterwards
+    def test_lazy_on_demand(self):
+        populate()
+        fs = load_lazy(16)
+        assert not fs.data_blocks
+        assert get_stats(fs).counters[FS_CTR_CACHE_MISSES] == 0
+        assert read(fs, "/f3") == LONG_DATA * 3
+        assert get_stats(fs).counters[FS_CTR_CACHE_MISSES] == 4
+        assert read(fs, "/f3") == LONG_DATA * 3
+        st = get_stats(fs)
+        assert st.counters[FS_CTR_CACHE_MISSES] == 4
+        assert st.counters[FS_CTR_CACHE_HITS] >= 4
+
+    # More data is read than fits into the cache
+    # Expected outcome:
+    # * blocks are evicted and read again, the contents stay right
+    def test_lazy_eviction(self):
+        populate()
+        fs = load_lazy(8)
+        for _ in range(2):
+            for i in range(10):
+                assert read(fs, "/f%d" % i) == LONG_DATA * 3
+        assert get_stats(fs).counters[FS_CTR_CACHE_MISSES] >= 80
+        assert check(fs) == 0
+
+    # Writes to more blocks than the cache holds, flushed and dumped
+    # Expected outcome:
+    # * changed blocks are kept until written, then read back from the image
+    # * an eager load of the dump has every change
+    def test_lazy_write(self):
+        populate()
+        fs = load_lazy(4)
+        for i in range(10):
+            assert call(libc.fs_writef, fs, "/f%d" % i, SHORT_DATA) == len(SHORT_DATA)
+        assert call(libc.fs_mkfile, fs, "/new") == 0
+        assert call(libc.fs_writef, fs, "/new", LONG_DATA) == len(LONG_DATA)
+        assert libc.fs_flush(ctypes.byref(fs)) == 0
+        for i in range(10):
+            assert read(fs, "/f%d" % i) == LONG_DATA * 3 + SHORT_DATA
+
+        assert call(libc.fs_rm, fs, "/f0") == 0
+        assert call(libc.fs_writef, fs, "/f1", SHORT_DATA) == len(SHORT_DATA)
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(bytes(IMAGE, "UTF-8"))) == 0
+        assert read(fs, "/f1") == LONG_DATA * 3 + SHORT_DATA * 2
+
+        loaded = load()
+        assert read(loaded, "/new") == LONG_DATA
+        assert read(loaded, "/f1") == LONG_DATA * 3 + SHORT_DATA * 2
+        assert read(loaded, "/f9") == LONG_DATA * 3 + SHORT_DATA
+        assert check(loaded) == 0
+
+    # Writes to more blocks than the cache holds with nothing flushing, then
+    # a dump
+    # Expected outcome:
+    # * changed frames are written back to make room instead of the cache
+    #   growing, reading them again gives the new content
+    def test_lazy_write_back(self):
+        populate()
+        fs = load_lazy(4)
+        for i in range(10):
+            assert call(libc.fs_writef, fs, "/f%d" % i, SHORT_DATA) == len(SHORT_DATA)
+        assert get_stats(fs).counters[FS_CTR_CACHE_WRITEBACKS] >= 6
+        for i in range(10):
+            assert read(fs, "/f%d" % i) == LONG_DATA * 3 + SHORT_DATA
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(bytes(IMAGE, "UTF-8"))) == 0
+
+        loaded = load()
+        for i in range(10):
+            assert read(loaded, "/f%d" % i) == LONG_DATA * 3 + SHORT_DATA
+        assert check(loaded) == 0
+
+    # Journaled writes to more blocks than the cache holds, abandoned, loaded
+    # lazily and flushed
+    # Expected outcome:
+    # * the replayed blocks stay cached until the flush writes them
+    # * blocks allocated after the replay are not read from the image
+    def test_lazy_replay_flush(self):
+        populate()
+        remove_journals()
+        fs = load_lazy(4)
+        assert libc.fs_journal_open(ctypes.byref(fs), JOURNAL_DATA | JOURNAL_SYNC, 1) == 0
+        for i in range(10):
+            assert call(libc.fs_writef, fs, "/f%d" % i, SHORT_DATA) == len(SHORT_DATA)
+
+        fs = load_lazy(4)
+        assert libc.fs_journal_open(ctypes.byref(fs), JOURNAL_DATA | JOURNAL_SYNC, 1) == 0
+        assert call(libc.fs_mkfile, fs, "/new") == 0
+        misses = get_stats(fs).counters[FS_CTR_CACHE_MISSES]
+        assert call(libc.fs_writef, fs, "/new", LONG_DATA) == len(LONG_DATA)
+        assert get_stats(fs).counters[FS_CTR_CACHE_MISSES] == misses
+        assert libc.fs_flush(ctypes.byref(fs)) == 0
+
+        loaded = load()
+        for i in range(10):
+            assert read(loaded, "/f%d" % i) == LONG_DATA * 3 + SHORT_DATA
+        assert read(loaded, "/new") == LONG_DATA
+        assert check(loaded) == 0
+        remove_journals()
@@ -0,0 +1,56 @@
+import ctypes
+from wrappers import *
+
+class Test_Link:
+    # Creating a hard link
+    # Expected outcome:
+    # * a new link inode naming the file, no data block copied
+    # * reads and writes through both names see the same content
+    def test_link_shares_data(self):
+        fs = setup(6)
+        fs = set_fil(name="file", inode=1, parent=0, parent_block=0, fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data="abc", parent_inode=1, parent_block_num=0, fs=fs)
+        fs = set_dir(name="dir", inode=2, parent=0, parent_block=1, fs=fs)
+        retval = call(libc.fs_link, fs, "/file", "/dir/other")
+        assert retval == 0
+        assert fs.inodes[3].n_type == NodeType.hard_link
+        assert fs.inodes[3].direct_blocks[0] == 1
+        assert fs.inodes[3].parent == 2
+        assert fs.inodes[1].links == 1
+        assert fs.free_list[1] == 1
+        assert call(libc.fs_writef, fs, "/dir/other", "def") == 3
+        assert read(fs, "/file") == "abcdef"
+        assert call(libc.fs_link, fs, "/file", "/dir/other") == -2
+        assert call(libc.fs_link, fs, "/dir", "/x") == -1
+
+    # Removing names
+    # * the file's own name first, then the link
+    # Expected outcome:
+    # * the data survives the first rm, the last rm frees inode and block
+    def test_link_rm(self):
+        fs = setup(6)
+        fs = set_fil(name="file", inode=1, parent=0, parent_block=0, fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data="abc", parent_inode=1, parent_block_num=0, fs=fs)
+        assert call(libc.fs_link, fs, "/file", "/other") == 0
+        assert call(libc.fs_rm, fs, "/file") == 0
+        assert fs.inodes[1].n_type == NodeType.reg_file
+        assert fs.free_list[0] == 0
+        assert read(fs, "/other") == "abc"
+        assert call(libc.fs_rm, fs, "/other") == 0
+        assert fs.inodes[1].n_type == NodeType.free_block
+        assert fs.inodes[2].n_type == NodeType.free_block
+        assert fs.free_list[0] == 1
+
+    # Removing a directory that holds both names
+    # Expected outcome:
+    # * everything is freed
+    def test_link_rm_dir(self):
+        fs = setup(6)
+        fs = set_dir(name="dir", inode=1, parent=0, parent_block=0, fs=fs)
+        fs = set_fil(name="file", inode=2, parent=1, parent_block=0, fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data="abc", parent_inode=2, parent_block_num=0, fs=fs)
+        assert call(libc.fs_link, fs, "/dir/file", "/dir/other") == 0
+        assert call(libc.fs_rm, fs, "/dir") == 0
+        for i in range(1, 4):
+            assert fs.inodes[i].n_type == NodeType.free_block
+        assert fs.free_list[0] == 1
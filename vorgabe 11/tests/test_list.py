@@ -1,6 +1,14 @@
 import ctypes
 from wrappers import *
 
+class Dirent(ctypes.Structure):
+    _fields_ = [
+        ("inode", ctypes.c_int),
+        ("type", ctypes.c_int),
+        ("size", ctypes.c_uint16),
+        ("name", ctypes.c_char * (NAME_MAX_LENGTH + 1))
+    ]
+
 class Test_List:
     def test_list_one_dir(self):
         fs = setup(5)
@@ -35,3 +43,26 @@ class Test_List:
         libc.fs_list.restype = ctypes.c_char_p
         retval = libc.fs_list(ctypes.byref(fs), ctypes.c_char_p(bytes("/","UTF-8")))
         assert retval.decode("utf-8") == "DIR Dir1\nDIR Dir2\nDIR Dir3\nFIL Fil1\nFIL Fil2\n"
+
+    # Iterating with fs_opendir / fs_readdir
+    # * a directory with a file (with content) and a directory, in reverse slot order
+    # Expected outcome:
+    # * entries come in inode order with type and size, then NULL
+    def test_readdir(self):
+        fs = setup(10)
+        fs = set_dir(name="Dir1",inode=2,parent=0,parent_block=0,fs=fs)
+        fs = set_fil(name="Fil1",inode=1,parent=0,parent_block=1,fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data=SHORT_DATA, parent_inode=1, parent_block_num=0, fs=fs)
+
+        dir = (ctypes.c_uint8 * 4096)()
+        assert libc.fs_opendir(ctypes.byref(fs), ctypes.c_char_p(bytes("/","UTF-8")), dir) == 0
+        libc.fs_readdir.restype = ctypes.POINTER(Dirent)
+        entries = []
+        while True:
+            e = libc.fs_readdir(dir)
+            if not e:
+                break
+            entries.append((e.contents.inode, e.contents.type, e.contents.size, e.contents.name.decode("utf-8")))
+        libc.fs_closedir(dir)
+        assert entries == [(1, 1, len(SHORT_DATA), "Fil1"), (2, 2, 0, "Dir1")]
+        assert libc.fs_opendir(ctypes.byref(fs), ctypes.c_char_p(bytes("/Dir1/x","UTF-8")), dir) == -1
@@ -0,0 +1,58 @@
+import ctypes
+from wrappers import *
+
+def mv(fs, src, dst):
+    return libc.fs_mv(ctypes.byref(fs), ctypes.c_char_p(bytes(src, "UTF-8")), ctypes.c_char_p(bytes(dst, "UTF-8")))
+
+class Test_Mv:
+    # Rename inside the same directory
+    # Expected outcome:
+    # * same inode and slot, new name, no inode or block allocated
+    def test_mv_rename(self):
+        fs = setup(5)
+        fs = set_fil(name="old", inode=1, parent=0, parent_block=0, fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data="abc", parent_inode=1, parent_block_num=0, fs=fs)
+        retval = mv(fs, "/old", "/new")
+        assert retval == 0
+        assert fs.inodes[0].direct_blocks[0] == 1
+        assert fs.inodes[1].name.decode("utf-8") == "new"
+        assert fs.inodes[1].direct_blocks[0] == 0
+        for i in range(2, 5):
+            assert fs.inodes[i].n_type == 3
+
+    # Move a directory with content into another directory
+    # Expected outcome:
+    # * the subtree is relinked, children keep their inodes
+    def test_mv_dir(self):
+        fs = setup(6)
+        fs = set_dir(name="src", inode=1, parent=0, parent_block=0, fs=fs)
+        fs = set_fil(name="file", inode=2, parent=1, parent_block=0, fs=fs)
+        fs = set_dir(name="dst", inode=3, parent=0, parent_block=1, fs=fs)
+        retval = mv(fs, "/src", "/dst/moved")
+        assert retval == 0
+        assert fs.inodes[0].direct_blocks[0] == -1
+        assert fs.inodes[3].direct_blocks[0] == 1
+        assert fs.inodes[1].parent == 3
+        assert fs.inodes[1].name.decode("utf-8") == "moved"
+        assert fs.inodes[1].direct_blocks[0] == 2
+        assert fs.inodes[2].parent == 1
+
+    # Invalid moves
+    # Expected outcome:
+    # * -2 if the destination exists, -1 for a missing source, the root,
+    #   a destination inside the source or a full directory; nothing changes
+    def test_mv_invalid(self):
+        fs = setup(16)
+        fs = set_dir(name="a", inode=1, parent=0, parent_block=0, fs=fs)
+        fs = set_fil(name="b", inode=2, parent=0, parent_block=1, fs=fs)
+        fs = set_dir(name="full", inode=3, parent=0, parent_block=2, fs=fs)
+        for i in range(DIRECT_BLOCKS_COUNT):
+            fs.inodes[3].direct_blocks[i] = 2
+        assert mv(fs, "/a", "/b") == -2
+        assert mv(fs, "/nope", "/c") == -1
+        assert mv(fs, "/", "/c") == -1
+        assert mv(fs, "/a", "/a/inner") == -1
+        assert mv(fs, "/a", "/full/a") == -1
+        assert fs.inodes[0].direct_blocks[0] == 1
+        assert fs.inodes[1].parent == 0
+        assert fs.inodes[1].name.decode("utf-8") == "a"
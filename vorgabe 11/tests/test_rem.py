@@ -85,3 +85,51 @@ class Test_Rem:
         assert fs.inodes[0].direct_blocks[1] == -1
         assert fs.inodes[0].direct_blocks[2] == -1
 
+
+    # Blocks and inodes of the removed tree are freed in ranges
+    # * the tree uses blocks 0, 1 and 3, block 2 belongs to a file outside of it
+    # Expected outcome:
+    # * exactly the blocks and inodes of the tree are free afterwards
+    def test_rem_recursion_frees_ranges(self):
+        fs = setup(8)
+        fs = set_dir(name="firstDir",inode=1,parent=0,parent_block=0,fs=fs)
+        fs = set_dir(name="secondDir",inode=2,parent=1,parent_block=0,fs=fs)
+        fs = set_fil(name="fil1",inode=3,parent=1,parent_block=1,fs=fs)
+        fs = set_fil(name="fil2",inode=4,parent=2,parent_block=0,fs=fs)
+        fs = set_fil(name="keep",inode=5,parent=0,parent_block=1,fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data="a", parent_inode=3, parent_block_num=0, fs=fs)
+        fs = set_data_block_with_string(block_num=1, string_data="b", parent_inode=3, parent_block_num=1, fs=fs)
+        fs = set_data_block_with_string(block_num=2, string_data="c", parent_inode=5, parent_block_num=0, fs=fs)
+        fs = set_data_block_with_string(block_num=3, string_data="d", parent_inode=4, parent_block_num=0, fs=fs)
+        free_before = fs.s_block.contents.free_blocks
+        retval = libc.fs_rm(ctypes.byref(fs), ctypes.c_char_p(bytes("/firstDir","UTF-8")))
+        assert retval == 0
+        assert [fs.free_list[i] for i in range(4)] == [1, 1, 0, 1]
+        assert [fs.inodes[i].n_type for i in range(6)] == [2, 3, 3, 3, 3, 1]
+        assert fs.s_block.contents.free_blocks == free_before + 3
+        assert fs.inodes[0].direct_blocks[1] == 5
+
+    # Deferred removal
+    # * the tree is unlinked at once, freed by reclaim steps of two inodes
+    # Expected outcome:
+    # * nothing is freed before the first step, everything after the last one
+    def test_rem_deferred(self):
+        fs = setup(8)
+        fs = set_dir(name="firstDir",inode=1,parent=0,parent_block=0,fs=fs)
+        fs = set_dir(name="secondDir",inode=2,parent=1,parent_block=0,fs=fs)
+        fs = set_fil(name="fil1",inode=3,parent=1,parent_block=1,fs=fs)
+        fs = set_fil(name="fil2",inode=4,parent=2,parent_block=0,fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data="a", parent_inode=4, parent_block_num=0, fs=fs)
+        retval = libc.fs_rm_deferred(ctypes.byref(fs), ctypes.c_char_p(bytes("/firstDir","UTF-8")))
+        assert retval == 0
+        assert fs.inodes[0].direct_blocks[0] == -1
+        assert fs.inodes[1].parent == -1
+        assert [fs.inodes[i].n_type for i in range(1, 5)] == [2, 2, 1, 1]
+        assert libc.fs_reclaim_pending(ctypes.byref(fs)) == 1
+        assert libc.fs_reclaim_step(ctypes.byref(fs), 2) == 2
+        assert libc.fs_reclaim_pending(ctypes.byref(fs)) == 1
+        assert libc.fs_reclaim_step(ctypes.byref(fs), 2) == 2
+        assert libc.fs_reclaim_pending(ctypes.byref(fs)) == 0
+        assert [fs.inodes[i].n_type for i in range(1, 5)] == [3, 3, 3, 3]
+        assert fs.free_list[0] == 1
+        assert libc.fs_rm_deferred(ctypes.byref(fs), ctypes.c_char_p(bytes("/firstDir","UTF-8"))) == -1
@@ -0,0 +1,73 @@
+import ctypes
+import os
+from wrappers import *
+
+libc.fs_defrag.restype = ctypes.c_int64
+libc.fs_shrink.restype = ctypes.c_int64
+
+def fill(fs, count):
+    for i in range(count):
+        assert call(libc.fs_mkfile, fs, "/f%d" % i) == 0
+        assert call(libc.fs_writef, fs, "/f%d" % i, LONG_DATA) == len(LONG_DATA)
+
+class Test_Resize:
+    # A full filesystem grows
+    # Expected outcome:
+    # * the new blocks and inodes are free and can be used right away
+    # * the image on disk has the new size and the old contents
+    def test_grow(self):
+        fs = setup(8)
+        fill(fs, 4)
+        assert call(libc.fs_mkfile, fs, "/x") == 0
+        assert call(libc.fs_writef, fs, "/x", LONG_DATA) == -2
+
+        assert libc.fs_resize(ctypes.byref(fs), 32) == 0
+        assert fs.s_block[0].num_blocks == 32
+        assert fs.s_block[0].free_blocks == 32 - 8
+        assert all(fs.free_list[b] == 1 and fs.inodes[b].n_type == NodeType.free_block for b in range(8, 32))
+        assert call(libc.fs_writef, fs, "/x", LONG_DATA) == len(LONG_DATA)
+        assert check(fs) == 0
+
+        loaded = load()
+        assert loaded.s_block[0].num_blocks == 32
+        assert read(loaded, "/f3") == LONG_DATA
+        assert check(loaded) == 0
+
+    # Shrinking below blocks / inodes in use
+    # Expected outcome:
+    # * refused, nothing changes
+    def test_shrink_in_use(self):
+        fs = setup(32)
+        fill(fs, 3)
+        size = os.path.getsize(IMAGE)
+        assert libc.fs_resize(ctypes.byref(fs), 4) == -1
+        assert fs.s_block[0].num_blocks == 32
+        assert os.path.getsize(IMAGE) == size
+        assert libc.fs_resize(ctypes.byref(fs), 7) == 0
+        assert fs.s_block[0].num_blocks == 7
+        assert fs.s_block[0].free_blocks == 1
+        assert read(fs, "/f1") == LONG_DATA
+        assert check(fs) == 0
+
+    # Shrinking after a defragmentation
+    # Expected outcome:
+    # * the image keeps only the used part and loads with the same contents
+    def test_shrink(self):
+        fs = setup(64)
+        for name in ["a", "b", "c", "d"]:
+            assert call(libc.fs_mkfile, fs, "/" + name) == 0
+        for _ in range(3):
+            for name in ["a", "b", "c", "d"]:
+                assert call(libc.fs_writef, fs, "/" + name, LONG_DATA) == len(LONG_DATA)
+        assert call(libc.fs_rm, fs, "/a") == 0
+        assert call(libc.fs_rm, fs, "/c") == 0
+
+        assert libc.fs_defrag(ctypes.byref(fs)) > 0
+        assert libc.fs_shrink(ctypes.byref(fs)) == 8
+        assert fs.s_block[0].num_blocks == 8
+        assert read(fs, "/b") == LONG_DATA * 3
+        assert check(fs) == 0
+
+        loaded = load()
+        assert loaded.s_block[0].num_blocks == 8
+        assert read(loaded, "/d") == LONG_DATA * 3
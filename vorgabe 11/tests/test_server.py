@@ -0,0 +1,109 @@
+import ctypes
+import os
+import signal
+import subprocess
+import time
+from wrappers import *
+
+SOCKET = "./temp_test_socket"
+RPC_MKDIR, RPC_MKFILE, RPC_WRITEF, RPC_READF, RPC_LIST, RPC_RM, RPC_CP, RPC_STAT, RPC_MV = range(1, 10)
+
+client = ctypes.CDLL("./build/client.so")
+cfree = ctypes.CDLL(None).free
+cfree.argtypes = [ctypes.c_void_p]
+client.fs_client_connect.restype = ctypes.c_void_p
+client.fs_client_close.argtypes = [ctypes.c_void_p]
+client.fs_client_send.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p, ctypes.c_char_p]
+client.fs_client_send.restype = ctypes.c_uint32
+client.fs_client_call.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p, ctypes.c_char_p,
+                                  ctypes.c_void_p, ctypes.c_void_p]
+client.fs_client_recv.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+client.fs_client_stat.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]
+
+class ResponseHeader(ctypes.Structure):
+    _fields_ = [("length", ctypes.c_uint32), ("id", ctypes.c_uint32), ("status", ctypes.c_int32)]
+
+class RpcStat(ctypes.Structure):
+    _fields_ = [("inode", ctypes.c_uint32), ("type", ctypes.c_uint32), ("size", ctypes.c_uint32),
+                ("blocks", ctypes.c_uint32), ("parent", ctypes.c_int32), ("nlink", ctypes.c_uint32)]
+
+def arg(s):
+    return None if s is None else bytes(s, "UTF-8")
+
+# status and payload of one request
+def rpc(c, op, arg0, arg1=None):
+    payload = ctypes.POINTER(ctypes.c_uint8)()
+    length = ctypes.c_uint32(0)
+    status = client.fs_client_call(c, op, arg(arg0), arg(arg1), ctypes.byref(payload), ctypes.byref(length))
+    data = bytes(payload[:length.value]).decode("UTF-8") if payload else ""
+    cfree(payload)
+    return status, data
+
+class Test_Server:
+    def setup_method(self):
+        assert subprocess.run(["./build/ha2", "-c", IMAGE, "64"], input="", timeout=30).returncode == 0
+        self.server = subprocess.Popen(["./build/ha2", "-l", IMAGE, "--serve", SOCKET])
+        for _ in range(300):
+            if os.path.exists(SOCKET):
+                break
+            time.sleep(0.01)
+        self.c = client.fs_client_connect(bytes(SOCKET, "UTF-8"))
+        assert self.c
+
+    # stops the server, which saves the filesystem
+    def stop(self):
+        client.fs_client_close(self.c)
+        self.c = None
+        self.server.send_signal(signal.SIGTERM)
+        return self.server.wait(timeout=30)
+
+    def teardown_method(self):
+        if self.c:
+            self.stop()
+
+    # One request after the other
+    # Expected outcome:
+    # * every operation answers with its return value and payload
+    # * the changes are in the image after a shutdown
+    def test_server_calls(self):
+        assert rpc(self.c, RPC_MKDIR, "/d") == (0, "")
+        assert rpc(self.c, RPC_MKFILE, "/d/f") == (0, "")
+        assert rpc(self.c, RPC_WRITEF, "/d/f", LONG_DATA) == (len(LONG_DATA), "")
+        assert rpc(self.c, RPC_READF, "/d/f") == (len(LONG_DATA), LONG_DATA)
+        assert rpc(self.c, RPC_READF, "/d/missing")[0] == -1
+        assert rpc(self.c, RPC_CP, "/d/f", "/g") == (0, "")
+        assert rpc(self.c, RPC_MV, "/g", "/d/h") == (0, "")
+        status, listing = rpc(self.c, RPC_LIST, "/d")
+        assert status == 0 and "f" in listing and "h" in listing
+
+        st = RpcStat()
+        assert client.fs_client_stat(self.c, b"/d/h", ctypes.byref(st)) == 0
+        assert st.type == NodeType.reg_file and st.size == len(LONG_DATA) and st.blocks == 2
+        assert client.fs_client_stat(self.c, b"/nothing", ctypes.byref(st)) == -1
+        assert rpc(self.c, RPC_RM, "/d/f") == (0, "")
+        assert self.stop() == 0
+        assert not os.path.exists(SOCKET)
+
+        fs = load()
+        assert read(fs, "/d/h") == LONG_DATA
+        assert check(fs) == 0
+
+    # Many requests sent before the first response is read
+    # Expected outcome:
+    # * the responses come back in request order with the ids of the requests
+    def test_server_pipelined(self):
+        ids = [client.fs_client_send(self.c, RPC_MKFILE, arg("/f%d" % i), None) for i in range(12)]
+        ids += [client.fs_client_send(self.c, RPC_WRITEF, arg("/f%d" % i), arg(SHORT_DATA)) for i in range(12)]
+        ids.append(client.fs_client_send(self.c, RPC_MKFILE, b"/f0", None))
+
+        h = ResponseHeader()
+        for n, expected in enumerate(ids):
+            assert client.fs_client_recv(self.c, ctypes.byref(h), None) == 0
+            assert h.id == expected
+            if n < 12:
+                assert h.status == 0
+            elif n < 24:
+                assert h.status == len(SHORT_DATA)
+            else:
+                assert h.status == -2
+        assert rpc(self.c, RPC_READF, "/f11") == (len(SHORT_DATA), SHORT_DATA)
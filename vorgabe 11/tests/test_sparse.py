@@ -0,0 +1,36 @@
+import ctypes
+import os
+from wrappers import *
+
+def on_disk():
+    return os.stat(IMAGE).st_blocks * 512
+
+class Test_Sparse:
+    # A new image holds no data yet
+    # Expected outcome:
+    # * it has its full size, but the data area takes no space on disk
+    def test_sparse_create(self):
+        fs = setup(4096)
+        assert os.path.getsize(IMAGE) > 4096 * BLOCK_SIZE
+        assert on_disk() < 4096 * BLOCK_SIZE // 2
+
+    # Files are written, dumped, removed and flushed
+    # Expected outcome:
+    # * the written blocks take space, the removed ones give it back
+    def test_sparse_punch(self):
+        fs = setup(4096)
+        empty = on_disk()
+        for d in range(8):
+            assert call(libc.fs_mkdir, fs, "/d%d" % d) == 0
+            for i in range(8):
+                path = "/d%d/f%d" % (d, i)
+                assert call(libc.fs_mkfile, fs, path) == 0
+                assert call(libc.fs_writef, fs, path, LONG_DATA * 5) == len(LONG_DATA) * 5
+        assert libc.fs_dump(ctypes.byref(fs), ctypes.c_char_p(bytes(IMAGE, "UTF-8"))) == 0
+        full = on_disk()
+        assert full >= empty + 64 * 6 * BLOCK_SIZE
+
+        for d in range(8):
+            assert call(libc.fs_rm, fs, "/d%d" % d) == 0
+        assert libc.fs_flush(ctypes.byref(fs)) == 0
+        assert on_disk() < full - 64 * 4 * BLOCK_SIZE
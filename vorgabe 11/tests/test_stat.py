@@ -0,0 +1,69 @@
+import ctypes
+from wrappers import *
+
+class StatInfo(ctypes.Structure):
+    _fields_ = [
+        ("inode", ctypes.c_int),
+        ("type", ctypes.c_int),
+        ("size", ctypes.c_uint64),
+        ("blocks", ctypes.c_uint32),
+        ("parent", ctypes.c_int),
+        ("nlink", ctypes.c_uint32)
+    ]
+
+def stat(fs, path):
+    st = StatInfo()
+    retval = libc.fs_stat(ctypes.byref(fs), ctypes.c_char_p(bytes(path, "UTF-8")), ctypes.byref(st))
+    return st if retval == 0 else None
+
+class Test_Stat:
+    # stat of a file, its hard link and a missing path
+    # Expected outcome:
+    # * type, size, blocks and parent straight from the inode
+    # * the link reports the file, nlink counts both names
+    def test_stat_file(self):
+        fs = setup(6)
+        fs = set_fil(name="file", inode=1, parent=0, parent_block=0, fs=fs)
+        fs = set_data_block_with_string(block_num=0, string_data=LONG_DATA[:1024], parent_inode=1, parent_block_num=0, fs=fs)
+        fs = set_data_block_with_string(block_num=1, string_data=LONG_DATA[1024:], parent_inode=1, parent_block_num=1, fs=fs)
+        st = stat(fs, "/file")
+        assert st.inode == 1
+        assert st.type == NodeType.reg_file
+        assert st.size == len(LONG_DATA)
+        assert st.blocks == 2
+        assert st.parent == 0
+        assert st.nlink == 1
+        assert call(libc.fs_link, fs, "/file", "/other") == 0
+        st = stat(fs, "/other")
+        assert st.inode == 1
+        assert st.nlink == 2
+        assert stat(fs, "/nope") is None
+
+    # Directory sizes once tracking is on
+    # Expected outcome:
+    # * every directory reports the bytes below it, kept up to date by
+    #   writef, cp, mv and rm
+    def test_stat_tracked_sizes(self):
+        fs = setup(32)
+        assert call(libc.fs_mkdir, fs, "/a") == 0
+        assert call(libc.fs_mkdir, fs, "/a/b") == 0
+        assert call(libc.fs_mkfile, fs, "/a/b/f") == 0
+        assert call(libc.fs_writef, fs, "/a/b/f", "12345") == 5
+        assert stat(fs, "/a").size == 0
+        assert libc.fs_track_sizes(ctypes.byref(fs)) == 0
+        assert stat(fs, "/").size == 5
+        assert stat(fs, "/a").size == 5
+        assert call(libc.fs_writef, fs, "/a/b/f", "678") == 3
+        assert stat(fs, "/a/b").size == 8
+        assert call(libc.fs_mkdir, fs, "/c") == 0
+        assert call(libc.fs_cp, fs, "/a", "/c/a") == 0
+        assert stat(fs, "/c").size == 8
+        assert stat(fs, "/").size == 16
+        assert call(libc.fs_mv, fs, "/a/b", "/c/b") == 0
+        assert stat(fs, "/a").size == 0
+        assert stat(fs, "/c").size == 16
+        assert call(libc.fs_rm, fs, "/c/a") == 0
+        assert stat(fs, "/c").size == 8
+        assert stat(fs, "/").size == 8
+        assert call(libc.fs_mkdir, fs, "/c/a") == 0
+        assert stat(fs, "/c/a").size == 0
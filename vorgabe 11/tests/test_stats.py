@@ -0,0 +1,63 @@
+import ctypes
+from wrappers import *
+
+STATS_BUCKETS = 38 << 3
+FS_OP_MKDIR, FS_OP_MKFILE, FS_OP_WRITEF, FS_OP_READF = 0, 1, 2, 3
+FS_OP_COUNT = 16
+FS_CTR_INODES_ALLOCATED, FS_CTR_INODES_FREED, FS_CTR_BLOCKS_ALLOCATED, FS_CTR_BLOCKS_FREED = 0, 1, 2, 3
+FS_CTR_BYTES_WRITTEN, FS_CTR_BYTES_READ, FS_CTR_NAME_COMPARES = 4, 5, 6
+FS_CTR_CACHE_HITS, FS_CTR_CACHE_MISSES, FS_CTR_CACHE_WRITEBACKS = 7, 8, 9
+FS_CTR_COUNT = 10
+
+class OpStats(ctypes.Structure):
+    _fields_ = [
+        ("count", ctypes.c_uint64),
+        ("errors", ctypes.c_uint64),
+        ("total_ns", ctypes.c_uint64),
+        ("hist", ctypes.c_uint64 * STATS_BUCKETS)
+    ]
+
+class Stats(ctypes.Structure):
+    _fields_ = [
+        ("ops", OpStats * FS_OP_COUNT),
+        ("counters", ctypes.c_uint64 * FS_CTR_COUNT),
+        ("reclaim_pending", ctypes.c_uint32)
+    ]
+
+def get_stats(fs):
+    st = Stats()
+    libc.fs_get_stats(ctypes.byref(fs), ctypes.byref(st))
+    return st
+
+class Test_Stats:
+    # A few operations, one of them failing
+    # Expected outcome:
+    # * counts, errors and histogram entries per operation
+    # * allocation and byte counters match what happened
+    # * everything is 0 after a reset
+    def test_stats_counts(self):
+        fs = setup(8)
+        libc.fs_reset_stats(ctypes.byref(fs))
+        assert call(libc.fs_mkdir, fs, "/d") == 0
+        assert call(libc.fs_mkfile, fs, "/d/f") == 0
+        assert call(libc.fs_mkfile, fs, "/d/f") == -2
+        assert call(libc.fs_writef, fs, "/d/f", SHORT_DATA) == len(SHORT_DATA)
+        st = get_stats(fs)
+        assert st.ops[FS_OP_MKDIR].count == 1
+        assert st.ops[FS_OP_MKFILE].count == 2
+        assert st.ops[FS_OP_MKFILE].errors == 1
+        assert sum(st.ops[FS_OP_MKFILE].hist) == 2
+        assert st.ops[FS_OP_WRITEF].count == 1
+        assert st.ops[FS_OP_READF].count == 0
+        assert st.counters[FS_CTR_INODES_ALLOCATED] == 2
+        assert st.counters[FS_CTR_BLOCKS_ALLOCATED] == 1
+        assert st.counters[FS_CTR_BYTES_WRITTEN] == len(SHORT_DATA)
+        assert st.counters[FS_CTR_NAME_COMPARES] > 0
+        assert call(libc.fs_rm, fs, "/d") == 0
+        st = get_stats(fs)
+        assert st.counters[FS_CTR_INODES_FREED] == 2
+        assert st.counters[FS_CTR_BLOCKS_FREED] == 1
+        libc.fs_reset_stats(ctypes.byref(fs))
+        st = get_stats(fs)
+        assert st.ops[FS_OP_MKFILE].count == 0
+        assert st.counters[FS_CTR_INODES_ALLOCATED] == 0
@@ -0,0 +1,86 @@
+import ctypes
+from wrappers import *
+
+FS_WALK_PRE = 1
+FS_WALK_POST = 2
+FS_WALK_SKIP = 1
+
+class WalkEntry(ctypes.Structure):
+    _fields_ = [
+        ("path", ctypes.c_char_p),
+        ("inode", ctypes.c_int),
+        ("parent", ctypes.c_int),
+        ("type", ctypes.c_int),
+        ("size", ctypes.c_uint16),
+        ("depth", ctypes.c_int),
+        ("post", ctypes.c_int)
+    ]
+
+WALK_FN = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.POINTER(WalkEntry), ctypes.c_void_p)
+
+# /a/x, /a/b/y, /z
+def make_tree():
+    fs = setup(8)
+    fs = set_dir(name="a", inode=1, parent=0, parent_block=0, fs=fs)
+    fs = set_fil(name="z", inode=2, parent=0, parent_block=1, fs=fs)
+    fs = set_fil(name="x", inode=3, parent=1, parent_block=0, fs=fs)
+    fs = set_dir(name="b", inode=4, parent=1, parent_block=1, fs=fs)
+    fs = set_fil(name="y", inode=5, parent=4, parent_block=0, fs=fs)
+    return fs
+
+def walk(fs, path, flags, max_depth, threads=1, result=None):
+    visits = []
+    def cb(e, arg):
+        visits.append((e.contents.path.decode("utf-8"), e.contents.depth, e.contents.post))
+        if result is not None:
+            return result(e.contents)
+        return 0
+    fn = WALK_FN(cb)
+    retval = libc.fs_walk_parallel(ctypes.byref(fs), bytes(path, "UTF-8"), fn, None, flags, max_depth, threads)
+    return retval, visits
+
+class Test_Walk:
+    # Pre-order walk of the whole tree
+    # Expected outcome:
+    # * parents come before children, children in inode order
+    def test_walk_pre(self):
+        fs = make_tree()
+        retval, visits = walk(fs, "/", FS_WALK_PRE, -1)
+        assert retval == 0
+        assert visits == [("/", 0, 0), ("/a", 1, 0), ("/a/x", 2, 0), ("/a/b", 2, 0),
+                          ("/a/b/y", 3, 0), ("/z", 1, 0)]
+
+    # Post-order walk with a depth limit, started below the root
+    # Expected outcome:
+    # * directories after their children, nothing below depth 1
+    def test_walk_post_depth(self):
+        fs = make_tree()
+        retval, visits = walk(fs, "/a", FS_WALK_POST, 1)
+        assert retval == 0
+        assert visits == [("/a/x", 1, 0), ("/a/b", 1, 1), ("/a", 0, 1)]
+
+    # Skipping a subtree and stopping the walk
+    # Expected outcome:
+    # * FS_WALK_SKIP leaves out /a/b/y, a negative value is returned at once
+    def test_walk_skip_stop(self):
+        fs = make_tree()
+        retval, visits = walk(fs, "/", FS_WALK_PRE, -1,
+                              result=lambda e: FS_WALK_SKIP if e.path == b"/a/b" else 0)
+        assert retval == 0
+        assert "/a/b/y" not in [v[0] for v in visits]
+        retval, visits = walk(fs, "/", FS_WALK_PRE, -1,
+                              result=lambda e: -7 if e.path == b"/a/x" else 0)
+        assert retval == -7
+        assert visits[-1][0] == "/a/x"
+        retval, visits = walk(fs, "/nope", FS_WALK_PRE, -1)
+        assert retval == -1
+
+    # Parallel walk visits the same entries, every directory after its subtree
+    def test_walk_parallel(self):
+        fs = make_tree()
+        retval, visits = walk(fs, "/", FS_WALK_PRE | FS_WALK_POST, -1, threads=4)
+        assert retval == 0
+        assert sorted(v[0] for v in visits if not v[2]) == ["/", "/a", "/a/b", "/a/b/y", "/a/x", "/z"]
+        order = [v[0] for v in visits if v[2] or v[0] in ("/z", "/a/x", "/a/b/y")]
+        assert order.index("/a/b/y") < order.index("/a/b") < order.index("/a") < order.index("/")
+        assert order.index("/z") < order.index("/")
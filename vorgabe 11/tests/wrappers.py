@@ -18,6 +18,7 @@ class NodeType(enum.IntEnum):
     reg_file = 1
     directory = 2
     free_block = 3
+    hard_link = 4
 
 # Define the data_block structure
 class DataBlock(ctypes.Structure):
@@ -32,6 +33,7 @@ class Inode(ctypes.Structure):
         ("n_type", ctypes.c_int),
         ("size", ctypes.c_uint16),
         ("name", ctypes.c_char * NAME_MAX_LENGTH),
+        ("links", ctypes.c_uint16),
         ("direct_blocks", ctypes.c_int * DIRECT_BLOCKS_COUNT),
         ("parent", ctypes.c_int)
     ]
@@ -67,6 +69,36 @@ def setup(fs_size):
     ptr = creator(ctypes.c_char_p(bytes("./mypyfiles.fs","UTF-8")),fsize)
     return ptr.contents
 
+IMAGE = "./mypyfiles.fs"
+
+# fs_readf with a raw buffer as result, tests may set libc.fs_readf.restype
+# as they like
+_readf = libc["fs_readf"]
+_readf.restype = ctypes.POINTER(ctypes.c_uint8)
+libc.fs_load.restype = ctypes.POINTER(FileSystem)
+
+# calls fn on fs with the remaining arguments as C strings
+def call(fn, fs, *args):
+    return fn(ctypes.byref(fs), *[ctypes.c_char_p(bytes(a, "UTF-8")) for a in args])
+
+# content of the file at path
+def read(fs, path):
+    size = ctypes.c_int(0)
+    buf = _readf(ctypes.byref(fs), ctypes.c_char_p(bytes(path, "UTF-8")), ctypes.byref(size))
+    return bytes(buf[:size.value]).decode("UTF-8")
+
+# number of problems fs_check finds in fs
+def check(fs):
+    return libc.fs_check(ctypes.byref(fs), 0, None)
+
+# sorted names of the entries of the directory dir_inode
+def names(fs, dir_inode):
+    return sorted(fs.inodes[i].name.decode("UTF-8") for i in fs.inodes[dir_inode].direct_blocks if i >= 0)
+
+# loads the image the tests write to
+def load():
+    return libc.fs_load(ctypes.c_char_p(bytes(IMAGE, "UTF-8"))).contents
+
 def set_dir(name: str, inode: int, parent: int, parent_block: int, fs):
     fs.inodes[inode].n_type = 2
     fs.inodes[inode].name = bytes(name,"utf-8")